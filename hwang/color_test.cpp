@@ -0,0 +1,288 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hwang/util/color.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+extern "C" {
+#include "libswscale/swscale.h"
+}
+
+namespace hwang {
+
+namespace {
+
+struct TestImage {
+  std::vector<uint8_t> y;
+  std::vector<uint8_t> u;
+  std::vector<uint8_t> v;
+  std::vector<uint8_t> uv;
+  YUV420Image planar;
+  YUV420Image nv12;
+};
+
+// Random planes with some padding at the end of each row
+TestImage make_test_image(int32_t width, int32_t height, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> byte(0, 255);
+  int32_t chroma_width = (width + 1) / 2;
+  int32_t chroma_height = (height + 1) / 2;
+  TestImage image;
+  int32_t y_stride = width + 7;
+  int32_t uv_stride = chroma_width * 2 + 5;
+  image.y.resize(y_stride * height);
+  image.u.resize(uv_stride * chroma_height);
+  image.v.resize(uv_stride * chroma_height);
+  image.uv.resize(uv_stride * chroma_height);
+  for (auto *plane : {&image.y, &image.u, &image.v}) {
+    for (uint8_t &b : *plane) {
+      b = byte(rng);
+    }
+  }
+  for (int32_t row = 0; row < chroma_height; ++row) {
+    for (int32_t x = 0; x < chroma_width; ++x) {
+      image.uv[row * uv_stride + x * 2] = image.u[row * uv_stride + x];
+      image.uv[row * uv_stride + x * 2 + 1] = image.v[row * uv_stride + x];
+    }
+  }
+  image.planar = {image.y.data(), image.u.data(), image.v.data(), y_stride,
+                  uv_stride,      1,              width,          height,
+                  ColorRange::LIMITED};
+  image.nv12 = {image.y.data(), image.uv.data(), image.uv.data() + 1,
+                y_stride,       uv_stride,       2,
+                width,          height,          ColorRange::LIMITED};
+  return image;
+}
+
+}
+
+TEST(ColorConversion, Reference) {
+  // Limited range black, white and gray
+  uint8_t y[2] = {16, 235};
+  uint8_t u[1] = {128};
+  uint8_t v[1] = {128};
+  YUV420Image image = {y, u, v, 2, 1, 1, 2, 1, ColorRange::LIMITED};
+  uint8_t rgb[6];
+  yuv420_to_rgb24(image, rgb, 6, false, SIMDLevel::SCALAR);
+  EXPECT_EQ(std::vector<uint8_t>(rgb, rgb + 6),
+            std::vector<uint8_t>({0, 0, 0, 255, 255, 255}));
+
+  image.range = ColorRange::FULL;
+  y[0] = 128;
+  yuv420_to_rgb24(image, rgb, 6, false, SIMDLevel::SCALAR);
+  EXPECT_EQ(std::vector<uint8_t>(rgb, rgb + 3),
+            std::vector<uint8_t>({128, 128, 128}));
+
+  // Pure red is R = 255 in both orders
+  y[0] = 82;
+  u[0] = 90;
+  v[0] = 240;
+  image.range = ColorRange::LIMITED;
+  yuv420_to_rgb24(image, rgb, 6, false, SIMDLevel::SCALAR);
+  EXPECT_GE(rgb[0], 250);
+  EXPECT_LE(rgb[2], 5);
+  yuv420_to_rgb24(image, rgb, 6, true, SIMDLevel::SCALAR);
+  EXPECT_LE(rgb[0], 5);
+  EXPECT_GE(rgb[2], 250);
+}
+
+TEST(ColorConversion, SIMDMatchesScalar) {
+  // Odd sizes exercise the scalar tails and the last chroma row and column
+  std::vector<std::pair<int32_t, int32_t>> sizes = {
+      {64, 4}, {127, 5}, {1, 1}, {33, 3}, {1920, 8}};
+  for (auto size : sizes) {
+    TestImage image = make_test_image(size.first, size.second, size.first);
+    int32_t stride = size.first * 3;
+    std::vector<uint8_t> expected(stride * size.second);
+    std::vector<uint8_t> actual(stride * size.second);
+    for (YUV420Image yuv : {image.planar, image.nv12}) {
+      for (ColorRange range : {ColorRange::LIMITED, ColorRange::FULL}) {
+        yuv.range = range;
+        for (bool bgr : {false, true}) {
+          yuv420_to_rgb24(yuv, expected.data(), stride, bgr,
+                          SIMDLevel::SCALAR);
+          for (SIMDLevel level :
+               {SIMDLevel::SSE41, SIMDLevel::AVX2, SIMDLevel::AVX512}) {
+            if (level > best_simd_level()) {
+              continue;
+            }
+            std::fill(actual.begin(), actual.end(), 0);
+            yuv420_to_rgb24(yuv, actual.data(), stride, bgr, level);
+            ASSERT_EQ(actual, expected)
+                << size.first << "x" << size.second << " level "
+                << (int)level << " uv_step " << yuv.uv_step << " range "
+                << (int)range << " bgr " << bgr;
+          }
+        }
+      }
+    }
+  }
+}
+
+TEST(ColorConversion, MatchesSwscale) {
+  // At the same even height sws_scale converts 4:2:0 to RGB without
+  // interpolating chroma, so only rounding differs. Widths are multiples of
+  // 16 because some versions leave the pixels after the last block of 16
+  // unwritten.
+  std::vector<std::pair<int32_t, int32_t>> sizes = {
+      {64, 32}, {32, 2}, {1280, 720}, {1920, 1080}};
+  for (auto size : sizes) {
+    int32_t width = size.first;
+    int32_t height = size.second;
+    TestImage image = make_test_image(width, height, width);
+    for (ColorRange range : {ColorRange::LIMITED, ColorRange::FULL}) {
+      YUV420Image yuv = image.planar;
+      yuv.range = range;
+      std::vector<uint8_t> actual(width * height * 3);
+      yuv420_to_rgb24(yuv, actual.data(), width * 3);
+
+      SwsContext *sws_context = sws_getContext(
+          width, height,
+          range == ColorRange::FULL ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P,
+          width, height, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+      ASSERT_NE(sws_context, nullptr);
+      const uint8_t *planes[4] = {yuv.y, yuv.u, yuv.v, nullptr};
+      int linesizes[4] = {yuv.y_stride, yuv.uv_stride, yuv.uv_stride, 0};
+      std::vector<uint8_t> expected(width * height * 3);
+      uint8_t *out_planes[4] = {expected.data(), nullptr, nullptr, nullptr};
+      int out_linesizes[4] = {width * 3, 0, 0, 0};
+      sws_scale(sws_context, planes, linesizes, 0, height, out_planes,
+                out_linesizes);
+      sws_freeContext(sws_context);
+
+      int max_difference = 0;
+      for (size_t i = 0; i < actual.size(); ++i) {
+        max_difference =
+            std::max(max_difference, std::abs(actual[i] - expected[i]));
+      }
+      EXPECT_LE(max_difference, 3)
+          << width << "x" << height << " range " << (int)range;
+    }
+  }
+}
+
+TEST(ColorConversion, ParallelMatchesSerial) {
+  ThreadPool pool(3);
+  for (int32_t height : {1, 63, 130, 257, 1080}) {
+    TestImage image = make_test_image(97, height, height);
+    int32_t stride = 97 * 3;
+    std::vector<uint8_t> expected(stride * height);
+    std::vector<uint8_t> actual(stride * height);
+    for (YUV420Image yuv : {image.planar, image.nv12}) {
+      yuv420_to_rgb24(yuv, expected.data(), stride);
+      std::fill(actual.begin(), actual.end(), 0);
+      yuv420_to_rgb24(yuv, actual.data(), stride, false, pool);
+      ASSERT_EQ(actual, expected) << "height " << height;
+    }
+  }
+}
+
+TEST(ColorConversion, RotatePlane) {
+  // 3x2 image of 2 byte elements, rows padded to 8 bytes
+  const uint8_t src[16] = {1, 1, 2, 2, 3, 3, 0, 0,
+                           4, 4, 5, 5, 6, 6, 0, 0};
+  std::vector<uint8_t> dst(12);
+  rotate_plane(src, 8, 3, 2, 2, 90, dst.data(), 4);
+  EXPECT_EQ(dst, std::vector<uint8_t>({4, 4, 1, 1, 5, 5, 2, 2, 6, 6, 3, 3}));
+  rotate_plane(src, 8, 3, 2, 2, 180, dst.data(), 6);
+  EXPECT_EQ(dst, std::vector<uint8_t>({6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1}));
+  rotate_plane(src, 8, 3, 2, 2, 270, dst.data(), 4);
+  EXPECT_EQ(dst, std::vector<uint8_t>({3, 3, 6, 6, 2, 2, 5, 5, 1, 1, 4, 4}));
+
+  // Four quarter turns of an image larger than a tile are the identity
+  const int32_t width = 70;
+  const int32_t height = 45;
+  std::vector<uint8_t> image(width * height * 3);
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = i * 7;
+  }
+  std::vector<uint8_t> a = image;
+  std::vector<uint8_t> b(image.size());
+  for (int32_t turn = 0; turn < 4; ++turn) {
+    int32_t w = turn % 2 == 0 ? width : height;
+    int32_t h = turn % 2 == 0 ? height : width;
+    rotate_plane(a.data(), w * 3, w, h, 3, 90, b.data(), h * 3);
+    std::swap(a, b);
+  }
+  EXPECT_EQ(a, image);
+}
+
+// Prints timings, run with --gtest_also_run_disabled_tests
+TEST(ColorConversion, DISABLED_Benchmark) {
+  std::vector<std::pair<int32_t, int32_t>> sizes = {
+      {1280, 720}, {1920, 1080}, {3840, 2160}};
+  const int32_t iterations = 20;
+  for (auto size : sizes) {
+    int32_t width = size.first;
+    int32_t height = size.second;
+    TestImage image = make_test_image(width, height, 0);
+    std::vector<uint8_t> rgb(width * height * 3);
+
+    auto time = [&](const std::function<void()> &convert) {
+      convert();
+      auto start = std::chrono::steady_clock::now();
+      for (int32_t i = 0; i < iterations; ++i) {
+        convert();
+      }
+      return std::chrono::duration<double, std::milli>(
+                 std::chrono::steady_clock::now() - start)
+                 .count() /
+             iterations;
+    };
+
+    // What SoftwareVideoDecoder used for every frame
+    SwsContext *sws_context = sws_getContext(
+        width, height, AV_PIX_FMT_YUV420P, width, height, AV_PIX_FMT_RGB24,
+        SWS_BICUBIC, NULL, NULL, NULL);
+    ASSERT_NE(sws_context, nullptr);
+    const uint8_t *planes[4] = {image.y.data(), image.u.data(),
+                                image.v.data(), nullptr};
+    int linesizes[4] = {image.planar.y_stride, image.planar.uv_stride,
+                        image.planar.uv_stride, 0};
+    uint8_t *out_planes[4] = {rgb.data(), nullptr, nullptr, nullptr};
+    int out_linesizes[4] = {width * 3, 0, 0, 0};
+    double sws_ms = time([&] {
+      sws_scale(sws_context, planes, linesizes, 0, height, out_planes,
+                out_linesizes);
+    });
+    sws_freeContext(sws_context);
+    printf("%dx%d sws_scale: %.3f ms/frame\n", width, height, sws_ms);
+
+    const char *names[] = {"scalar", "sse4.1", "avx2", "avx512"};
+    for (SIMDLevel level : {SIMDLevel::SCALAR, SIMDLevel::SSE41,
+                            SIMDLevel::AVX2, SIMDLevel::AVX512}) {
+      if (level > best_simd_level()) {
+        continue;
+      }
+      double ms = time([&] {
+        yuv420_to_rgb24(image.planar, rgb.data(), width * 3, false, level);
+      });
+      printf("%dx%d %s: %.3f ms/frame (%.1fx sws_scale)\n", width, height,
+             names[(int)level], ms, sws_ms / ms);
+    }
+    ThreadPool &pool = color_conversion_pool();
+    double parallel_ms = time([&] {
+      yuv420_to_rgb24(image.planar, rgb.data(), width * 3, false, pool);
+    });
+    printf("%dx%d %d threads: %.3f ms/frame (%.1fx sws_scale)\n", width,
+           height, pool.num_workers() + 1, parallel_ms, sws_ms / parallel_ms);
+  }
+}
+
+}
@@ -17,6 +17,7 @@
 
 #include "hwang/util/h264.h"
 
+#include <algorithm>
 #include <thread>
 #include <cassert>
 
@@ -36,7 +37,10 @@ DecoderAutomata::DecoderAutomata(DeviceHandle device_handle,
       decoder_type_(decoder_type),
       decoder_(decoder),
       feeder_waiting_(false), not_done_(true), frames_retrieved_(0),
-      skip_frames_(false) {
+      frames_to_get_(0), skip_frames_(false), drop_non_ref_frames_(false),
+      feeder_frames_sent_(0), frames_received_(0),
+      frames_fed_(0), frames_skipped_(0), frames_decoded_(0), frames_used_(0),
+      warm_initializations_(0), segments_continued_(0) {
   feeder_thread_ = std::thread(&DecoderAutomata::feeder, this);
   result_set_ = false;
 }
@@ -56,6 +60,7 @@ DecoderAutomata::~DecoderAutomata() {
   {
     frames_to_get_ = 0;
     frames_retrieved_ = 0;
+    decoder_->notify_waiters();
     while (decoder_->decoded_frames_buffered() > 0) {
       decoder_->discard_frame();
     }
@@ -73,34 +78,91 @@ DecoderAutomata::~DecoderAutomata() {
     feeder_waiting_ = false;
   }
 
-  wake_feeder_.notify_one();
+  wake_feeder_.notify_all();
   feeder_thread_.join();
 }
 
 Result DecoderAutomata::initialize(const std::vector<EncodedData> &encoded_data,
-                                 const std::vector<uint8_t> &extradata) {
+                                 const std::vector<uint8_t> &extradata,
+                                 PixelFormat output_format,
+                                 const FrameGeometry &geometry,
+                                 DecodeQuality quality) {
+  return initialize(std::vector<EncodedData>(encoded_data), extradata,
+                    output_format, geometry, quality);
+}
+
+Result DecoderAutomata::initialize(std::vector<EncodedData> &&encoded_data,
+                                   const std::vector<uint8_t> &extradata,
+                                   PixelFormat output_format,
+                                   const FrameGeometry &geometry,
+                                   DecodeQuality quality) {
   assert(!encoded_data.empty());
-  while (decoder_->decoded_frames_buffered() > 0) {
-    HWANG_RETURN_ON_ERROR(decoder_->discard_frame());
-  }
+  // Checked here so that a bad geometry does not discard the current state.
+  // The decoder resolves it again for the resolution it decodes at.
+  FrameGeometry resolved;
+  HWANG_RETURN_ON_ERROR(resolve_geometry(geometry, encoded_data[0].width,
+                                         encoded_data[0].height, resolved));
 
   std::unique_lock<std::mutex> lk(feeder_mutex_);
   wake_feeder_.wait(lk, [this] { return feeder_waiting_.load(); });
 
-  encoded_data_ = encoded_data;
-  frame_size_ = encoded_data[0].width * encoded_data[0].height * 3;
-  current_frame_ = encoded_data[0].start_keyframe;
-  next_frame_.store(encoded_data[0].valid_frames[0], std::memory_order_release);
+  if (try_warm_initialize(encoded_data, extradata, output_format, geometry,
+                          quality)) {
+    warm_initializations_++;
+    return Result();
+  }
+
+  while (decoder_->decoded_frames_buffered() > 0) {
+    HWANG_RETURN_ON_ERROR(decoder_->discard_frame());
+  }
+
+  encoded_data_ = std::move(encoded_data);
+  current_frame_ = encoded_data_[0].start_keyframe;
+  next_frame_.store(encoded_data_[0].valid_frames[0],
+                    std::memory_order_release);
   retriever_data_idx_.store(0, std::memory_order_release);
   retriever_valid_idx_ = 0;
 
   VideoDecoderInterface::FrameInfo info;
-  info.height = encoded_data[0].height;
-  info.width = encoded_data[0].width;
-  info.format = encoded_data[0].format;
+  info.height = encoded_data_[0].height;
+  info.width = encoded_data_[0].width;
+  info.format = encoded_data_[0].format;
+  info.output_format = output_format;
+  info.geometry = geometry;
+  info.quality = quality;
+  info.threading = threading_;
+  info.huge_pages = huge_pages_;
+  if (info.threading.mode == ThreadingMode::AUTO &&
+      auto_threading_mode_ == ThreadingMode::AUTO) {
+    // Frame threading has to refill its pipeline at the start of every
+    // interval, which is only worth it when intervals are long
+    int64_t samples = 0;
+    for (const EncodedData &data : encoded_data_) {
+      samples += data.sample_sizes.size();
+    }
+    auto_threading_mode_ =
+        samples >= FRAME_THREADING_MIN_SAMPLES * (int64_t)encoded_data_.size()
+            ? ThreadingMode::FRAME
+            : ThreadingMode::SLICE;
+  }
+  if (info.threading.mode == ThreadingMode::AUTO) {
+    info.threading.mode = auto_threading_mode_;
+  }
 
   // printf("extradata size %lu\n", extradata.size());
   HWANG_RETURN_ON_ERROR(decoder_->configure(info, extradata))
+  decoder_->get_output_size(output_width_, output_height_);
+  frame_size_ = frame_buffer_size(output_format, output_width_, output_height_);
+
+  // Dropping frames requires parsing slice headers which we only support for
+  // mp4 encapsulated H.264
+  bool is_avc = (info.format == "avc1" || info.format == "h264") &&
+                parse_avcc(extradata.data(), extradata.size(), avc_config_);
+  drop_non_ref_frames_ = skip_non_ref_frames_ && is_avc;
+  {
+    std::unique_lock<std::mutex> lk(dropped_frames_mutex_);
+    dropped_frames_.clear();
+  }
 
   if (frames_retrieved_ > 0) {
     HWANG_RETURN_ON_ERROR(decoder_->flush());
@@ -108,18 +170,209 @@ Result DecoderAutomata::initialize(const std::vector<EncodedData> &encoded_data,
       HWANG_RETURN_ON_ERROR(decoder_->discard_frame());
     }
   }
+  feeder_frames_sent_ = 0;
+  frames_received_ = 0;
+  {
+    std::unique_lock<std::mutex> lk(boundaries_mutex_);
+    segment_boundaries_.clear();
+  }
+
+  // Needed to find IDR frames at the start of segments
+  nal_length_size_ = 0;
+  bool is_hevc = (info.format == "h265" || info.format == "hev1" ||
+                  info.format == "hvc1" || info.format == "hevc");
+  if (is_avc) {
+    nal_length_size_ = avc_config_.nal_length_size;
+  } else if (is_hevc && extradata.size() > 21) {
+    // lengthSizeMinusOne in the HEVCDecoderConfigurationRecord
+    nal_length_size_ = (extradata[21] & 0x3) + 1;
+  }
+  is_hevc_ = is_hevc;
 
   set_feeder_idx(0);
   info_ = info;
+  extradata_ = extradata;
   std::atomic_thread_fence(std::memory_order_release);
   seeking_ = false;
 
   return Result();
 }
 
+Result DecoderAutomata::discard_output() {
+  HWANG_RETURN_ON_ERROR(decoder_->discard_frame());
+  frames_received_++;
+  return Result();
+}
+
+bool DecoderAutomata::can_continue_without_flush(int32_t data_idx) {
+  if (!continue_segments_ || data_idx <= 0 ||
+      data_idx >= encoded_data_.size() || nal_length_size_ == 0) {
+    return false;
+  }
+  const EncodedData &prev = encoded_data_[data_idx - 1];
+  const EncodedData &next = encoded_data_[data_idx];
+  // Frame numbers must keep increasing so dropped frames can be tracked
+  if (next.start_keyframe < prev.end_keyframe) {
+    return false;
+  }
+  // Only an IDR frame guarantees no frame of the next segment references
+  // frames from the previous one
+  size_t sample_idx = next.keyframes.at(0) - next.start_keyframe;
+  const uint8_t *sample = next.video_data() + next.sample_offsets.at(sample_idx);
+  size_t size = next.sample_sizes.at(sample_idx);
+  size_t offset = 0;
+  while (offset + nal_length_size_ <= size) {
+    uint64_t nal_size = 0;
+    for (int32_t i = 0; i < nal_length_size_; ++i) {
+      nal_size = (nal_size << 8) | sample[offset + i];
+    }
+    offset += nal_length_size_;
+    if (nal_size == 0 || offset + nal_size > size) {
+      return false;
+    }
+    if (is_hevc_) {
+      int32_t nal_unit_type = (sample[offset] >> 1) & 0x3F;
+      if (nal_unit_type < 32) {
+        // IDR_W_RADL or IDR_N_LP
+        return nal_unit_type == 19 || nal_unit_type == 20;
+      }
+    } else {
+      int32_t nal_unit_type = get_nal_unit_type(sample + offset);
+      if (is_vcl_nal(nal_unit_type)) {
+        return nal_unit_type == 5;
+      }
+    }
+    offset += nal_size;
+  }
+  return false;
+}
+
+bool DecoderAutomata::try_warm_initialize(
+    std::vector<EncodedData> &encoded_data,
+    const std::vector<uint8_t> &extradata, PixelFormat output_format,
+    const FrameGeometry &geometry, DecodeQuality quality) {
+  // The previous request must have been fully retrieved and the feeder must
+  // not have reached the end of its last interval, which flushes the decoder
+  if (encoded_data_.empty() || result_set_ || seeking_ ||
+      frames_retrieved_ == 0 || frames_retrieved_ != frames_to_get_ ||
+      retriever_data_idx_ != encoded_data_.size() ||
+      feeder_data_idx_ != encoded_data_.size() - 1) {
+    return false;
+  }
+  const EncodedData &prev = encoded_data_.back();
+  const EncodedData &next = encoded_data[0];
+  if (next.format != info_.format || next.width != info_.width ||
+      next.height != info_.height || output_format != info_.output_format ||
+      geometry != info_.geometry || quality != info_.quality ||
+      extradata != extradata_) {
+    return false;
+  }
+
+  // The retriever labels decoder output starting at current_frame_ and the
+  // feeder continues with sample feeder_frame
+  int64_t feeder_frame = feeder_current_frame_;
+  int64_t first_frame = next.valid_frames.at(0);
+  if ((int64_t)next.start_keyframe > current_frame_ ||
+      first_frame < current_frame_ ||
+      feeder_frame < (int64_t)next.start_keyframe ||
+      feeder_frame > (int64_t)next.end_keyframe) {
+    return false;
+  }
+  // Seeking is cheaper than decoding up to a later GOP
+  for (uint64_t keyframe : next.keyframes) {
+    if ((int64_t)keyframe > feeder_frame && (int64_t)keyframe <= first_frame) {
+      return false;
+    }
+  }
+  // Make sure the samples already fed are from the same video
+  int64_t overlap_start = std::max(next.start_keyframe, prev.start_keyframe);
+  for (int64_t i = overlap_start; i < feeder_frame; ++i) {
+    if (next.sample_sizes.at(i - next.start_keyframe) !=
+        prev.sample_sizes.at(i - prev.start_keyframe)) {
+      return false;
+    }
+  }
+
+  // Samples that have not been fed yet no longer need to be dropped, but
+  // frames that were already dropped can not be returned
+  std::vector<int64_t> undropped;
+  for (size_t i = 0; i < feeder_gop_drops_.size(); ++i) {
+    if (feeder_gop_start_ + (int64_t)i >= feeder_frame &&
+        feeder_gop_drops_[i] >= 0) {
+      undropped.push_back(feeder_gop_drops_[i]);
+    }
+  }
+  std::sort(undropped.begin(), undropped.end());
+  std::deque<int64_t> dropped;
+  {
+    std::unique_lock<std::mutex> lk(dropped_frames_mutex_);
+    for (int64_t frame : dropped_frames_) {
+      if (frame >= current_frame_ &&
+          !std::binary_search(undropped.begin(), undropped.end(), frame)) {
+        if (std::binary_search(next.valid_frames.begin(),
+                               next.valid_frames.end(), (uint64_t)frame)) {
+          return false;
+        }
+        dropped.push_back(frame);
+      }
+    }
+    dropped_frames_ = dropped;
+  }
+  for (size_t i = 0; i < feeder_gop_drops_.size(); ++i) {
+    if (feeder_gop_start_ + (int64_t)i >= feeder_frame) {
+      feeder_gop_drops_[i] = -1;
+    }
+  }
+
+  encoded_data_ = std::move(encoded_data);
+  const EncodedData &data = encoded_data_[0];
+  retriever_data_idx_ = 0;
+  retriever_valid_idx_ = 0;
+  next_frame_.store(data.valid_frames[0], std::memory_order_release);
+
+  feeder_data_idx_ = 0;
+  auto valid_it = std::lower_bound(data.valid_frames.begin(),
+                                   data.valid_frames.end(), feeder_frame);
+  feeder_valid_idx_ = valid_it - data.valid_frames.begin();
+  feeder_next_frame_ = (valid_it != data.valid_frames.end()) ? *valid_it : -1;
+  auto keyframe_it = std::lower_bound(data.keyframes.begin(),
+                                      data.keyframes.end(), feeder_frame);
+  feeder_next_keyframe_idx_ = keyframe_it - data.keyframes.begin();
+  feeder_next_keyframe_ =
+      (keyframe_it != data.keyframes.end()) ? *keyframe_it : -1;
+  feeder_buffer_offset_ =
+      (feeder_frame < (int64_t)data.end_keyframe)
+          ? data.sample_offsets.at(feeder_frame - data.start_keyframe)
+          : data.video_size();
+  std::atomic_thread_fence(std::memory_order_release);
+  return true;
+}
+
 Result DecoderAutomata::get_frames(uint8_t *buffer, int32_t num_frames) {
+  HWANG_RETURN_ON_ERROR(begin_frames(num_frames));
+  for (int32_t i = 0; i < num_frames; ++i) {
+    HWANG_RETURN_ON_ERROR(next_frame(buffer + i * frame_size_));
+  }
+  return Result();
+}
+
+Result DecoderAutomata::get_frames(int32_t num_frames, const FrameSink &sink) {
+  stream_buffers_.resize(STREAM_BUFFERS);
+  for (auto &stream_buffer : stream_buffers_) {
+    stream_buffer.resize(frame_size_);
+  }
+  HWANG_RETURN_ON_ERROR(begin_frames(num_frames));
+  for (int32_t i = 0; i < num_frames; ++i) {
+    uint8_t *buffer = stream_buffers_[i % STREAM_BUFFERS].data();
+    int64_t frame_number;
+    HWANG_RETURN_ON_ERROR(next_frame(buffer, &frame_number));
+    HWANG_RETURN_ON_ERROR(sink(frame_number, buffer));
+  }
+  return Result();
+}
+
+Result DecoderAutomata::begin_frames(int32_t num_frames) {
   int64_t total_frames_decoded = 0;
-  int64_t total_frames_used = 0;
 
   auto start = now();
 
@@ -136,15 +389,16 @@ Result DecoderAutomata::get_frames(uint8_t *buffer, int32_t num_frames) {
   // we have exhausted this decode args group
   if (encoded_data_.size() > retriever_data_idx_) {
     const auto &valid_frames = encoded_data_[retriever_data_idx_].valid_frames;
-    // If we are at the end of a segment or if the retriever and the feeder
-    // are working on the same segment
+    // If we are at the end of a segment, if the retriever and the feeder
+    // are working on the same segment or if the feeder continued into the
+    // next segment without flushing
     if (retriever_valid_idx_ == valid_frames.size() ||
-        retriever_data_idx_ == feeder_data_idx_) {
+        retriever_data_idx_ == feeder_data_idx_ || !seeking_) {
       // Make sure to not feed seek packet if we reached end of stream
       if (encoded_data_.size() > feeder_data_idx_) {
         if (seeking_) {
           while (decoder_->decoded_frames_buffered() > 0) {
-            decoder_->discard_frame();
+            HWANG_RETURN_ON_ERROR(discard_output());
             total_frames_decoded++;
           }
           seeking_ = false;
@@ -156,30 +410,52 @@ Result DecoderAutomata::get_frames(uint8_t *buffer, int32_t num_frames) {
         std::unique_lock<std::mutex> lk(feeder_mutex_);
         feeder_waiting_ = false;
       }
-      wake_feeder_.notify_one();
+      wake_feeder_.notify_all();
     }
   }
+  frames_decoded_ += total_frames_decoded;
 
   // if (profiler_) {
   //   profiler_->add_interval("get_frames_wait", start, now());
   // }
 
-  while (frames_retrieved_ < frames_to_get_) {
+  return Result();
+}
+
+Result DecoderAutomata::next_frame(uint8_t *buffer, int64_t *frame_number) {
+  if (frames_retrieved_ >= frames_to_get_) {
+    return Result(false, "next_frame called after all requested frames were "
+                         "retrieved");
+  }
+
+  int64_t total_frames_decoded = 0;
+  int64_t total_frames_used = 0;
+
+  bool retrieved_frame = false;
+  while (!retrieved_frame) {
+    // Sleep until the feeder has produced a frame or hit an error
+    decoder_->wait_until_frames_buffered(
+        1, [this] { return result_set_.load(); });
     if (result_set_.load()) {
       HWANG_RETURN_ON_ERROR(feeder_result_);
     }
     if (decoder_->decoded_frames_buffered() > 0) {
-      auto iter = now();
       // New frames
       bool more_frames = true;
-      while (more_frames && frames_retrieved_ < frames_to_get_) {
+      while (more_frames && !retrieved_frame) {
         const auto &valid_frames =
             encoded_data_[retriever_data_idx_].valid_frames;
+        // Account for frames the feeder did not send to the decoder
+        current_frame_ = skip_dropped_frames(current_frame_);
         assert(valid_frames.size() > retriever_valid_idx_.load());
         assert(current_frame_ <= valid_frames.at(retriever_valid_idx_));
         if (current_frame_ == valid_frames.at(retriever_valid_idx_)) {
-          uint8_t *decoded_buffer = buffer + frames_retrieved_ * frame_size_;
-          HWANG_RETURN_ON_ERROR(decoder_->get_frame(decoded_buffer, frame_size_));
+          HWANG_RETURN_ON_ERROR(decoder_->get_frame(buffer, frame_size_));
+          frames_received_++;
+          if (frame_number != nullptr) {
+            *frame_number = current_frame_;
+          }
+          retrieved_frame = true;
           more_frames = (decoder_->decoded_frames_buffered() > 0);
           retriever_valid_idx_++;
           if (retriever_valid_idx_ == valid_frames.size()) {
@@ -190,35 +466,74 @@ Result DecoderAutomata::get_frames(uint8_t *buffer, int32_t num_frames) {
             // Trigger feeder to start again and set ourselves to the
             // start of that keyframe
             if (retriever_data_idx_ < encoded_data_.size()) {
-              {
-                // Wait until feeder is waiting
-                // skip_frames_ = true;
-                std::unique_lock<std::mutex> lk(feeder_mutex_);
-                wake_feeder_.wait(lk, [this, &total_frames_decoded] {
-                  while (decoder_->decoded_frames_buffered() > 0) {
-                    decoder_->discard_frame();
-                    total_frames_decoded++;
+              // Discard the frames the feeder decodes past the last valid
+              // frame of this segment. The feeder either flushes and waits
+              // at the end of the segment or continues into the next one and
+              // records how many frames it had sent before doing so.
+              // skip_frames_ = true;
+              bool continued = false;
+              while (true) {
+                int64_t frames_sent = feeder_frames_sent_;
+                int64_t boundary = -1;
+                {
+                  std::unique_lock<std::mutex> lk(boundaries_mutex_);
+                  if (!segment_boundaries_.empty()) {
+                    boundary = segment_boundaries_.front();
                   }
-                  return feeder_waiting_.load();
-                });
-                // skip_frames_ = false;
-              }
-
-              if (seeking_) {
-                while (decoder_->decoded_frames_buffered() > 0) {
-                  decoder_->discard_frame();
+                }
+                int64_t last_frame = (boundary >= 0) ? boundary : frames_sent;
+                while (frames_received_ < last_frame &&
+                       decoder_->decoded_frames_buffered() > 0) {
+                  HWANG_RETURN_ON_ERROR(discard_output());
                   total_frames_decoded++;
                 }
-                seeking_ = false;
+                if (boundary >= 0 && frames_received_ == boundary) {
+                  std::unique_lock<std::mutex> lk(boundaries_mutex_);
+                  segment_boundaries_.pop_front();
+                  continued = true;
+                  break;
+                }
+                if (boundary < 0 && feeder_waiting_.load()) {
+                  break;
+                }
+                decoder_->wait_until_frames_buffered(1, [this, boundary] {
+                  if (feeder_waiting_.load()) {
+                    return true;
+                  }
+                  std::unique_lock<std::mutex> lk(boundaries_mutex_);
+                  return boundary < 0 && !segment_boundaries_.empty();
+                });
               }
+              // skip_frames_ = false;
 
-              {
-                std::unique_lock<std::mutex> lk(feeder_mutex_);
-                feeder_waiting_ = false;
+              if (continued) {
+                // The feeder is already decoding this segment
                 current_frame_ =
                     encoded_data_[retriever_data_idx_].keyframes[0] - 1;
+              } else {
+                if (seeking_) {
+                  while (decoder_->decoded_frames_buffered() > 0) {
+                    HWANG_RETURN_ON_ERROR(discard_output());
+                    total_frames_decoded++;
+                  }
+                  seeking_ = false;
+                }
+                // The decoder was drained so every frame sent has been
+                // received, even if the decoder dropped some of them
+                frames_received_ = feeder_frames_sent_.load();
+
+                {
+                  std::unique_lock<std::mutex> lk(feeder_mutex_);
+                  feeder_waiting_ = false;
+                  current_frame_ =
+                      encoded_data_[retriever_data_idx_].keyframes[0] - 1;
+                }
+                {
+                  std::unique_lock<std::mutex> lk(dropped_frames_mutex_);
+                  dropped_frames_.clear();
+                }
+                wake_feeder_.notify_all();
               }
-              wake_feeder_.notify_one();
               more_frames = false;
             } else {
               assert(frames_retrieved_ + 1 == frames_to_get_);
@@ -232,21 +547,23 @@ Result DecoderAutomata::get_frames(uint8_t *buffer, int32_t num_frames) {
           total_frames_used++;
           frames_retrieved_++;
         } else {
-          HWANG_RETURN_ON_ERROR(decoder_->discard_frame());
+          HWANG_RETURN_ON_ERROR(discard_output());
           more_frames = (decoder_->decoded_frames_buffered() > 0);
         }
         current_frame_++;
         total_frames_decoded++;
       }
-    } 
-    std::this_thread::yield();
+    }
+  }
+  frames_decoded_ += total_frames_decoded;
+  frames_used_ += total_frames_used;
+
+  if (frames_retrieved_ == frames_to_get_) {
+    // The feeder may be blocked waiting for buffer space which will not free
+    // up now that all requested frames have been retrieved
+    decoder_->notify_waiters();
   }
   HWANG_RETURN_ON_ERROR(decoder_->wait_until_frames_copied());
-  // if (profiler_) {
-  //   profiler_->add_interval("get_frames", start, now());
-  //   profiler_->increment("frames_used", total_frames_used);
-  //   profiler_->increment("frames_decoded", total_frames_decoded);
-  // }
 
   return Result();
 }
@@ -266,7 +583,9 @@ void DecoderAutomata::feeder() {
       std::unique_lock<std::mutex> lk(feeder_mutex_);
       feeder_waiting_ = true;
     }
-    wake_feeder_.notify_one();
+    wake_feeder_.notify_all();
+    // The retriever may be blocked on the decoder waiting for frames
+    decoder_->notify_waiters();
 
     {
       std::unique_lock<std::mutex> lk(feeder_mutex_);
@@ -285,11 +604,12 @@ void DecoderAutomata::feeder() {
     frames_fed = 0;
     bool seen_metadata = false;
     while (frames_retrieved_ < frames_to_get_) {
-      int32_t frames_to_wait = 8;
-      while (frames_retrieved_ < frames_to_get_ &&
-             decoder_->decoded_frames_buffered() > frames_to_wait) {
-        wake_feeder_.notify_one();
-        std::this_thread::yield();
+      // Sleep until the retriever has drained the decoder output
+      decoder_->wait_until_space_available(MAX_BUFFERED_FRAMES, [this] {
+        return frames_retrieved_ >= frames_to_get_;
+      });
+      if (frames_retrieved_ >= frames_to_get_) {
+        break;
       }
       if (skip_frames_) {
         seen_metadata = false;
@@ -300,9 +620,8 @@ void DecoderAutomata::feeder() {
       frames_fed++;
 
       int32_t fdi = feeder_data_idx_.load(std::memory_order_acquire);
-      const uint8_t *encoded_buffer =
-          (const uint8_t *)encoded_data_[fdi].encoded_video.data();
-      size_t encoded_buffer_size = encoded_data_[fdi].encoded_video.size();
+      const uint8_t *encoded_buffer = encoded_data_[fdi].video_data();
+      size_t encoded_buffer_size = encoded_data_[fdi].video_size();
       int32_t encoded_packet_size = 0;
       const uint8_t *encoded_packet = NULL;
       bool is_keyframe = false;
@@ -356,14 +675,48 @@ void DecoderAutomata::feeder() {
       //   }
       // }
 
-      Result result = decoder_->feed(encoded_packet, encoded_packet_size,
-                                     is_keyframe);
-      if (!result.ok) {
-        result_set_ = true;
-        feeder_result_ = result;
+      if (encoded_packet_size == 0 && can_continue_without_flush(fdi + 1)) {
+        // Feed the next segment's IDR frame straight into the decoder. The
+        // retriever uses the number of frames sent so far to tell where the
+        // next segment's frames start.
+        {
+          std::unique_lock<std::mutex> lk(boundaries_mutex_);
+          segment_boundaries_.push_back(feeder_frames_sent_);
+        }
+        decoder_->notify_waiters();
+        set_feeder_idx(fdi + 1);
+        segments_continued_++;
         continue;
       }
-      fprintf(stderr, "feeder current frame %d\n", feeder_current_frame_.load());
+
+      bool drop_frame = false;
+      if (encoded_packet_size > 0) {
+        if (is_keyframe) {
+          plan_gop_drops(fdi, feeder_current_frame_);
+        }
+        int64_t gop_idx = feeder_current_frame_ - feeder_gop_start_;
+        drop_frame = gop_idx >= 0 && gop_idx < feeder_gop_drops_.size() &&
+                     feeder_gop_drops_[gop_idx] >= 0;
+      }
+
+      if (drop_frame) {
+        frames_skipped_++;
+      } else {
+        if (encoded_packet_size > 0) {
+          // Counted before feeding so the frame is accounted for by the time
+          // the retriever sees it
+          feeder_frames_sent_++;
+        }
+        Result result = decoder_->feed(encoded_packet, encoded_packet_size,
+                                       is_keyframe);
+        if (!result.ok) {
+          set_feeder_result(result);
+          continue;
+        }
+        if (encoded_packet_size > 0) {
+          frames_fed_++;
+        }
+      }
 
       if (feeder_current_frame_ == feeder_next_frame_) {
         feeder_valid_idx_++;
@@ -386,8 +739,7 @@ void DecoderAutomata::feeder() {
         // of the decoder and wait before moving onto the next segment
         Result result = decoder_->flush();
         if (!result.ok) {
-          result_set_ = true;
-          feeder_result_ = result;
+          set_feeder_result(result);
           continue;
         }
 
@@ -398,15 +750,138 @@ void DecoderAutomata::feeder() {
       } else {
         seen_metadata = true;
       }
-      std::this_thread::yield();
     }
   }
 }
 
+void DecoderAutomata::set_feeder_result(const Result &result) {
+  feeder_result_ = result;
+  result_set_ = true;
+  // Wake up the retriever so it can report the error
+  decoder_->notify_waiters();
+}
+
+void DecoderAutomata::plan_gop_drops(int32_t data_idx, int64_t gop_start) {
+  const EncodedData &data = encoded_data_[data_idx];
+  int64_t gop_end = data.end_keyframe;
+  for (uint64_t keyframe : data.keyframes) {
+    if (keyframe > gop_start) {
+      gop_end = std::min(gop_end, (int64_t)keyframe);
+      break;
+    }
+  }
+  gop_end = std::min(gop_end,
+                     (int64_t)(data.start_keyframe + data.sample_sizes.size()));
+
+  feeder_gop_start_ = gop_start;
+  feeder_gop_drops_.assign(std::max(gop_end - gop_start, (int64_t)0), -1);
+  if (!drop_non_ref_frames_) {
+    return;
+  }
+
+  struct GOPSample {
+    int64_t poc;
+    int64_t index;
+    bool is_reference;
+  };
+  std::vector<GOPSample> samples;
+  int64_t prev_poc_msb = 0;
+  int64_t prev_poc_lsb = -1;
+  for (int64_t i = gop_start; i < gop_end; ++i) {
+    const uint8_t *sample =
+        data.video_data() + data.sample_offsets[i - data.start_keyframe];
+    size_t sample_size = data.sample_sizes[i - data.start_keyframe];
+    SliceHeader header;
+    if (!parse_avcc_sample_slice_header(sample, sample_size, avc_config_,
+                                        header)) {
+      // Can not tell which frames are safe to drop so decode all of them
+      return;
+    }
+    if (i == gop_start && header.nal_unit_type != 5) {
+      // In an open GOP the leading pictures come before the I frame in
+      // output order but reference the previous GOP, so the decoder does
+      // not output them the way the ranks below assume
+      return;
+    }
+    const SPS &sps = avc_config_.sps_map.at(header.sps_id);
+    int64_t poc;
+    if (sps.poc_type == 2) {
+      // Output order is the same as decode order
+      poc = i;
+    } else if (sps.poc_type == 0) {
+      int64_t max_poc_lsb = (int64_t)1 << sps.log2_max_pic_order_cnt_lsb;
+      int64_t poc_lsb = header.pic_order_cnt_lsb;
+      if (header.nal_unit_type == 5 || prev_poc_lsb < 0) {
+        prev_poc_msb = 0;
+        prev_poc_lsb = (header.nal_unit_type == 5) ? 0 : poc_lsb;
+      }
+      int64_t poc_msb = prev_poc_msb;
+      if (poc_lsb < prev_poc_lsb &&
+          prev_poc_lsb - poc_lsb >= max_poc_lsb / 2) {
+        poc_msb += max_poc_lsb;
+      } else if (poc_lsb > prev_poc_lsb &&
+                 poc_lsb - prev_poc_lsb > max_poc_lsb / 2) {
+        poc_msb -= max_poc_lsb;
+      }
+      poc = poc_msb + poc_lsb;
+      if (header.nal_ref_idc != 0) {
+        prev_poc_msb = poc_msb;
+        prev_poc_lsb = poc_lsb;
+      }
+    } else {
+      return;
+    }
+    samples.push_back({poc, i, header.nal_ref_idc != 0});
+  }
+
+  // The decoder outputs frames in presentation order, so the frame number
+  // the retriever assigns to a sample is its rank by picture order count
+  std::stable_sort(samples.begin(), samples.end(),
+                   [](const GOPSample &a, const GOPSample &b) {
+                     return a.poc < b.poc;
+                   });
+  std::vector<int64_t> dropped;
+  for (size_t rank = 0; rank < samples.size(); ++rank) {
+    int64_t frame = gop_start + rank;
+    if (!samples[rank].is_reference &&
+        !std::binary_search(data.valid_frames.begin(), data.valid_frames.end(),
+                            (uint64_t)frame)) {
+      feeder_gop_drops_[samples[rank].index - gop_start] = frame;
+      dropped.push_back(frame);
+    }
+  }
+  std::unique_lock<std::mutex> lk(dropped_frames_mutex_);
+  dropped_frames_.insert(dropped_frames_.end(), dropped.begin(),
+                         dropped.end());
+}
+
+int64_t DecoderAutomata::skip_dropped_frames(int64_t frame) {
+  std::unique_lock<std::mutex> lk(dropped_frames_mutex_);
+  while (!dropped_frames_.empty() && dropped_frames_.front() <= frame) {
+    if (dropped_frames_.front() == frame) {
+      frame++;
+    }
+    dropped_frames_.pop_front();
+  }
+  return frame;
+}
+
+DecoderAutomata::Stats DecoderAutomata::get_stats() {
+  Stats stats;
+  stats.frames_fed = frames_fed_;
+  stats.frames_skipped = frames_skipped_;
+  stats.frames_decoded = frames_decoded_;
+  stats.frames_used = frames_used_;
+  stats.warm_initializations = warm_initializations_;
+  stats.segments_continued = segments_continued_;
+  return stats;
+}
+
 void DecoderAutomata::set_feeder_idx(int32_t data_idx) {
   feeder_data_idx_ = data_idx;
   feeder_valid_idx_ = 0;
   feeder_buffer_offset_ = 0;
+  feeder_gop_drops_.clear();
   if (feeder_data_idx_ < encoded_data_.size()) {
     feeder_buffer_offset_ =
         encoded_data_[feeder_data_idx_].sample_offsets.at(0);
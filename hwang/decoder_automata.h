@@ -17,8 +17,12 @@
 
 #include "hwang/video_decoder_interface.h"
 #include "hwang/video_decoder_factory.h"
+#include "hwang/util/h264.h"
 
 #include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <thread>
@@ -42,7 +46,10 @@ class DecoderAutomata {
 
    struct EncodedData {
      inline bool operator==(const EncodedData &other) const {
-       return encoded_video == other.encoded_video && width == other.width &&
+       return video_size() == other.video_size() &&
+              (video_size() == 0 ||
+               memcmp(video_data(), other.video_data(), video_size()) == 0) &&
+              width == other.width &&
               height == other.height &&
               start_keyframe == other.start_keyframe &&
               end_keyframe == other.end_keyframe &&
@@ -53,7 +60,23 @@ class DecoderAutomata {
               valid_frames == other.valid_frames;
      }
 
+     // Encoded bytes are either owned in encoded_video or referenced through
+     // encoded_video_ref, which avoids copying data owned elsewhere (e.g. a
+     // memory mapped file). A borrowed buffer can be referenced with a no-op
+     // deleter as long as it outlives the automata's use of it.
      std::vector<uint8_t> encoded_video;
+     std::shared_ptr<const uint8_t> encoded_video_ref;
+     size_t encoded_video_ref_size = 0;
+
+     const uint8_t *video_data() const {
+       return encoded_video_ref ? encoded_video_ref.get()
+                                : encoded_video.data();
+     }
+     size_t video_size() const {
+       return encoded_video_ref ? encoded_video_ref_size
+                                : encoded_video.size();
+     }
+
      uint32_t width;
      uint32_t height;
      uint64_t start_keyframe;
@@ -64,11 +87,101 @@ class DecoderAutomata {
      std::vector<uint64_t> keyframes;
      std::vector<uint64_t> valid_frames;
   };
+  // Frames are cropped, resized and rotated as described by geometry and
+  // returned in output_format, see frame_size.
+  // If the first frame of the new request comes after the last frame of the
+  // previous one and the feeder is still in that frame's GOP, the decoder is
+  // not reset and decoding continues from where the previous request left
+  // off.
   Result initialize(const std::vector<EncodedData> &encoded_data,
-                    const std::vector<uint8_t> &extradata);
+                    const std::vector<uint8_t> &extradata,
+                    PixelFormat output_format = PixelFormat::RGB24,
+                    const FrameGeometry &geometry = FrameGeometry(),
+                    DecodeQuality quality = DecodeQuality::EXACT);
+
+  // Takes ownership of encoded_data instead of copying it
+  Result initialize(std::vector<EncodedData> &&encoded_data,
+                    const std::vector<uint8_t> &extradata,
+                    PixelFormat output_format = PixelFormat::RGB24,
+                    const FrameGeometry &geometry = FrameGeometry(),
+                    DecodeQuality quality = DecodeQuality::EXACT);
+
+  // Threading used by software decoders from the next initialize that does
+  // not continue the previous request. AUTO picks frame threading when the
+  // intervals of that initialize average at least FRAME_THREADING_MIN_SAMPLES
+  // samples and slice threading otherwise, and keeps the choice until the
+  // policy is set again so later requests can reuse the open codec.
+  void set_threading_policy(const ThreadingPolicy &policy) {
+    threading_ = policy;
+    auto_threading_mode_ = ThreadingMode::AUTO;
+  }
+
+  static const int64_t FRAME_THREADING_MIN_SAMPLES = 32;
+
+  // Whether software decoders back decoded pictures with transparent huge
+  // pages, from the next initialize that does not continue the previous
+  // request. Reduces TLB misses on 4K video.
+  void set_huge_pages(bool huge_pages) { huge_pages_ = huge_pages; }
 
+  // Whether unrequested H.264 frames that no other frame references are
+  // dropped before decoding, from the next initialize. On by default.
+  void set_skip_non_ref_frames(bool skip) { skip_non_ref_frames_ = skip; }
+
+  // Whether the decoder keeps running from one interval into the next when
+  // the next one starts with an IDR frame, instead of being flushed between
+  // them. On by default.
+  void set_continue_segments(bool continue_segments) {
+    continue_segments_ = continue_segments;
+  }
+
+  // Decodes the next num_frames requested frames into buffer, which must be
+  // large enough to hold all of them
   Result get_frames(uint8_t* buffer, int32_t num_frames);
 
+  // Receives the frame number and data of each requested frame
+  using FrameSink = std::function<Result(int64_t, const uint8_t*)>;
+
+  // Passes each of the next num_frames requested frames to sink as soon as it
+  // is decoded, while the feeder keeps decoding ahead. Frames are written to
+  // a ring of STREAM_BUFFERS buffers, so a frame's data stays valid until
+  // STREAM_BUFFERS - 1 more frames have been delivered.
+  Result get_frames(int32_t num_frames, const FrameSink& sink);
+
+  // Pull based interface: after begin_frames(num_frames), each of num_frames
+  // calls to next_frame decodes the next requested frame into buffer
+  Result begin_frames(int32_t num_frames);
+
+  Result next_frame(uint8_t* buffer, int64_t* frame_number = nullptr);
+
+  static const int32_t STREAM_BUFFERS = 4;
+
+  // Size in bytes of each frame returned since the last initialize
+  size_t frame_size() const { return frame_size_; }
+
+  PixelFormat output_format() const { return info_.output_format; }
+
+  // Size of the returned frames after cropping, resizing and rotation
+  uint32_t output_width() const { return output_width_; }
+  uint32_t output_height() const { return output_height_; }
+
+  struct Stats {
+    // Samples sent to the decoder
+    int64_t frames_fed;
+    // Samples dropped before reaching the decoder because they were not
+    // requested and no other frame references them
+    int64_t frames_skipped;
+    // Frames produced by the decoder
+    int64_t frames_decoded;
+    // Decoded frames returned by get_frames
+    int64_t frames_used;
+    // Calls to initialize that continued decoding from the previous request
+    int64_t warm_initializations;
+    // Segments started without flushing the decoder
+    int64_t segments_continued;
+  };
+  // Cumulative counts since this automata was created
+  Stats get_stats();
+
   // void set_profiler(Profiler* profiler);
 
  private:
@@ -76,6 +189,22 @@ class DecoderAutomata {
 
   void set_feeder_idx(int32_t data_idx);
 
+  void set_feeder_result(const Result &result);
+
+  Result discard_output();
+
+  bool can_continue_without_flush(int32_t data_idx);
+
+  bool try_warm_initialize(std::vector<EncodedData> &encoded_data,
+                           const std::vector<uint8_t> &extradata,
+                           PixelFormat output_format,
+                           const FrameGeometry &geometry,
+                           DecodeQuality quality);
+
+  void plan_gop_drops(int32_t data_idx, int64_t gop_start);
+
+  int64_t skip_dropped_frames(int64_t frame);
+
   const int32_t MAX_BUFFERED_FRAMES = 8;
 
   // Profiler* profiler_ = nullptr;
@@ -88,8 +217,17 @@ class DecoderAutomata {
   std::thread feeder_thread_;
   std::atomic<bool> not_done_;
 
+  ThreadingPolicy threading_;
+  // What AUTO resolved to, AUTO until the first initialize
+  ThreadingMode auto_threading_mode_ = ThreadingMode::AUTO;
+  bool huge_pages_ = false;
+  bool skip_non_ref_frames_ = true;
+  bool continue_segments_ = true;
   VideoDecoderInterface::FrameInfo info_{};
-  size_t frame_size_;
+  std::vector<uint8_t> extradata_;
+  size_t frame_size_ = 0;
+  uint32_t output_width_ = 0;
+  uint32_t output_height_ = 0;
   int32_t current_frame_;
   std::atomic<int32_t> reset_current_frame_;
   std::vector<EncodedData> encoded_data_;
@@ -116,6 +254,37 @@ class DecoderAutomata {
 
   std::atomic<bool> result_set_;
   Result feeder_result_;
+
+  std::vector<std::vector<uint8_t>> stream_buffers_;
+
+  // Non-reference H.264 frames that are not in valid_frames are never sent
+  // to the decoder. The feeder decides which samples of a GOP to drop when
+  // it reaches the GOP's keyframe and publishes the frame numbers they would
+  // have been output as in dropped_frames_ so the retriever can skip them.
+  bool drop_non_ref_frames_;
+  AVCConfig avc_config_;
+  int64_t feeder_gop_start_;
+  // Frame number of each dropped sample in the current GOP, -1 if not dropped
+  std::vector<int64_t> feeder_gop_drops_;
+  std::mutex dropped_frames_mutex_;
+  std::deque<int64_t> dropped_frames_;
+
+  // Segments that start with an IDR frame are fed without flushing the
+  // decoder. Frames are matched to segments by counting: the feeder records
+  // how many frames it had sent when it started each such segment.
+  int32_t nal_length_size_ = 0;
+  bool is_hevc_ = false;
+  std::atomic<int64_t> feeder_frames_sent_;
+  std::atomic<int64_t> frames_received_;
+  std::mutex boundaries_mutex_;
+  std::deque<int64_t> segment_boundaries_;
+
+  std::atomic<int64_t> frames_fed_;
+  std::atomic<int64_t> frames_skipped_;
+  std::atomic<int64_t> frames_decoded_;
+  std::atomic<int64_t> frames_used_;
+  std::atomic<int64_t> warm_initializations_;
+  std::atomic<int64_t> segments_continued_;
 };
 
 }
@@ -12,15 +12,26 @@
  */
 
 #include "hwang/decoder_automata.h"
+#include "hwang/impls/software/frame_arena.h"
+#include "hwang/impls/software/software_video_decoder.h"
 #include "hwang/mp4_index_creator.h"
 #include "hwang/tests/videos.h"
+#include "hwang/util/color.h"
 #include "hwang/util/cuda.h"
 #include "hwang/util/fs.h"
+#include "hwang/util/thread_budget.h"
 
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <thread>
 
+#include <unistd.h>
+
 extern "C" {
 #include "libavcodec/avcodec.h"
 }
@@ -29,6 +40,24 @@ namespace hwang {
 
 namespace {
 
+// Indexes an mp4 held in memory by feeding the index creator the ranges it
+// asks for
+bool index_video_bytes(const std::vector<uint8_t> &video_bytes,
+                       VideoIndex &video_index) {
+  MP4IndexCreator indexer(video_bytes.size());
+  uint64_t current_offset = 0;
+  uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
+  while (!indexer.is_done()) {
+    indexer.feed(video_bytes.data() + current_offset, size_to_read,
+                 current_offset, size_to_read);
+  }
+  if (indexer.is_error()) {
+    return false;
+  }
+  video_index = indexer.get_video_index();
+  return true;
+}
+
 std::vector<DecoderAutomata::EncodedData>
 get_all_frames(const VideoIndex &video_index,
                const std::vector<uint8_t> &video_bytes) {
@@ -160,6 +189,64 @@ get_strided_range_frames(const VideoIndex &video_index,
 const std::vector<TestVideoInfo> cpu_videos = {test_video_hevc};
 const std::vector<TestVideoInfo> gpu_videos = {test_video_hevc};
 
+TEST(DecoderAutomata, ThreadBudget) {
+  ThreadBudget budget(8);
+  for (int i = 0; i < 3; ++i) {
+    budget.register_decoder();
+  }
+  // Equal shares until the budget runs out, then one thread each
+  EXPECT_EQ(budget.acquire(0), 2);
+  EXPECT_EQ(budget.acquire(5), 5);
+  EXPECT_EQ(budget.acquire(0), 1);
+  EXPECT_EQ(budget.in_use(), 8);
+  budget.release(5);
+  EXPECT_EQ(budget.acquire(0), 2);
+  EXPECT_EQ(budget.in_use(), 5);
+}
+
+TEST(DecoderAutomata, ConversionThreads) {
+  // A decoder with the default threading policy converts frames with its
+  // whole share of the budget, which is every core when it is alone
+  SoftwareVideoDecoder decoder(0, DeviceType::CPU);
+  VideoDecoderInterface::FrameInfo info;
+  info.width = 640;
+  info.height = 360;
+  info.format = "hevc";
+  ASSERT_TRUE(decoder.configure(info, {}).ok);
+  int32_t expected =
+      std::min(ThreadBudget::global().total(),
+               color_conversion_pool().num_workers() + 1);
+  EXPECT_EQ(decoder.conversion_threads(), std::max(expected, 1));
+  if (std::thread::hardware_concurrency() > 1) {
+    EXPECT_GT(decoder.conversion_threads(), 1);
+  }
+}
+
+TEST(DecoderAutomata, FrameArena) {
+  FrameArena arena;
+  // Released buffers are reused for the same size class
+  for (int i = 0; i < 10; ++i) {
+    AVBufferRef *a = arena.get(1920 * 1080 * 3 / 2);
+    AVBufferRef *b = arena.get(1280 * 720 * 3 / 2);
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    EXPECT_EQ((uintptr_t)a->data % FrameArena::ALIGNMENT, 0);
+    EXPECT_EQ((uintptr_t)b->data % FrameArena::ALIGNMENT, 0);
+    av_buffer_unref(&a);
+    av_buffer_unref(&b);
+  }
+  EXPECT_EQ(arena.allocations(), 2);
+
+  arena.set_huge_pages(true);
+  AVBufferRef *huge = arena.get(3840 * 2160 * 3 / 2);
+  ASSERT_NE(huge, nullptr);
+  EXPECT_EQ((uintptr_t)huge->data % (2 * 1024 * 1024), 0);
+  arena.clear();
+  // Still valid after the pools are dropped
+  memset(huge->data, 0, 3840 * 2160 * 3 / 2);
+  av_buffer_unref(&huge);
+}
+
 TEST(DecoderAutomata, GetAllFrames) {
   std::vector<TestVideoInfo> videos = cpu_videos;
 
@@ -170,15 +257,8 @@ TEST(DecoderAutomata, GetAllFrames) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
     printf("video_index format %s\n", video_index.format().c_str());
 
     // Create decoder
@@ -213,15 +293,8 @@ TEST(DecoderAutomata, GetStridedRangesFrames) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
 
     // Create decoder
     VideoDecoderType decoder_type = VideoDecoderType::SOFTWARE;
@@ -259,6 +332,379 @@ TEST(DecoderAutomata, GetStridedRangesFrames) {
   }
 }
 
+TEST(DecoderAutomata, SkipNonRefFrames) {
+  avcodec_register_all();
+
+  std::vector<uint8_t> video_bytes =
+      read_entire_file(download_video(test_video_h264));
+  VideoIndex video_index;
+  ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+  ASSERT_EQ(video_index.format(), "avc1");
+
+  // Every third frame leaves unrequested B frames to drop
+  std::vector<uint64_t> desired_frames;
+  for (uint64_t i = 0; i < std::min(video_index.frames(), (uint64_t)150);
+       i += 3) {
+    desired_frames.push_back(i);
+  }
+  size_t frame_size =
+      video_index.frame_width() * video_index.frame_height() * 3;
+
+  std::vector<uint8_t> frames[2];
+  DecoderAutomata::Stats stats[2];
+  for (int skip = 0; skip < 2; ++skip) {
+    DecoderAutomata *decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    decoder->set_skip_non_ref_frames(skip == 1);
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_strided_range_frames(video_index, video_bytes, desired_frames);
+    ASSERT_TRUE(decoder->initialize(args, video_index.metadata_bytes()).ok);
+    frames[skip].resize(frame_size * desired_frames.size());
+    ASSERT_TRUE(
+        decoder->get_frames(frames[skip].data(), desired_frames.size()).ok);
+    stats[skip] = decoder->get_stats();
+    printf("skip %d: fed %ld, skipped %ld, decoded %ld, used %ld\n", skip,
+           stats[skip].frames_fed, stats[skip].frames_skipped,
+           stats[skip].frames_decoded, stats[skip].frames_used);
+    EXPECT_EQ(stats[skip].frames_used, desired_frames.size());
+    delete decoder;
+  }
+
+  EXPECT_EQ(stats[0].frames_skipped, 0);
+  EXPECT_GT(stats[1].frames_skipped, 0);
+  EXPECT_LT(stats[1].frames_fed, stats[0].frames_fed);
+  // Dropping frames nothing references does not change the decoded pixels
+  EXPECT_TRUE(frames[0] == frames[1]);
+}
+
+TEST(DecoderAutomata, ContinueSegments) {
+  avcodec_register_all();
+
+  std::vector<uint8_t> video_bytes =
+      read_entire_file(download_video(test_video_h264));
+  VideoIndex video_index;
+  ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+  ASSERT_GE(video_index.keyframe_indices().size(), 3);
+
+  // One interval per GOP, so consecutive intervals are adjacent and each
+  // starts with a keyframe
+  std::vector<uint64_t> desired_frames;
+  std::vector<DecoderAutomata::EncodedData> args;
+  std::vector<uint64_t> keyframes = video_index.keyframe_indices();
+  for (size_t k = 0; k < 3; ++k) {
+    std::vector<uint64_t> gop_frames;
+    uint64_t end = k + 1 < keyframes.size() ? keyframes[k + 1]
+                                            : video_index.frames();
+    for (uint64_t i = keyframes[k]; i < std::min(end, keyframes[k] + 5);
+         ++i) {
+      gop_frames.push_back(i);
+    }
+    std::vector<DecoderAutomata::EncodedData> gop_args =
+        get_strided_range_frames(video_index, video_bytes, gop_frames);
+    desired_frames.insert(desired_frames.end(), gop_frames.begin(),
+                          gop_frames.end());
+    args.insert(args.end(), gop_args.begin(), gop_args.end());
+  }
+  size_t frame_size =
+      video_index.frame_width() * video_index.frame_height() * 3;
+
+  std::vector<uint8_t> frames[2];
+  DecoderAutomata::Stats stats[2];
+  for (int cont = 0; cont < 2; ++cont) {
+    DecoderAutomata *decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    decoder->set_continue_segments(cont == 1);
+    ASSERT_TRUE(decoder->initialize(args, video_index.metadata_bytes()).ok);
+    frames[cont].resize(frame_size * desired_frames.size());
+    ASSERT_TRUE(
+        decoder->get_frames(frames[cont].data(), desired_frames.size()).ok);
+    stats[cont] = decoder->get_stats();
+    EXPECT_EQ(stats[cont].frames_used, desired_frames.size());
+    delete decoder;
+  }
+
+  EXPECT_EQ(stats[0].segments_continued, 0);
+  EXPECT_GT(stats[1].segments_continued, 0);
+  // Not flushing at an IDR frame does not change the decoded pixels
+  EXPECT_TRUE(frames[0] == frames[1]);
+}
+
+TEST(DecoderAutomata, StreamFrames) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+    size_t frame_size =
+        video_index.frame_width() * video_index.frame_height() * 3;
+
+    std::vector<uint64_t> desired_frames;
+    for (uint64_t i = 0; i < 150; i += 3) {
+      desired_frames.push_back(i);
+    }
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_strided_range_frames(video_index, video_bytes, desired_frames);
+
+    // Decode into one buffer
+    DecoderAutomata *decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    decoder->initialize(args, video_index.metadata_bytes());
+    std::vector<uint8_t> frame_buffer(frame_size * desired_frames.size());
+    size_t frames_so_far = 0;
+    for (auto &arg : args) {
+      ASSERT_TRUE(decoder
+                      ->get_frames(frame_buffer.data() +
+                                       frames_so_far * frame_size,
+                                   arg.valid_frames.size())
+                      .ok);
+      frames_so_far += arg.valid_frames.size();
+    }
+    delete decoder;
+
+    // Stream the same frames and make sure they match. The intervals
+    // reference the file bytes instead of each holding a copy.
+    for (auto &arg : args) {
+      std::vector<uint8_t>().swap(arg.encoded_video);
+      arg.encoded_video_ref = std::shared_ptr<const uint8_t>(
+          video_bytes.data(), [](const uint8_t *) {});
+      arg.encoded_video_ref_size = video_bytes.size();
+    }
+    decoder = DecoderAutomata::make_instance(CPU_DEVICE, 1,
+                                             VideoDecoderType::SOFTWARE);
+    decoder->initialize(args, video_index.metadata_bytes());
+    size_t streamed = 0;
+    for (auto &arg : args) {
+      Result result = decoder->get_frames(
+          arg.valid_frames.size(),
+          [&](int64_t frame_number, const uint8_t *data) {
+            EXPECT_EQ(frame_number, desired_frames[streamed]);
+            EXPECT_EQ(memcmp(data, frame_buffer.data() + streamed * frame_size,
+                             frame_size),
+                      0);
+            streamed++;
+            return Result();
+          });
+      ASSERT_TRUE(result.ok);
+    }
+    EXPECT_EQ(streamed, desired_frames.size());
+    delete decoder;
+  }
+}
+
+TEST(DecoderAutomata, OutputFormats) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+    uint32_t width = video_index.frame_width();
+    uint32_t height = video_index.frame_height();
+
+    std::vector<uint64_t> desired_frames = {0, 1, 2, 3};
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_strided_range_frames(video_index, video_bytes, desired_frames);
+
+    auto decode = [&](PixelFormat format) {
+      DecoderAutomata *decoder = DecoderAutomata::make_instance(
+          CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+      EXPECT_TRUE(
+          decoder->initialize(args, video_index.metadata_bytes(), format).ok);
+      EXPECT_EQ(decoder->frame_size(),
+                frame_buffer_size(format, width, height));
+      std::vector<uint8_t> frames(decoder->frame_size() *
+                                  desired_frames.size());
+      EXPECT_TRUE(
+          decoder->get_frames(frames.data(), desired_frames.size()).ok);
+      delete decoder;
+      return frames;
+    };
+    std::vector<uint8_t> gray = decode(PixelFormat::GRAY8);
+    std::vector<uint8_t> i420 = decode(PixelFormat::YUV420P);
+    std::vector<uint8_t> nv12 = decode(PixelFormat::NV12);
+
+    // All formats share the same luma plane and NV12 interleaves the I420
+    // chroma planes
+    size_t luma_size = frame_buffer_size(PixelFormat::GRAY8, width, height);
+    size_t yuv_size = frame_buffer_size(PixelFormat::YUV420P, width, height);
+    size_t chroma_size = (yuv_size - luma_size) / 2;
+    for (size_t f = 0; f < desired_frames.size(); ++f) {
+      const uint8_t *g = gray.data() + f * luma_size;
+      const uint8_t *p = i420.data() + f * yuv_size;
+      const uint8_t *n = nv12.data() + f * yuv_size;
+      ASSERT_EQ(memcmp(g, p, luma_size), 0);
+      ASSERT_EQ(memcmp(g, n, luma_size), 0);
+      for (size_t i = 0; i < chroma_size; ++i) {
+        ASSERT_EQ(n[luma_size + i * 2], p[luma_size + i]);
+        ASSERT_EQ(n[luma_size + i * 2 + 1], p[luma_size + chroma_size + i]);
+      }
+    }
+  }
+}
+
+TEST(DecoderAutomata, Geometry) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+    uint32_t width = video_index.frame_width();
+    uint32_t height = video_index.frame_height();
+
+    std::vector<uint64_t> desired_frames = {0, 1};
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_strided_range_frames(video_index, video_bytes, desired_frames);
+
+    auto decode = [&](const FrameGeometry &geometry) {
+      DecoderAutomata *decoder = DecoderAutomata::make_instance(
+          CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+      EXPECT_TRUE(decoder->initialize(args, video_index.metadata_bytes(),
+                                      PixelFormat::RGB24, geometry)
+                      .ok);
+      std::vector<uint8_t> frames(decoder->frame_size() *
+                                  desired_frames.size());
+      EXPECT_TRUE(
+          decoder->get_frames(frames.data(), desired_frames.size()).ok);
+      delete decoder;
+      return frames;
+    };
+    std::vector<uint8_t> full = decode(FrameGeometry());
+
+    FrameGeometry crop;
+    crop.crop_x = 16;
+    crop.crop_y = 8;
+    crop.crop_width = width / 2;
+    crop.crop_height = height / 2;
+    std::vector<uint8_t> cropped = decode(crop);
+    crop.rotation = 90;
+    std::vector<uint8_t> rotated = decode(crop);
+
+    // Cropping selects the same pixels as the full frame and rotating by 90
+    // degrees moves pixel (x, y) to (crop_height - 1 - y, x)
+    uint32_t cw = crop.crop_width;
+    uint32_t ch = crop.crop_height;
+    ASSERT_EQ(cropped.size(), cw * ch * 3 * desired_frames.size());
+    ASSERT_EQ(rotated.size(), cropped.size());
+    for (size_t f = 0; f < desired_frames.size(); ++f) {
+      const uint8_t *a = full.data() + f * width * height * 3;
+      const uint8_t *c = cropped.data() + f * cw * ch * 3;
+      const uint8_t *r = rotated.data() + f * cw * ch * 3;
+      for (uint32_t y = 0; y < ch; ++y) {
+        ASSERT_EQ(memcmp(c + y * cw * 3,
+                         a + ((y + crop.crop_y) * width + crop.crop_x) * 3,
+                         cw * 3),
+                  0);
+        for (uint32_t x = 0; x < cw; ++x) {
+          ASSERT_EQ(memcmp(c + (y * cw + x) * 3,
+                           r + (x * ch + (ch - 1 - y)) * 3, 3),
+                    0);
+        }
+      }
+    }
+
+    // Resizing changes the frame size and crops outside the frame fail
+    FrameGeometry resize;
+    resize.width = width / 4;
+    resize.height = height / 4;
+    resize.interpolation = Interpolation::AREA;
+    EXPECT_EQ(decode(resize).size(),
+              frame_buffer_size(PixelFormat::RGB24, width / 4, height / 4) *
+                  desired_frames.size());
+    FrameGeometry outside;
+    outside.crop_x = width;
+    outside.crop_width = 1;
+    outside.crop_height = 1;
+    DecoderAutomata *decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    EXPECT_FALSE(decoder->initialize(args, video_index.metadata_bytes(),
+                                     PixelFormat::RGB24, outside)
+                     .ok);
+    delete decoder;
+  }
+}
+
+TEST(DecoderAutomata, WarmInitialize) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+    size_t frame_size =
+        video_index.frame_width() * video_index.frame_height() * 3;
+
+    // Two requests in the longest GOP, the second after the first
+    const auto &keyframes = video_index.keyframe_indices();
+    uint64_t gop_start = 0;
+    uint64_t gop_size = 0;
+    for (size_t i = 0; i < keyframes.size(); ++i) {
+      uint64_t end = i + 1 < keyframes.size() ? keyframes[i + 1]
+                                              : video_index.frames();
+      if (end - keyframes[i] > gop_size) {
+        gop_start = keyframes[i];
+        gop_size = end - keyframes[i];
+      }
+    }
+    // Otherwise the feeder could reach the end of the GOP or pass the second
+    // request before it comes in
+    ASSERT_GE(gop_size, 64) << video.data_url << " has no GOP long enough";
+    std::vector<std::vector<uint64_t>> requests = {
+        {gop_start + gop_size / 4, gop_start + gop_size / 4 + 1},
+        {gop_start + gop_size / 2, gop_start + gop_size / 2 + 1}};
+
+    // Slice threading adds no frame delay and nothing is dropped, so the
+    // feeder stays within MAX_BUFFERED_FRAMES of the first request
+    DecoderAutomata *warm_decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    ThreadingPolicy slice_threading;
+    slice_threading.mode = ThreadingMode::SLICE;
+    warm_decoder->set_threading_policy(slice_threading);
+    warm_decoder->set_skip_non_ref_frames(false);
+    for (const auto &request : requests) {
+      std::vector<DecoderAutomata::EncodedData> args =
+          get_strided_range_frames(video_index, video_bytes, request);
+      ASSERT_EQ(args.size(), 1);
+      ASSERT_TRUE(
+          warm_decoder->initialize(args, video_index.metadata_bytes()).ok);
+      std::vector<uint8_t> warm_frames(frame_size * request.size());
+      ASSERT_TRUE(
+          warm_decoder->get_frames(warm_frames.data(), request.size()).ok);
+
+      // Compare against a decoder that starts from the keyframe
+      DecoderAutomata *cold_decoder = DecoderAutomata::make_instance(
+          CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+      ASSERT_TRUE(
+          cold_decoder->initialize(args, video_index.metadata_bytes()).ok);
+      std::vector<uint8_t> cold_frames(frame_size * request.size());
+      ASSERT_TRUE(
+          cold_decoder->get_frames(cold_frames.data(), request.size()).ok);
+      delete cold_decoder;
+
+      EXPECT_EQ(warm_frames, cold_frames);
+    }
+    EXPECT_EQ(warm_decoder->get_stats().warm_initializations, 1);
+    delete warm_decoder;
+  }
+}
+
 TEST(DecoderAutomata, GatherFramesComparison) {
   av_log_set_level(AV_LOG_TRACE);
 
@@ -271,15 +717,8 @@ TEST(DecoderAutomata, GatherFramesComparison) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
 
     // Create decoder
     VideoDecoderType decoder_type = VideoDecoderType::SOFTWARE;
@@ -341,6 +780,215 @@ TEST(DecoderAutomata, GatherFramesComparison) {
   }
 }
 
+TEST(DecoderAutomata, CPUTimePerFrame) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    // Load test data
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+
+    // Create decoder
+    VideoDecoderType decoder_type = VideoDecoderType::SOFTWARE;
+    DeviceHandle device = CPU_DEVICE;
+    DecoderAutomata *decoder =
+        DecoderAutomata::make_instance(device, 1, decoder_type);
+
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_all_frames(video_index, video_bytes);
+    decoder->initialize(args, video_index.metadata_bytes());
+    int64_t frames = 0;
+    for (auto &arg : args) {
+      frames += arg.valid_frames.size();
+    }
+    size_t frame_size =
+        video_index.frame_width() * video_index.frame_height() * 3;
+    std::vector<uint8_t> frame_buffer(frame_size * frames);
+
+    // Start the session and give the decoder time to finish the packets it
+    // was handed, then stop consuming. Nothing should run until the next
+    // request, so the process should barely use any CPU.
+    ASSERT_TRUE(decoder->get_frames(frame_buffer.data(), 1).ok);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::clock_t idle_start = std::clock();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    double idle_cpu_seconds =
+        (std::clock() - idle_start) / (double)CLOCKS_PER_SEC;
+    printf("%.3f cpu-seconds while idle for 1 second\n", idle_cpu_seconds);
+    ASSERT_LT(idle_cpu_seconds, 0.05);
+
+    // Decoder bound: waiting for the decoder should not add CPU time on top
+    // of the decode work itself
+    std::clock_t cpu_start = std::clock();
+    ASSERT_TRUE(
+        decoder->get_frames(frame_buffer.data() + frame_size, frames - 1).ok);
+    double cpu_seconds = (std::clock() - cpu_start) / (double)CLOCKS_PER_SEC;
+    printf("decoded %ld frames, %.6f cpu-seconds/frame\n", frames - 1,
+           cpu_seconds / (frames - 1));
+
+    delete decoder;
+  }
+}
+
+// Prints timings, run with --gtest_also_run_disabled_tests
+TEST(DecoderAutomata, DISABLED_DecodeQualityBenchmark) {
+  // Both codecs, since the skip options are only honored by some of them
+  std::vector<TestVideoInfo> videos = {test_video_hevc, test_video_h264};
+
+  avcodec_register_all();
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_all_frames(video_index, video_bytes);
+    int64_t num_frames = 0;
+    for (auto &arg : args) {
+      num_frames += arg.valid_frames.size();
+    }
+
+    auto make_decoder = [&](DecodeQuality quality) {
+      DecoderAutomata *decoder = DecoderAutomata::make_instance(
+          CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+      EXPECT_TRUE(decoder->initialize(args, video_index.metadata_bytes(),
+                                      PixelFormat::GRAY8, FrameGeometry(),
+                                      quality)
+                      .ok);
+      return decoder;
+    };
+    auto time_decode = [&](DecodeQuality quality) {
+      auto start = std::chrono::steady_clock::now();
+      DecoderAutomata *decoder = make_decoder(quality);
+      EXPECT_TRUE(decoder
+                      ->get_frames(num_frames,
+                                   [](int64_t, const uint8_t *) {
+                                     return Result();
+                                   })
+                      .ok);
+      delete decoder;
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           start)
+          .count();
+    };
+
+    double exact_seconds = time_decode(DecodeQuality::EXACT);
+    const char *names[] = {"exact", "fast", "preview"};
+    for (DecodeQuality quality :
+         {DecodeQuality::FAST, DecodeQuality::PREVIEW}) {
+      double seconds = time_decode(quality);
+
+      // Luma PSNR against exact decode
+      DecoderAutomata *exact = make_decoder(DecodeQuality::EXACT);
+      DecoderAutomata *reduced = make_decoder(quality);
+      ASSERT_EQ(reduced->frame_size(), exact->frame_size());
+      std::vector<uint8_t> a(exact->frame_size());
+      std::vector<uint8_t> b(reduced->frame_size());
+      ASSERT_TRUE(exact->begin_frames(num_frames).ok);
+      ASSERT_TRUE(reduced->begin_frames(num_frames).ok);
+      double squared_error = 0;
+      for (int64_t f = 0; f < num_frames; ++f) {
+        ASSERT_TRUE(exact->next_frame(a.data()).ok);
+        ASSERT_TRUE(reduced->next_frame(b.data()).ok);
+        for (size_t i = 0; i < a.size(); ++i) {
+          double d = (double)a[i] - b[i];
+          squared_error += d * d;
+        }
+      }
+      double mse = squared_error / (a.size() * num_frames);
+      double psnr = mse == 0 ? INFINITY : 10 * std::log10(255.0 * 255.0 / mse);
+      printf("%s %s: %.2fx speedup, %.2f dB luma PSNR\n",
+             video.data_url.c_str(), names[(int)quality],
+             exact_seconds / seconds, psnr);
+      delete exact;
+      delete reduced;
+    }
+  }
+}
+
+// Takes minutes, run with --gtest_also_run_disabled_tests
+TEST(DecoderAutomata, DISABLED_InitializeSoak) {
+  std::vector<TestVideoInfo> videos = cpu_videos;
+
+  avcodec_register_all();
+
+  // Resident set size in bytes, -1 if it can not be read
+  auto rss = []() -> int64_t {
+    long pages = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+      if (fscanf(f, "%*ld %ld", &pages) != 1) {
+        pages = -1;
+      }
+      fclose(f);
+    }
+    return pages < 0 ? -1 : (int64_t)pages * sysconf(_SC_PAGESIZE);
+  };
+
+  for (const TestVideoInfo &video : videos) {
+    std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
+
+    // Create video index
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
+
+    // Reference the video instead of copying it on every initialize
+    std::vector<DecoderAutomata::EncodedData> args =
+        get_strided_range_frames(video_index, video_bytes, {0});
+    for (auto &arg : args) {
+      std::vector<uint8_t>().swap(arg.encoded_video);
+      arg.encoded_video_ref = std::shared_ptr<const uint8_t>(
+          video_bytes.data(), [](const uint8_t *) {});
+      arg.encoded_video_ref_size = video_bytes.size();
+    }
+
+    DecoderAutomata *decoder = DecoderAutomata::make_instance(
+        CPU_DEVICE, 1, VideoDecoderType::SOFTWARE);
+    auto run = [&](int64_t cycles, bool reopen) {
+      auto start = std::chrono::steady_clock::now();
+      for (int64_t i = 0; i < cycles; ++i) {
+        // Alternating the quality forces the codec to be reopened
+        DecodeQuality quality = reopen && i % 2 == 1 ? DecodeQuality::FAST
+                                                     : DecodeQuality::EXACT;
+        EXPECT_TRUE(decoder->initialize(args, video_index.metadata_bytes(),
+                                        PixelFormat::RGB24, FrameGeometry(),
+                                        quality)
+                        .ok);
+      }
+      return std::chrono::duration<double, std::micro>(
+                 std::chrono::steady_clock::now() - start)
+                 .count() /
+             cycles;
+    };
+
+    const int64_t cycles = 100000;
+    double reopen_us = run(1000, true);
+    int64_t rss_start = rss();
+    double reuse_us = run(cycles, false);
+    int64_t rss_middle = rss();
+    run(1000, true);
+    int64_t rss_end = rss();
+    printf("%s: %.1f us per initialize reopening the codec, %.1f us reusing "
+           "it, RSS %ld -> %ld -> %ld KB\n",
+           video.data_url.c_str(), reopen_us, reuse_us, rss_start / 1024,
+           rss_middle / 1024, rss_end / 1024);
+    EXPECT_LT(reuse_us, reopen_us);
+    // Neither path should leak a context per cycle
+    if (rss_start >= 0 && rss_end >= 0) {
+      EXPECT_LT(rss_end - rss_start, 16 * 1024 * 1024);
+    }
+
+    delete decoder;
+  }
+}
+
 #ifdef HAVE_CUDA
 TEST(DecoderAutomata, GetAllFramesGPU) {
   std::vector<TestVideoInfo> videos = gpu_videos;
@@ -352,15 +1000,8 @@ TEST(DecoderAutomata, GetAllFramesGPU) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
 
     // Create decoder
     VideoDecoderType decoder_type = VideoDecoderType::NVIDIA;
@@ -398,15 +1039,8 @@ TEST(DecoderAutomata, GetStridedRangesFramesGPU) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
 
     // Create decoder
     VideoDecoderType decoder_type = VideoDecoderType::NVIDIA;
@@ -461,15 +1095,8 @@ TEST(DecoderAutomata, GatherFramesComparisonGPU) {
     std::vector<uint8_t> video_bytes = read_entire_file(download_video(video));
 
     // Create video index
-    MP4IndexCreator indexer(video_bytes.size());
-    uint64_t current_offset = 0;
-    uint64_t size_to_read = std::min((size_t)1024, video_bytes.size());
-    while (!indexer.is_done()) {
-      indexer.feed(video_bytes.data() + current_offset, size_to_read,
-                   current_offset, size_to_read);
-    }
-    ASSERT_FALSE(indexer.is_error());
-    VideoIndex video_index = indexer.get_video_index();
+    VideoIndex video_index;
+    ASSERT_TRUE(index_video_bytes(video_bytes, video_index));
 
     // Create decoder
     VideoDecoderType decoder_type = VideoDecoderType::NVIDIA;
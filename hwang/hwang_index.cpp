@@ -0,0 +1,158 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Writes a serialized VideoIndex for every video given on the command line or
+// in a file list:
+//
+//   hwang_index --file_list=videos.txt --output_dir=/indices
+//
+// Videos that can not be indexed are reported on stderr and do not stop the
+// others. The exit status is 1 if any video failed.
+
+#include "hwang/mp4_index_creator.h"
+#include "hwang/util/fs.h"
+
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+DEFINE_string(file_list, "",
+              "File with one video path per line, '-' to read stdin");
+DEFINE_string(output_dir, "",
+              "Directory the indices are written to, mirroring the video "
+              "paths. Indices are written next to the videos if empty.");
+DEFINE_string(suffix, ".index", "Appended to a video path to name its index");
+DEFINE_int32(index_version, hwang::VideoIndex::DEFAULT_SERIALIZE_VERSION,
+             "Format version of the indices written. Version 2 is about "
+             "half the size but can not be read by releases before it.");
+DEFINE_bool(flat, false,
+            "Write flat indices that VideoIndexView maps without parsing");
+DEFINE_bool(probe_samples, false,
+            "Read the slice headers of H.264 samples to find the ones the "
+            "decoder can skip when the file does not list them");
+DEFINE_int32(threads, 0, "Indexing threads, one per core if 0");
+DEFINE_int32(max_concurrent_reads, 0,
+             "Reads in flight at once across all threads, unlimited if 0");
+
+namespace {
+
+std::string index_path(const std::string &video_path) {
+  if (FLAGS_output_dir.empty()) {
+    return video_path + FLAGS_suffix;
+  }
+  size_t start = video_path.find_first_not_of('/');
+  return FLAGS_output_dir + "/" +
+         video_path.substr(start == std::string::npos ? 0 : start) +
+         FLAGS_suffix;
+}
+
+hwang::Result write_index(const std::string &path,
+                          const hwang::VideoIndex &index) {
+  if (!FLAGS_output_dir.empty() &&
+      hwang::mkdir_p(hwang::dirname_s(path).c_str(), 0755) != 0) {
+    return hwang::Result(false, "Could not create directory for " + path +
+                                    ": " + strerror(errno));
+  }
+  std::vector<uint8_t> data = FLAGS_flat
+                                  ? index.serialize_flat()
+                                  : index.serialize(FLAGS_index_version);
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write((const char *)data.data(), data.size());
+  file.close();
+  if (!file) {
+    return hwang::Result(false, "Could not write " + path);
+  }
+  return hwang::Result();
+}
+
+}
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage(
+      "Indexes mp4 videos for hwang\n"
+      "usage: hwang_index [flags] [video.mp4 ...]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_index_version < 1 ||
+      FLAGS_index_version > (int32_t)hwang::VideoIndex::SERIALIZE_VERSION) {
+    std::cerr << "--index_version must be between 1 and "
+              << hwang::VideoIndex::SERIALIZE_VERSION << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> paths(argv + 1, argv + argc);
+  if (!FLAGS_file_list.empty()) {
+    std::ifstream list_file;
+    if (FLAGS_file_list != "-") {
+      list_file.open(FLAGS_file_list);
+      if (!list_file) {
+        std::cerr << "Could not open " << FLAGS_file_list << std::endl;
+        return 1;
+      }
+    }
+    std::istream &list = FLAGS_file_list == "-" ? std::cin : list_file;
+    std::string line;
+    while (std::getline(list, line)) {
+      if (!line.empty()) {
+        paths.push_back(line);
+      }
+    }
+  }
+  if (paths.empty()) {
+    gflags::ShowUsageWithFlags(argv[0]);
+    return 1;
+  }
+
+  hwang::BatchIndexOptions options;
+  options.num_threads = FLAGS_threads;
+  options.max_concurrent_reads = FLAGS_max_concurrent_reads;
+  options.index.probe_samples = FLAGS_probe_samples;
+
+  std::mutex error_mutex;
+  std::atomic<uint64_t> failed{0};
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> syscalls{0};
+  auto start = std::chrono::steady_clock::now();
+  hwang::index_files(
+      paths,
+      [&](size_t i, const hwang::Result &indexed,
+          const hwang::VideoIndex &index, const hwang::IndexStats &stats) {
+        bytes_read += stats.bytes_read;
+        syscalls += stats.syscalls;
+        hwang::Result result = indexed;
+        if (result.ok) {
+          result = write_index(index_path(paths[i]), index);
+        }
+        if (!result.ok) {
+          failed++;
+          std::unique_lock<std::mutex> lk(error_mutex);
+          std::cerr << paths[i] << ": " << result.message << std::endl;
+        }
+      },
+      options);
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::cerr << "Indexed " << paths.size() - failed << " of " << paths.size()
+            << " videos in " << seconds << " s ("
+            << paths.size() / std::max(seconds, 1e-9) << " videos/s, "
+            << bytes_read / (1024.0 * 1024.0) << " MiB in " << syscalls
+            << " syscalls)" << std::endl;
+  return failed > 0 ? 1 : 0;
+}
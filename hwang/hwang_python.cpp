@@ -1,7 +1,9 @@
 #include "hwang/video_index.h"
+#include "hwang/video_index_view.h"
 #include "hwang/mp4_index_creator.h"
 #include "hwang/video_decoder_factory.h"
 #include "hwang/decoder_automata.h"
+#include "hwang/util/thread_budget.h"
 
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
@@ -12,15 +14,42 @@ namespace py = pybind11;
 
 namespace {
 
-std::string VideoIndex_serialize_wrapper(VideoIndex *index) {
-  auto serialized_data = index->serialize();
-  return std::string(serialized_data.begin(), serialized_data.end());
+py::bytes VideoIndex_serialize_wrapper(VideoIndex *index, uint32_t version) {
+  auto serialized_data = index->serialize(version);
+  return py::bytes(reinterpret_cast<const char *>(serialized_data.data()),
+                   serialized_data.size());
 }
 
-VideoIndex VideoIndex_deserialize_wrapper(const std::string &data) {
-  const uint8_t *data_ptr = reinterpret_cast<const uint8_t *>(data.data());
-  std::vector<uint8_t> v(data_ptr, data_ptr + data.size());
-  return VideoIndex::deserialize(v);
+py::bytes VideoIndex_serialize_flat_wrapper(VideoIndex *index) {
+  auto serialized_data = index->serialize_flat();
+  return py::bytes(reinterpret_cast<const char *>(serialized_data.data()),
+                   serialized_data.size());
+}
+
+VideoIndexView VideoIndexView_open_wrapper(const std::string &path) {
+  VideoIndexView view;
+  Result result = VideoIndexView::open(path, view);
+  if (!result.ok) {
+    throw std::runtime_error(result.message);
+  }
+  return view;
+}
+
+py::bytes VideoIndexView_metadata_bytes_wrapper(const VideoIndexView &view) {
+  return py::bytes(reinterpret_cast<const char *>(view.metadata_bytes()),
+                   view.metadata_size());
+}
+
+VideoIndex VideoIndex_deserialize_wrapper(py::buffer data) {
+  py::buffer_info info = data.request();
+  VideoIndex index;
+  Result result = VideoIndex::deserialize(
+      reinterpret_cast<const uint8_t *>(info.ptr), info.size * info.itemsize,
+      index);
+  if (!result.ok) {
+    throw std::runtime_error(result.message);
+  }
+  return index;
 }
 
 std::tuple<bool, uint64_t, uint64_t>
@@ -35,10 +64,82 @@ MP4IndexCreator_feed_wrapper(MP4IndexCreator *indexer, const std::string data,
   return std::make_tuple(ret, next_offset, next_size);
 }
 
+std::tuple<VideoIndex, IndexStats> index_file_wrapper(const std::string &path,
+                                                       bool probe_samples) {
+  IndexOptions options;
+  options.probe_samples = probe_samples;
+  VideoIndex index;
+  IndexStats stats;
+  Result result;
+  {
+    py::gil_scoped_release release;
+    result = index_file(path, index, &stats, options);
+  }
+  if (!result.ok) {
+    throw std::runtime_error(result.message);
+  }
+  return std::make_tuple(index, stats);
+}
+
+std::tuple<VideoIndex, IndexStats> index_buffer_wrapper(py::buffer data,
+                                                         bool probe_samples) {
+  // Indexes the Python buffer (bytes, mmap, numpy array, ...) in place
+  py::buffer_info view = data.request();
+  IndexOptions options;
+  options.probe_samples = probe_samples;
+  VideoIndex index;
+  IndexStats stats;
+  Result result;
+  {
+    py::gil_scoped_release release;
+    result = index_buffer(reinterpret_cast<const uint8_t *>(view.ptr),
+                          view.size * view.itemsize, index, &stats, options);
+  }
+  if (!result.ok) {
+    throw std::runtime_error(result.message);
+  }
+  return std::make_tuple(index, stats);
+}
+
+// Returns an (index, None) or (None, error message) tuple per path
+py::list index_files_wrapper(const std::vector<std::string> &paths,
+                             int32_t num_threads,
+                             int32_t max_concurrent_reads,
+                             bool probe_samples) {
+  BatchIndexOptions options;
+  options.num_threads = num_threads;
+  options.max_concurrent_reads = max_concurrent_reads;
+  options.index.probe_samples = probe_samples;
+  std::vector<VideoIndex> indices(paths.size());
+  std::vector<Result> results(paths.size());
+  {
+    py::gil_scoped_release release;
+    index_files(paths,
+                [&](size_t i, const Result &result, const VideoIndex &index,
+                    const IndexStats &stats) {
+                  results[i] = result;
+                  if (result.ok) {
+                    indices[i] = index;
+                  }
+                },
+                options);
+  }
+  py::list out;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (results[i].ok) {
+      out.append(py::make_tuple(std::move(indices[i]), py::none()));
+    } else {
+      out.append(py::make_tuple(py::none(), results[i].message));
+    }
+  }
+  return out;
+}
+
 std::vector<std::tuple<std::tuple<uint64_t, uint64_t>, std::vector<uint64_t>>>
 slice_into_video_intervals_wrapper(const VideoIndex &index,
-                                   std::vector<uint64_t> rows) {
-  VideoIntervals v = slice_into_video_intervals(index, rows);
+                                   std::vector<uint64_t> rows,
+                                   const IntervalCosts &costs) {
+  VideoIntervals v = slice_into_video_intervals(index, rows, costs);
   std::vector<std::tuple<std::tuple<uint64_t, uint64_t>, std::vector<uint64_t>>>
       tups;
   for (size_t i = 0; i < v.sample_index_intervals.size(); ++i) {
@@ -48,52 +149,89 @@ slice_into_video_intervals_wrapper(const VideoIndex &index,
   return tups;
 }
 
-std::string
+py::bytes
 EncodedData_encoded_video_wrapper(DecoderAutomata::EncodedData *data) {
-  return std::string(data->encoded_video.data(),
-                     data->encoded_video.data() + data->encoded_video.size());
+  return py::bytes(reinterpret_cast<const char *>(data->video_data()),
+                   data->video_size());
 }
 
 void EncodedData_encoded_video_write_wrapper(DecoderAutomata::EncodedData *data,
-                                             const std::string &v) {
-  data->encoded_video = std::vector<uint8_t>(v.data(), v.data() + v.size());
+                                             py::buffer v) {
+  // Reference the Python buffer (bytes, mmap, numpy array, ...) instead of
+  // copying it. The buffer view is released once the last EncodedData
+  // referencing it is destroyed.
+  py::buffer_info *view = new py::buffer_info(v.request());
+  data->encoded_video.clear();
+  data->encoded_video_ref_size = view->size * view->itemsize;
+  data->encoded_video_ref = std::shared_ptr<const uint8_t>(
+      reinterpret_cast<const uint8_t *>(view->ptr), [view](const uint8_t *) {
+        py::gil_scoped_acquire acquire;
+        delete view;
+      });
 }
 
 void DecoderAutomata_initialize_wrapper(
     DecoderAutomata &dec,
-    const std::vector<DecoderAutomata::EncodedData> &encoded_data,
-    const std::vector<uint8_t> &extradata) {
-  Result result = dec.initialize(encoded_data, extradata);
+    std::vector<DecoderAutomata::EncodedData> encoded_data,
+    const std::vector<uint8_t> &extradata, PixelFormat output_format,
+    const FrameGeometry &geometry, DecodeQuality quality) {
+  Result result = dec.initialize(std::move(encoded_data), extradata,
+                                 output_format, geometry, quality);
   if (!result.ok) {
     throw std::runtime_error(result.message);
   }
 }
 
-std::vector<py::array_t<uint8_t>> DecoderAutomata_get_frames_wrapper(
-    DecoderAutomata &dec, const VideoIndex &index, uint32_t num_frames) {
-  size_t frame_size = index.frame_width() * index.frame_height() * 3;
-  std::vector<uint8_t> frame_buffer(frame_size * num_frames);
-  Result result = dec.get_frames(frame_buffer.data(), num_frames);
+void DecoderAutomata_begin_frames_wrapper(DecoderAutomata &dec,
+                                         uint32_t num_frames) {
+  Result result = dec.begin_frames(num_frames);
   if (!result.ok) {
     throw std::runtime_error(result.message);
   }
+}
+
+py::array_t<uint8_t> DecoderAutomata_next_frame_wrapper(
+    DecoderAutomata &dec, const VideoIndex &index) {
+  size_t frame_size = dec.frame_size();
+  // Decode directly into the buffer handed to Python
+  uint8_t *buffer = (uint8_t *)malloc(frame_size);
+  Result result = dec.next_frame(buffer);
+  if (!result.ok) {
+    free(buffer);
+    throw std::runtime_error(result.message);
+  }
+  // Pass deallocation responsibility (i.e. ownership) to Python runtime.
+  // https://stackoverflow.com/questions/44659924/returning-numpy-arrays-via-pybind11
+  py::capsule free_when_done(buffer, [](void* buf) { free(buf); });
+  long int width = dec.output_width();
+  long int height = dec.output_height();
+  switch (dec.output_format()) {
+    case PixelFormat::RGB24:
+    case PixelFormat::BGR24:
+      return py::array_t<uint8_t>({height, width, 3L}, {width * 3, 3L, 1L},
+                                  buffer, free_when_done);
+    case PixelFormat::GRAY8:
+      return py::array_t<uint8_t>({height, width}, {width, 1L}, buffer,
+                                  free_when_done);
+    default:
+      // Planar formats are returned as rows of width bytes when the chroma
+      // planes divide evenly, as OpenCV expects for I420 and NV12
+      if (width % 2 == 0 && height % 2 == 0) {
+        return py::array_t<uint8_t>({height * 3 / 2, width}, {width, 1L},
+                                    buffer, free_when_done);
+      }
+      return py::array_t<uint8_t>({(long int)frame_size}, {1L}, buffer,
+                                  free_when_done);
+  }
+}
+
+std::vector<py::array_t<uint8_t>> DecoderAutomata_get_frames_wrapper(
+    DecoderAutomata &dec, const VideoIndex &index, uint32_t num_frames) {
+  DecoderAutomata_begin_frames_wrapper(dec, num_frames);
   std::vector<py::array_t<uint8_t>> frames;
   for (uint32_t i = 0; i < num_frames; ++i) {
-    uint8_t *buffer = (uint8_t *)malloc(frame_size);
-    memcpy(buffer,
-           frame_buffer.data() +
-               i * index.frame_width() * index.frame_height() * 3,
-           frame_size);
-    // Pass deallocation responsibility (i.e. ownership) to Python runtime.
-    // https://stackoverflow.com/questions/44659924/returning-numpy-arrays-via-pybind11
-    py::capsule free_when_done(buffer, [](void* buf) { free(buf); });
-    frames.push_back(py::array_t<uint8_t>(
-        {(long int)index.frame_height(), (long int)index.frame_width(), 3L},
-        {(long int)index.frame_width() * 3, 3L, 1L},
-        buffer,
-        free_when_done));
+    frames.push_back(DecoderAutomata_next_frame_wrapper(dec, index));
   }
-
   return frames;
 }
 
@@ -105,7 +243,8 @@ PYBIND11_MODULE(_python, m) {
 
   py::class_<VideoIndex>(m, "VideoIndex")
       .def_static("deserialize", &VideoIndex_deserialize_wrapper)
-      .def("serialize", &VideoIndex_serialize_wrapper)
+      .def("serialize", &VideoIndex_serialize_wrapper,
+           py::arg("version") = VideoIndex::DEFAULT_SERIALIZE_VERSION)
       .def("timescale", &VideoIndex::timescale)
       .def("duration", &VideoIndex::duration)
       .def("fps", &VideoIndex::fps)
@@ -116,17 +255,80 @@ PYBIND11_MODULE(_python, m) {
       .def("sample_offsets", &VideoIndex::sample_offsets)
       .def("sample_sizes", &VideoIndex::sample_sizes)
       .def("keyframe_indices", &VideoIndex::keyframe_indices)
-      .def("metadata_bytes", &VideoIndex::metadata_bytes);
+      .def("compact", &VideoIndex::compact)
+      .def("is_compact", &VideoIndex::is_compact)
+      .def("sample_offset", &VideoIndex::sample_offset)
+      .def("sample_size", &VideoIndex::sample_size)
+      .def("is_keyframe", &VideoIndex::is_keyframe)
+      .def("keyframe_at_or_before", &VideoIndex::keyframe_at_or_before)
+      .def("keyframe_at_or_after", &VideoIndex::keyframe_at_or_after)
+      .def("sample_table_bytes", &VideoIndex::sample_table_bytes)
+      .def("sample_flags", &VideoIndex::sample_flags)
+      .def("num_non_ref_frames", &VideoIndex::num_non_ref_frames)
+      .def("has_timestamps", &VideoIndex::has_timestamps)
+      .def("sample_decode_timestamp", &VideoIndex::sample_decode_timestamp)
+      .def("sample_presentation_timestamp",
+           &VideoIndex::sample_presentation_timestamp)
+      .def("frame_timestamp", &VideoIndex::frame_timestamp)
+      .def("frame_at_timestamp", &VideoIndex::frame_at_timestamp)
+      .def("frames_at_interval", &VideoIndex::frames_at_interval)
+      .def("metadata_bytes", &VideoIndex::metadata_bytes)
+      .def("serialize_flat", &VideoIndex_serialize_flat_wrapper);
+
+  py::class_<VideoIndexView>(m, "VideoIndexView")
+      .def_static("open", &VideoIndexView_open_wrapper, py::arg("path"))
+      .def("timescale", &VideoIndexView::timescale)
+      .def("duration", &VideoIndexView::duration)
+      .def("fps", &VideoIndexView::fps)
+      .def("frame_width", &VideoIndexView::frame_width)
+      .def("frame_height", &VideoIndexView::frame_height)
+      .def("format", &VideoIndexView::format)
+      .def("frames", &VideoIndexView::frames)
+      .def("sample_offset", &VideoIndexView::sample_offset)
+      .def("sample_size", &VideoIndexView::sample_size)
+      .def("sample_flags", &VideoIndexView::sample_flags)
+      .def("num_keyframes", &VideoIndexView::num_keyframes)
+      .def("keyframe_index", &VideoIndexView::keyframe_index)
+      .def("is_keyframe", &VideoIndexView::is_keyframe)
+      .def("keyframe_at_or_before", &VideoIndexView::keyframe_at_or_before)
+      .def("metadata_bytes", &VideoIndexView_metadata_bytes_wrapper);
 
   py::class_<MP4IndexCreator>(m, "MP4IndexCreator")
-      .def(py::init<uint64_t>())
+      .def(py::init([](uint64_t file_size, bool probe_samples) {
+             IndexOptions options;
+             options.probe_samples = probe_samples;
+             return new MP4IndexCreator(file_size, options);
+           }),
+           py::arg("file_size"), py::arg("probe_samples") = false)
       .def("feed", &MP4IndexCreator_feed_wrapper)
       .def("is_done", &MP4IndexCreator::is_done)
       .def("is_error", &MP4IndexCreator::is_error)
       .def("error_message", &MP4IndexCreator::error_message)
       .def("get_video_index", &MP4IndexCreator::get_video_index);
 
-  m.def("slice_into_video_intervals", &slice_into_video_intervals_wrapper);
+  py::class_<IndexStats>(m, "IndexStats")
+      .def(py::init<>())
+      .def_readonly("bytes_read", &IndexStats::bytes_read)
+      .def_readonly("syscalls", &IndexStats::syscalls);
+
+  m.def("index_file", &index_file_wrapper, py::arg("path"),
+        py::arg("probe_samples") = false);
+  m.def("index_buffer", &index_buffer_wrapper, py::arg("data"),
+        py::arg("probe_samples") = false);
+  m.def("index_files", &index_files_wrapper, py::arg("paths"),
+        py::arg("num_threads") = 0, py::arg("max_concurrent_reads") = 0,
+        py::arg("probe_samples") = false);
+
+  py::class_<IntervalCosts>(m, "IntervalCosts")
+      .def(py::init<>())
+      .def_readwrite("decode_frame", &IntervalCosts::decode_frame)
+      .def_readwrite("read_byte", &IntervalCosts::read_byte)
+      .def_readwrite("seek", &IntervalCosts::seek)
+      .def_readwrite("skip_non_ref_frames",
+                     &IntervalCosts::skip_non_ref_frames);
+
+  m.def("slice_into_video_intervals", &slice_into_video_intervals_wrapper,
+        py::arg("index"), py::arg("rows"), py::arg("costs") = IntervalCosts());
 
   py::enum_<DeviceType>(m, "DeviceType", py::arithmetic())
       .value("CPU", DeviceType::CPU)
@@ -137,6 +339,49 @@ PYBIND11_MODULE(_python, m) {
       .def_readwrite("type", &DeviceHandle::type)
       .def_readwrite("id", &DeviceHandle::id);
 
+  py::enum_<PixelFormat>(m, "PixelFormat")
+      .value("RGB24", PixelFormat::RGB24)
+      .value("YUV420P", PixelFormat::YUV420P)
+      .value("NV12", PixelFormat::NV12)
+      .value("GRAY8", PixelFormat::GRAY8)
+      .value("BGR24", PixelFormat::BGR24);
+
+  py::enum_<DecodeQuality>(m, "DecodeQuality")
+      .value("EXACT", DecodeQuality::EXACT)
+      .value("FAST", DecodeQuality::FAST)
+      .value("PREVIEW", DecodeQuality::PREVIEW);
+
+  py::enum_<ThreadingMode>(m, "ThreadingMode")
+      .value("AUTO", ThreadingMode::AUTO)
+      .value("FRAME", ThreadingMode::FRAME)
+      .value("SLICE", ThreadingMode::SLICE);
+
+  py::class_<ThreadingPolicy>(m, "ThreadingPolicy")
+      .def(py::init<>())
+      .def_readwrite("mode", &ThreadingPolicy::mode)
+      .def_readwrite("thread_count", &ThreadingPolicy::thread_count);
+
+  m.def("set_decoder_thread_budget",
+        [](int32_t threads) { ThreadBudget::global().set_total(threads); },
+        "Total number of threads shared by all software decoders");
+
+  py::enum_<Interpolation>(m, "Interpolation")
+      .value("NEAREST", Interpolation::NEAREST)
+      .value("BILINEAR", Interpolation::BILINEAR)
+      .value("BICUBIC", Interpolation::BICUBIC)
+      .value("AREA", Interpolation::AREA);
+
+  py::class_<FrameGeometry>(m, "FrameGeometry")
+      .def(py::init<>())
+      .def_readwrite("crop_x", &FrameGeometry::crop_x)
+      .def_readwrite("crop_y", &FrameGeometry::crop_y)
+      .def_readwrite("crop_width", &FrameGeometry::crop_width)
+      .def_readwrite("crop_height", &FrameGeometry::crop_height)
+      .def_readwrite("width", &FrameGeometry::width)
+      .def_readwrite("height", &FrameGeometry::height)
+      .def_readwrite("rotation", &FrameGeometry::rotation)
+      .def_readwrite("interpolation", &FrameGeometry::interpolation);
+
   py::enum_<VideoDecoderType>(m, "VideoDecoderType", py::arithmetic())
       .value("SOFTWARE", VideoDecoderType::SOFTWARE)
       .value("NVIDIA", VideoDecoderType::NVIDIA);
@@ -160,8 +405,30 @@ PYBIND11_MODULE(_python, m) {
       .def_readwrite("valid_frames",
                      &DecoderAutomata::EncodedData::valid_frames);
 
+  py::class_<DecoderAutomata::Stats>(m, "DecoderStats")
+      .def_readonly("frames_fed", &DecoderAutomata::Stats::frames_fed)
+      .def_readonly("frames_skipped", &DecoderAutomata::Stats::frames_skipped)
+      .def_readonly("frames_decoded", &DecoderAutomata::Stats::frames_decoded)
+      .def_readonly("frames_used", &DecoderAutomata::Stats::frames_used)
+      .def_readonly("warm_initializations",
+                    &DecoderAutomata::Stats::warm_initializations)
+      .def_readonly("segments_continued",
+                    &DecoderAutomata::Stats::segments_continued);
+
   py::class_<DecoderAutomata>(m, "DecoderAutomata")
       .def(py::init(&DecoderAutomata::make_instance))
-      .def("initialize", &DecoderAutomata_initialize_wrapper)
-      .def("get_frames", &DecoderAutomata_get_frames_wrapper);
+      .def("initialize", &DecoderAutomata_initialize_wrapper,
+           py::arg("encoded_data"), py::arg("extradata"),
+           py::arg("output_format") = PixelFormat::RGB24,
+           py::arg("geometry") = FrameGeometry(),
+           py::arg("quality") = DecodeQuality::EXACT)
+      .def("get_frames", &DecoderAutomata_get_frames_wrapper)
+      .def("begin_frames", &DecoderAutomata_begin_frames_wrapper)
+      .def("next_frame", &DecoderAutomata_next_frame_wrapper)
+      .def("set_threading_policy", &DecoderAutomata::set_threading_policy)
+      .def("set_huge_pages", &DecoderAutomata::set_huge_pages)
+      .def("set_skip_non_ref_frames",
+           &DecoderAutomata::set_skip_non_ref_frames)
+      .def("set_continue_segments", &DecoderAutomata::set_continue_segments)
+      .def("get_stats", &DecoderAutomata::get_stats);
 }
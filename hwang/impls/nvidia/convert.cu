@@ -218,4 +218,42 @@ cudaError_t convertNV12toRGBA(const uint8_t *in, size_t in_pitch,
   return cudaPeekAtLastError();
 }
 
+namespace {
+
+// Each thread handles one chroma sample and the 2x2 luma block it covers
+__global__ void NV12_to_I420(const uint8_t *src, size_t src_pitch,
+                             uint8_t *dst, int width, int height) {
+  const int chroma_width = (width + 1) / 2;
+  const int chroma_height = (height + 1) / 2;
+  const int cx = blockIdx.x * blockDim.x + threadIdx.x;
+  const int cy = blockIdx.y * blockDim.y + threadIdx.y;
+  if (cx >= chroma_width || cy >= chroma_height) {
+    return;
+  }
+
+  for (int y = cy * 2; y < min(cy * 2 + 2, height); ++y) {
+    for (int x = cx * 2; x < min(cx * 2 + 2, width); ++x) {
+      dst[y * width + x] = src[y * src_pitch + x];
+    }
+  }
+
+  const uint8_t *chroma = src + src_pitch * height + cy * src_pitch + cx * 2;
+  uint8_t *u_plane = dst + (size_t)width * height;
+  uint8_t *v_plane = u_plane + (size_t)chroma_width * chroma_height;
+  u_plane[cy * chroma_width + cx] = chroma[0];
+  v_plane[cy * chroma_width + cx] = chroma[1];
+}
+
+}
+
+cudaError_t convertNV12toYUV420P(const uint8_t *in, size_t in_pitch,
+                                 uint8_t *out, int width, int height,
+                                 cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp((width + 1) / 2, block.x), divUp((height + 1) / 2, block.y));
+
+  NV12_to_I420<<<grid, block, 0, stream>>>(in, in_pitch, out, width, height);
+  return cudaPeekAtLastError();
+}
+
 }
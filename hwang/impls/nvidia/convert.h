@@ -28,6 +28,13 @@ cudaError_t convertNV12toRGBA(
     int width, int height,
     cudaStream_t stream);
 
+// Writes the Y, U and V planes contiguously to out
+cudaError_t convertNV12toYUV420P(
+    const uint8_t *in,
+    size_t inPitch, uint8_t *out,
+    int width, int height,
+    cudaStream_t stream);
+
 #endif
 
 }
@@ -54,6 +54,8 @@ NVIDIAVideoDecoder::NVIDIAVideoDecoder(int device_id, DeviceType output_type,
     output_type_(output_type),
     cuda_context_(cuda_context),
     streams_(max_mapped_frames_),
+    codec_(nullptr),
+    cc_(nullptr),
     parser_(nullptr),
     decoder_(nullptr),
     frame_queue_read_pos_(0),
@@ -148,6 +150,7 @@ Result NVIDIAVideoDecoder::configure(const FrameInfo& metadata,
     bitstream_filter_name_ = "h264_mp4toannexb";
   } else if (metadata.format == "h265" ||
              metadata.format == "hev1" ||
+             metadata.format == "hvc1" ||
              metadata.format == "hevc") {
     codec_id = AV_CODEC_ID_HEVC;
     cuda_codec_id = cudaVideoCodec_HEVC;
@@ -162,6 +165,10 @@ Result NVIDIAVideoDecoder::configure(const FrameInfo& metadata,
     return Result(false,
                   "Could not find decoder for codec: " + metadata.format);
   }
+  // The context only serves the bitstream filter, so it is recreated
+  if (cc_ != nullptr) {
+    avcodec_free_context(&cc_);
+  }
   cc_ = avcodec_alloc_context3(codec_);
   if (!cc_) {
     return Result(false, "Could not alloc codec context for codec: " +
@@ -180,12 +187,28 @@ Result NVIDIAVideoDecoder::configure(const FrameInfo& metadata,
 
   frame_width_ = metadata.width;
   frame_height_ = metadata.height;
+  output_format_ = metadata.output_format;
+  if (output_format_ == PixelFormat::BGR24) {
+    return Result(false, "BGR24 output is not supported by the NVIDIA decoder");
+  }
+  HWANG_RETURN_ON_ERROR(resolve_geometry(metadata.geometry, frame_width_,
+                                         frame_height_, geometry_));
+  // The decoder crops and resizes while writing its output surface, but can
+  // not rotate, and always uses its own filter
+  if (geometry_.rotation != 0) {
+    return Result(false, "Rotation is not supported by the NVIDIA decoder");
+  }
+  output_width_ = geometry_.width;
+  output_height_ = geometry_.height;
+  // NVDEC has no speed knobs, so every quality decodes exactly
   metadata_packets_ = extradata;
 
   if (convert_frame_ != nullptr) {
     CU_CHECK(cudaFree(convert_frame_));
   }
-  CU_CHECK(cudaMalloc(&convert_frame_, frame_width_ * frame_height_ * 3));
+  CU_CHECK(cudaMalloc(&convert_frame_, frame_buffer_size(output_format_,
+                                                         output_width_,
+                                                         output_height_)));
 
   if (cc_->extradata_size > 0 && cc_->extradata != nullptr) {
     free(cc_->extradata);
@@ -248,13 +271,18 @@ Result NVIDIAVideoDecoder::configure(const FrameInfo& metadata,
 
   cuinfo.ulWidth = frame_width_;
   cuinfo.ulHeight = frame_height_;
-  cuinfo.ulTargetWidth = cuinfo.ulWidth;
-  cuinfo.ulTargetHeight = cuinfo.ulHeight;
+  cuinfo.ulTargetWidth = output_width_;
+  cuinfo.ulTargetHeight = output_height_;
+
+  cuinfo.display_area.left = geometry_.crop_x;
+  cuinfo.display_area.top = geometry_.crop_y;
+  cuinfo.display_area.right = geometry_.crop_x + geometry_.crop_width;
+  cuinfo.display_area.bottom = geometry_.crop_y + geometry_.crop_height;
 
   cuinfo.target_rect.left = 0;
   cuinfo.target_rect.top = 0;
-  cuinfo.target_rect.right = cuinfo.ulWidth;
-  cuinfo.target_rect.bottom = cuinfo.ulHeight;
+  cuinfo.target_rect.right = cuinfo.ulTargetWidth;
+  cuinfo.target_rect.bottom = cuinfo.ulTargetHeight;
 
   cuinfo.ulNumDecodeSurfaces = max_output_frames_;
   cuinfo.ulNumOutputSurfaces = max_mapped_frames_;
@@ -391,6 +419,11 @@ Result NVIDIAVideoDecoder::flush() {
   return Result();
 }
 
+void NVIDIAVideoDecoder::get_output_size(uint32_t &width, uint32_t &height) {
+  width = output_width_;
+  height = output_height_;
+}
+
 Result NVIDIAVideoDecoder::discard_frame() {
   std::unique_lock<std::mutex> lock(frame_queue_mutex_);
   CUD_CHECK(cuCtxPushCurrent(cuda_context_));
@@ -401,6 +434,7 @@ Result NVIDIAVideoDecoder::discard_frame() {
     frame_in_use_[dispinfo.picture_index] = false;
     frame_queue_read_pos_ = (frame_queue_read_pos_ + 1) % max_output_frames_;
     frame_queue_elements_--;
+    frame_queue_changed_.notify_all();
   }
 
   CUcontext dummy;
@@ -420,6 +454,7 @@ Result NVIDIAVideoDecoder::get_frame(uint8_t *decoded_buffer,
     frame_queue_read_pos_ = (frame_queue_read_pos_ + 1) % max_output_frames_;
     frame_queue_elements_--;
     lock.unlock();
+    frame_queue_changed_.notify_all();
 
     CUVIDPROCPARAMS params = {};
     params.progressive_frame = dispinfo.progressive_frame;
@@ -439,11 +474,43 @@ Result NVIDIAVideoDecoder::get_frame(uint8_t *decoded_buffer,
     //   profiler_->add_interval("map_frame", start_map, now());
     // }
     CUdeviceptr mapped_frame = mapped_frames_[mapped_frame_index];
-    CU_CHECK(convertNV12toRGBA(reinterpret_cast<const uint8_t *>(mapped_frame),
-                               pitch, convert_frame_, frame_width_ * 3,
-                               frame_width_, frame_height_, 0));
-    CU_CHECK(cudaMemcpy(decoded_buffer, convert_frame_,
-                        frame_width_ * frame_height_ * 3, cudaMemcpyDefault));
+    const uint8_t *mapped_data =
+        reinterpret_cast<const uint8_t *>(mapped_frame);
+    size_t frame_size =
+        frame_buffer_size(output_format_, output_width_, output_height_);
+    // The mapped surface holds the cropped and resized frame
+    switch (output_format_) {
+      case PixelFormat::RGB24:
+        CU_CHECK(convertNV12toRGBA(mapped_data, pitch, convert_frame_,
+                                   output_width_ * 3, output_width_,
+                                   output_height_, 0));
+        CU_CHECK(cudaMemcpy(decoded_buffer, convert_frame_, frame_size,
+                            cudaMemcpyDefault));
+        break;
+      case PixelFormat::YUV420P:
+        CU_CHECK(convertNV12toYUV420P(mapped_data, pitch, convert_frame_,
+                                      output_width_, output_height_, 0));
+        CU_CHECK(cudaMemcpy(decoded_buffer, convert_frame_, frame_size,
+                            cudaMemcpyDefault));
+        break;
+      case PixelFormat::NV12:
+      case PixelFormat::GRAY8: {
+        // The decoder's surface is already NV12 so only the pitch is removed
+        CU_CHECK(cudaMemcpy2D(decoded_buffer, output_width_, mapped_data,
+                              pitch, output_width_, output_height_,
+                              cudaMemcpyDefault));
+        if (output_format_ == PixelFormat::NV12) {
+          size_t chroma_width = ((output_width_ + 1) / 2) * 2;
+          CU_CHECK(cudaMemcpy2D(
+              decoded_buffer + output_width_ * output_height_, chroma_width,
+              mapped_data + pitch * output_height_, pitch, chroma_width,
+              (output_height_ + 1) / 2, cudaMemcpyDefault));
+        }
+        break;
+      }
+      default:
+        break;
+    }
 
     CUD_CHECK(
         cuvidUnmapVideoFrame(decoder_, mapped_frames_[mapped_frame_index]));
@@ -467,6 +534,27 @@ int NVIDIAVideoDecoder::decoded_frames_buffered() {
   return frame_queue_elements_;
 }
 
+void NVIDIAVideoDecoder::wait_until_frames_buffered(
+    int num_frames, const std::function<bool()> &cancel) {
+  std::unique_lock<std::mutex> lock(frame_queue_mutex_);
+  frame_queue_changed_.wait(lock, [&] {
+    return cancel() || frame_queue_elements_ >= num_frames;
+  });
+}
+
+void NVIDIAVideoDecoder::wait_until_space_available(
+    int num_frames, const std::function<bool()> &cancel) {
+  std::unique_lock<std::mutex> lock(frame_queue_mutex_);
+  frame_queue_changed_.wait(lock, [&] {
+    return cancel() || frame_queue_elements_ <= num_frames;
+  });
+}
+
+void NVIDIAVideoDecoder::notify_waiters() {
+  { std::unique_lock<std::mutex> lock(frame_queue_mutex_); }
+  frame_queue_changed_.notify_all();
+}
+
 Result NVIDIAVideoDecoder::wait_until_frames_copied() { return Result(); }
 
 int NVIDIAVideoDecoder::cuvid_handle_video_sequence(void* opaque,
@@ -500,19 +588,19 @@ int NVIDIAVideoDecoder::cuvid_handle_picture_display(
       std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
       decoder.frame_in_use_[dispinfo->picture_index] = true;
     }
-    while (true) {
+    {
       std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
-      if (decoder.frame_queue_elements_ < max_output_frames_) {
-        int write_pos =
-            (decoder.frame_queue_read_pos_ + decoder.frame_queue_elements_) %
-            max_output_frames_;
-        decoder.frame_queue_[write_pos] = *dispinfo;
-        decoder.frame_queue_elements_++;
-        decoder.last_displayed_frame_++;
-        break;
-      }
-      usleep(1000);
+      decoder.frame_queue_changed_.wait(lock, [&decoder] {
+        return decoder.frame_queue_elements_ < max_output_frames_;
+      });
+      int write_pos =
+          (decoder.frame_queue_read_pos_ + decoder.frame_queue_elements_) %
+          max_output_frames_;
+      decoder.frame_queue_[write_pos] = *dispinfo;
+      decoder.frame_queue_elements_++;
+      decoder.last_displayed_frame_++;
     }
+    decoder.frame_queue_changed_.notify_all();
   } else {
     std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
     decoder.invalid_frames_[dispinfo->picture_index] = false;
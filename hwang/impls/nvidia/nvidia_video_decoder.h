@@ -22,6 +22,9 @@
 #include <cuda.h>
 #include <cuda_runtime.h>
 
+#include <condition_variable>
+#include <mutex>
+
 #if CUDA_VERSION >= 9000
 #include "hwang/impls/nvidia/nvcuvid.h"
 #else
@@ -59,12 +62,22 @@ public:
 
   Result flush() override;
 
+  void get_output_size(uint32_t &width, uint32_t &height) override;
+
   Result discard_frame() override;
 
   Result get_frame(uint8_t *decoded_buffer, size_t decoded_size) override;
 
   int decoded_frames_buffered() override;
 
+  void wait_until_frames_buffered(
+      int num_frames, const std::function<bool()> &cancel) override;
+
+  void wait_until_space_available(
+      int num_frames, const std::function<bool()> &cancel) override;
+
+  void notify_waiters() override;
+
   Result wait_until_frames_copied() override;
 
 private:
@@ -89,6 +102,11 @@ private:
 
   int32_t frame_width_;
   int32_t frame_height_;
+  // Size of the returned frames after cropping and resizing
+  int32_t output_width_;
+  int32_t output_height_;
+  FrameGeometry geometry_;
+  PixelFormat output_format_;
   std::vector<uint8_t> metadata_packets_;
   CUvideoparser parser_;
   CUvideodecoder decoder_;
@@ -99,6 +117,8 @@ private:
   volatile int32_t invalid_frames_[max_output_frames_];
 
   std::mutex frame_queue_mutex_;
+  // Signaled whenever frame_queue_elements_ changes
+  std::condition_variable frame_queue_changed_;
   CUVIDPARSERDISPINFO frame_queue_[max_output_frames_];
   int32_t frame_queue_read_pos_;
   int32_t frame_queue_elements_;
@@ -0,0 +1,143 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hwang/impls/software/frame_arena.h"
+
+extern "C" {
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
+}
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+namespace hwang {
+
+namespace {
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+void free_buffer(void *opaque, uint8_t *data) { free(data); }
+
+}
+
+FrameArena::FrameArena() : huge_pages_(false), allocations_(0) {}
+
+FrameArena::~FrameArena() { clear(); }
+
+int FrameArena::get_buffer2(AVCodecContext *cc, AVFrame *frame, int flags) {
+  FrameArena *arena = (FrameArena *)cc->opaque;
+  AVPixelFormat format = (AVPixelFormat)frame->format;
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+  if (arena == nullptr || !(cc->codec->capabilities & AV_CODEC_CAP_DR1) ||
+      desc == nullptr ||
+      (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+    return avcodec_default_get_buffer2(cc, frame, flags);
+  }
+
+  // Padded the same way as libavcodec's own buffers so the decoder can write
+  // past the visible edges
+  int width = frame->width;
+  int height = frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(cc, &width, &height, linesize_align);
+  int linesizes[4];
+  if (av_image_fill_linesizes(linesizes, format, width) < 0) {
+    return avcodec_default_get_buffer2(cc, frame, flags);
+  }
+
+  // All planes share one buffer so a frame takes a single pool entry
+  int planes = av_pix_fmt_count_planes(format);
+  size_t offsets[4];
+  size_t size = 0;
+  for (int p = 0; p < planes; ++p) {
+    int align = std::max((int)ALIGNMENT, linesize_align[p]);
+    linesizes[p] = (linesizes[p] + align - 1) & ~(align - 1);
+    int plane_height = height;
+    if (p == 1 || p == 2) {
+      plane_height = -((-height) >> desc->log2_chroma_h);
+    }
+    offsets[p] = size;
+    size += (size_t)linesizes[p] * plane_height;
+  }
+  // Some decoders read up to 16 bytes past the end of the last row
+  size += 16 + ALIGNMENT - 1;
+
+  AVBufferRef *buffer = arena->get(size);
+  if (buffer == nullptr) {
+    return AVERROR(ENOMEM);
+  }
+  frame->buf[0] = buffer;
+  for (int p = 0; p < AV_NUM_DATA_POINTERS; ++p) {
+    frame->data[p] = p < planes ? buffer->data + offsets[p] : nullptr;
+    frame->linesize[p] = p < planes ? linesizes[p] : 0;
+  }
+  frame->extended_data = frame->data;
+  return 0;
+}
+
+AVBufferRef *FrameArena::get(size_t size) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto it = pools_.find(size);
+  if (it == pools_.end()) {
+    AVBufferPool *pool =
+        av_buffer_pool_init2(size, this, &FrameArena::alloc, nullptr);
+    if (pool == nullptr) {
+      return nullptr;
+    }
+    it = pools_.emplace(size, pool).first;
+  }
+  return av_buffer_pool_get(it->second);
+}
+
+void FrameArena::clear() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  for (auto &kv : pools_) {
+    av_buffer_pool_uninit(&kv.second);
+  }
+  pools_.clear();
+}
+
+AVBufferRef *FrameArena::alloc(void *opaque, int size) {
+  FrameArena *arena = (FrameArena *)opaque;
+  size_t alignment = ALIGNMENT;
+  size_t bytes = size;
+  // Only buffers spanning whole huge pages benefit from them
+  bool huge_pages = arena->huge_pages_ && bytes >= HUGE_PAGE_SIZE;
+  if (huge_pages) {
+    alignment = HUGE_PAGE_SIZE;
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+  void *data = nullptr;
+  if (posix_memalign(&data, alignment, bytes) != 0) {
+    return nullptr;
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages) {
+    // Advisory: without transparent huge pages this has no effect
+    madvise(data, bytes, MADV_HUGEPAGE);
+  }
+#endif
+  AVBufferRef *buffer =
+      av_buffer_create((uint8_t *)data, size, free_buffer, nullptr, 0);
+  if (buffer == nullptr) {
+    free(data);
+    return nullptr;
+  }
+  arena->allocations_++;
+  return buffer;
+}
+
+}
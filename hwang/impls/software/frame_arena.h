@@ -0,0 +1,68 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/buffer.h"
+}
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+namespace hwang {
+
+// Picture buffers for a decoder's frames. Buffers are recycled through one
+// pool per size class, so once every pool has warmed up decoding does not
+// allocate. Buffers can be backed by transparent huge pages to reduce TLB
+// misses on large frames.
+class FrameArena {
+ public:
+  // Alignment of every buffer and of each plane's rows
+  static const int32_t ALIGNMENT = 64;
+
+  FrameArena();
+
+  ~FrameArena();
+
+  // Applies to buffers allocated after the call
+  void set_huge_pages(bool huge_pages) { huge_pages_ = huge_pages; }
+
+  // get_buffer2 callback for a codec context whose opaque points to an
+  // arena. Falls back to the default allocator for codecs that can not
+  // decode into user buffers. Thread safe.
+  static int get_buffer2(AVCodecContext *cc, AVFrame *frame, int flags);
+
+  // Reference to a buffer of at least size bytes
+  AVBufferRef *get(size_t size);
+
+  // Drops all pools. Buffers still referenced by frames are freed when the
+  // frames release them.
+  void clear();
+
+  // Buffers allocated since the arena was created
+  int64_t allocations() const { return allocations_; }
+
+ private:
+  static AVBufferRef *alloc(void *opaque, int size);
+
+  std::mutex mutex_;
+  // Keyed by buffer size, which follows from the frame geometry
+  std::map<size_t, AVBufferPool *> pools_;
+  std::atomic<bool> huge_pages_;
+  std::atomic<int64_t> allocations_;
+};
+
+}
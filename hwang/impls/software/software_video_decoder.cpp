@@ -14,7 +14,8 @@
  */
 
 #include "hwang/impls/software/software_video_decoder.h"
-#include "hwang/util/h264.h"
+#include "hwang/util/color.h"
+#include "hwang/util/thread_budget.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"
@@ -26,6 +27,7 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+#include <algorithm>
 #include <cassert>
 
 namespace hwang {
@@ -36,34 +38,90 @@ int32_t now() {
   return 0;
 }
 
-typedef struct BSFCompatContext {
-    AVBSFContext *ctx;
-    int extradata_updated;
-} BSFCompatContext;
-
-typedef struct H264BSFContext {
-    int32_t  sps_offset;
-    int32_t  pps_offset;
-    uint8_t  length_size;
-    uint8_t  new_idr;
-    uint8_t  idr_sps_seen;
-    uint8_t  idr_pps_seen;
-    int      extradata_parsed;
-} H264BSFContext;
+AVPixelFormat to_av_pixel_format(PixelFormat format) {
+  switch (format) {
+    case PixelFormat::RGB24:
+      return AV_PIX_FMT_RGB24;
+    case PixelFormat::YUV420P:
+      return AV_PIX_FMT_YUV420P;
+    case PixelFormat::NV12:
+      return AV_PIX_FMT_NV12;
+    case PixelFormat::GRAY8:
+      return AV_PIX_FMT_GRAY8;
+    case PixelFormat::BGR24:
+      return AV_PIX_FMT_BGR24;
+  }
+  return AV_PIX_FMT_NONE;
+}
+
+// Whether frames decoded as decoded_format can be copied plane by plane into
+// output_format instead of being converted
+bool can_copy_planes(AVPixelFormat decoded_format,
+                     AVPixelFormat output_format) {
+  if (decoded_format == output_format) {
+    return true;
+  }
+  switch (output_format) {
+    case AV_PIX_FMT_YUV420P:
+      return decoded_format == AV_PIX_FMT_YUVJ420P;
+    case AV_PIX_FMT_GRAY8:
+      // Formats that start with a full resolution 8-bit luma plane
+      return decoded_format == AV_PIX_FMT_YUV420P ||
+             decoded_format == AV_PIX_FMT_YUVJ420P ||
+             decoded_format == AV_PIX_FMT_YUV422P ||
+             decoded_format == AV_PIX_FMT_YUVJ422P ||
+             decoded_format == AV_PIX_FMT_YUV444P ||
+             decoded_format == AV_PIX_FMT_YUVJ444P ||
+             decoded_format == AV_PIX_FMT_NV12 ||
+             decoded_format == AV_PIX_FMT_NV21;
+    default:
+      return false;
+  }
+}
+
+// Whether frames decoded as decoded_format can be converted with
+// yuv420_to_rgb24 instead of sws_scale. sws_scale converts these formats
+// without interpolating chroma when the height is even, as yuv420_to_rgb24
+// does, so the output only differs by rounding. Other inputs are left to
+// sws_scale, which interpolates chroma for them.
+bool can_convert_yuv420(AVPixelFormat decoded_format,
+                        AVPixelFormat output_format, int32_t height) {
+  return (output_format == AV_PIX_FMT_RGB24 ||
+          output_format == AV_PIX_FMT_BGR24) &&
+         (decoded_format == AV_PIX_FMT_YUV420P ||
+          decoded_format == AV_PIX_FMT_YUVJ420P) &&
+         height % 2 == 0;
+}
+
+int sws_flags(Interpolation interpolation) {
+  switch (interpolation) {
+    case Interpolation::NEAREST:
+      return SWS_POINT;
+    case Interpolation::BILINEAR:
+      return SWS_BILINEAR;
+    case Interpolation::BICUBIC:
+      return SWS_BICUBIC;
+    case Interpolation::AREA:
+      return SWS_AREA;
+  }
+  return SWS_BILINEAR;
+}
 
 }
 ///////////////////////////////////////////////////////////////////////////////
 /// SoftwareVideoDecoder
 SoftwareVideoDecoder::SoftwareVideoDecoder(int32_t device_id,
-                                           DeviceType output_type,
-                                           int32_t thread_count)
+                                           DeviceType output_type)
   : device_id_(device_id),
     output_type_(output_type),
-    thread_count_(thread_count),
+    budget_threads_(0),
     codec_(nullptr),
     cc_(nullptr),
-    reset_context_(true),
     sws_context_(nullptr),
+    packet_pool_(nullptr),
+    packet_pool_size_(0),
+    frame_width_(0),
+    frame_height_(0),
     frame_pool_(1024),
     decoded_frame_queue_(1024) {
 
@@ -72,20 +130,11 @@ SoftwareVideoDecoder::SoftwareVideoDecoder(int32_t device_id,
 
   av_init_packet(&packet_);
 
-  annexb_ = nullptr;
+  ThreadBudget::global().register_decoder();
 }
 
 SoftwareVideoDecoder::~SoftwareVideoDecoder() {
-  if (annexb_) {
-    av_bitstream_filter_close(annexb_);
-  }
-
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
-  avcodec_free_context(&cc_);
-#else
-  avcodec_close(cc_);
-  av_freep(&cc_);
-#endif
+  close_codec();
   while (frame_pool_.size() > 0) {
     AVFrame* frame;
     frame_pool_.pop(frame);
@@ -98,140 +147,197 @@ SoftwareVideoDecoder::~SoftwareVideoDecoder() {
   }
 
   sws_freeContext(sws_context_);
+  av_buffer_pool_uninit(&packet_pool_);
+
+  ThreadBudget::global().unregister_decoder();
 }
 
 Result SoftwareVideoDecoder::configure(const FrameInfo &metadata,
                                        const std::vector<uint8_t> &extradata) {
-  if (annexb_) {
-    av_bitstream_filter_close(annexb_);
-  }
-
-  metadata_ = metadata;
-  frame_width_ = metadata_.width;
-  frame_height_ = metadata_.height;
-  reset_context_ = true;
-
-  int required_size = av_image_get_buffer_size(AV_PIX_FMT_RGB24, frame_width_,
-                                               frame_height_, 1);
-
-  conversion_buffer_.resize(required_size);
-
-  extradata_ = extradata;
-  extradata_.resize(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
-
   AVCodecID codec_id = AV_CODEC_ID_H264;
-  bitstream_filter_name_ = "h264_mp4toannexb";
   if (metadata.format == "h264" ||
       metadata.format == "avc1") {
     codec_id = AV_CODEC_ID_H264;
-    bitstream_filter_name_ = "h264_mp4toannexb";
   } else if (metadata.format == "h265" ||
              metadata.format == "hev1" ||
+             metadata.format == "hvc1" ||
              metadata.format == "hevc") {
     codec_id = AV_CODEC_ID_HEVC;
-    bitstream_filter_name_ = "hevc_mp4toannexb";
   } else {
     return Result(false, "Unsupported video codec: " + metadata.format +
                              ". Supported codecs are: h264, hevc/h265");
   }
+
+  // Consecutive intervals of the same video only differ in the samples fed,
+  // so the open codec is reset instead of being reopened. The output format
+  // and geometry are applied after decoding and do not affect the codec.
+  bool reuse_codec =
+      cc_ != nullptr && cc_->codec_id == codec_id &&
+      metadata.width == metadata_.width &&
+      metadata.height == metadata_.height &&
+      metadata.quality == metadata_.quality &&
+      metadata.threading == metadata_.threading &&
+      metadata.huge_pages == metadata_.huge_pages &&
+      extradata.size() == (size_t)cc_->extradata_size &&
+      std::equal(extradata.begin(), extradata.end(), cc_->extradata);
+
+  metadata_ = metadata;
+
+  output_format_ = to_av_pixel_format(metadata_.output_format);
+  if (output_format_ == AV_PIX_FMT_NONE) {
+    return Result(false, "Unsupported output pixel format");
+  }
+
+  if (reuse_codec && metadata_.threading.thread_count == 0) {
+    // The share changes as decoders come and go. The thread count of an open
+    // codec is fixed, so it is reopened when the share changed.
+    ThreadBudget &budget = ThreadBudget::global();
+    int32_t previous = budget_threads_;
+    budget.release(previous);
+    budget_threads_ = budget.acquire(0);
+    reuse_codec = budget_threads_ == previous;
+  }
+
+  if (reuse_codec) {
+    avcodec_flush_buffers(cc_);
+    while (decoded_frames_buffered() > 0) {
+      HWANG_RETURN_ON_ERROR(discard_frame());
+    }
+  } else {
+    HWANG_RETURN_ON_ERROR(open_codec(codec_id, extradata));
+  }
+
+  frame_width_ = metadata_.width;
+  frame_height_ = metadata_.height;
+  HWANG_RETURN_ON_ERROR(resolve_geometry(metadata_.geometry, frame_width_,
+                                         frame_height_, geometry_));
+
+  return Result();
+}
+
+int32_t SoftwareVideoDecoder::conversion_threads() const {
+  return std::max(
+      std::min(budget_threads_, color_conversion_pool().num_workers() + 1),
+      1);
+}
+
+Result SoftwareVideoDecoder::open_codec(AVCodecID codec_id,
+                                        const std::vector<uint8_t> &extradata) {
+  close_codec();
+
   codec_ = avcodec_find_decoder(codec_id);
   if (!codec_) {
     return Result(false,
-                  "Could not find decoder for codec: " + metadata.format);
+                  "Could not find decoder for codec: " + metadata_.format);
   }
   cc_ = avcodec_alloc_context3(codec_);
   if (!cc_) {
     return Result(false, "Could not alloc codec context for codec: " +
-                             metadata.format);
+                             metadata_.format);
   }
 
-  cc_->thread_count = thread_count_;
+  budget_threads_ =
+      ThreadBudget::global().acquire(metadata_.threading.thread_count);
+  cc_->thread_count = budget_threads_;
+  cc_->thread_type = metadata_.threading.mode == ThreadingMode::SLICE
+                         ? FF_THREAD_SLICE
+                         : FF_THREAD_FRAME;
+
+  // Decoded pictures are recycled instead of being allocated per frame
+  frame_arena_.set_huge_pages(metadata_.huge_pages);
+  cc_->opaque = &frame_arena_;
+  cc_->get_buffer2 = &FrameArena::get_buffer2;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+  // Otherwise frame threads serialize their get_buffer2 calls
+  cc_->thread_safe_callbacks = 1;
+#endif
 
-  if (avcodec_open2(cc_, codec_, NULL) < 0) {
-    return Result(false, "Could not open codec for format: " +
-                             metadata.format);
+  // The skip options are only honored by some codecs and otherwise ignored
+  switch (metadata_.quality) {
+    case DecodeQuality::EXACT:
+      break;
+    case DecodeQuality::FAST:
+      cc_->flags2 |= AV_CODEC_FLAG2_FAST;
+      cc_->skip_loop_filter = AVDISCARD_NONREF;
+      break;
+    case DecodeQuality::PREVIEW:
+      cc_->flags2 |= AV_CODEC_FLAG2_FAST;
+      cc_->skip_loop_filter = AVDISCARD_ALL;
+      cc_->skip_idct = AVDISCARD_NONREF;
+      break;
   }
 
-  if (cc_->extradata_size > 0 && cc_->extradata != nullptr) {
-    free(cc_->extradata);
+  // Pools sized for the previous resolution would otherwise hold on to
+  // their buffers for the lifetime of the decoder
+  if ((int32_t)metadata_.width != frame_width_ ||
+      (int32_t)metadata_.height != frame_height_) {
+    frame_arena_.clear();
   }
-  cc_->extradata = (uint8_t*)malloc(extradata_.size());
-  memcpy(cc_->extradata, extradata_.data(), extradata_.size());
-  cc_->extradata_size = extradata_.size();
 
-  annexb_ = av_bitstream_filter_init(bitstream_filter_name_.c_str());
+  // The decoder reads the parameter sets and NAL length size from the
+  // avcC/hvcC box, so samples can be sent as stored in the mp4 without
+  // rewriting them to Annex B
+  cc_->extradata =
+      (uint8_t *)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (!cc_->extradata) {
+    close_codec();
+    return Result(false, "Could not allocate codec extradata");
+  }
+  memcpy(cc_->extradata, extradata.data(), extradata.size());
+  cc_->extradata_size = extradata.size();
 
+  if (avcodec_open2(cc_, codec_, NULL) < 0) {
+    // A half configured context must not be mistaken for an open codec by
+    // the next configure
+    close_codec();
+    return Result(false, "Could not open codec for format: " +
+                             metadata_.format);
+  }
   return Result();
 }
 
+void SoftwareVideoDecoder::close_codec() {
+  if (cc_ == nullptr) {
+    return;
+  }
+  // Frames of the previous stream must not be returned after reopening
+  while (decoded_frames_buffered() > 0) {
+    discard_frame();
+  }
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
+  avcodec_free_context(&cc_);
+#else
+  avcodec_close(cc_);
+  av_freep(&cc_);
+#endif
+  ThreadBudget::global().release(budget_threads_);
+  budget_threads_ = 0;
+}
+
 Result SoftwareVideoDecoder::feed(const uint8_t *encoded_buffer,
                                   size_t encoded_size, bool keyframe) {
-  uint8_t *filtered_buffer = nullptr;
-  int32_t filtered_size = 0;
-  int err;
   if (encoded_size > 0) {
-    err = av_bitstream_filter_filter(annexb_, cc_, NULL, &filtered_buffer,
-                                     &filtered_size, encoded_buffer,
-                                     encoded_size, keyframe);
-    if (err < 0) {
-      char err_msg[256];
-      av_strerror(err, err_msg, 256);
-      return Result(false, "Error while filtering frame (" +
-                               std::to_string(err) +
-                               "): " + std::string(err_msg));
-    }
-    if (keyframe) {
-      BSFCompatContext *priv = (BSFCompatContext *)annexb_->priv_data;
-      AVBSFContext *priv_ctx = (AVBSFContext *)priv->ctx;
-
-      uint8_t *extra_buffer = priv_ctx->par_out->extradata;
-      size_t extra_size = priv_ctx->par_out->extradata_size;
-
-      int32_t temp_size = filtered_size + extra_size + 3;
-      uint8_t *temp_buffer = (uint8_t *)malloc(temp_size);
-
-      temp_buffer[0] = 0;
-      temp_buffer[1] = 0;
-      temp_buffer[2] = 1;
-      memcpy(temp_buffer + 3, extra_buffer, extra_size);
-      memcpy(temp_buffer + 3 + extra_size, filtered_buffer, filtered_size);
-
-      free(filtered_buffer);
-      filtered_buffer = temp_buffer;
-      filtered_size = temp_size;
-    }
-  }
-
-// Debug read packets
-#if 0
-  int32_t es = (int32_t)filtered_data_size;
-  const uint8_t* b = filtered_buffer;
-  while (es > 0) {
-    const uint8_t* nal_start;
-    int32_t nal_size;
-    next_nal(b, es, nal_start, nal_size);
-    int32_t nal_unit_type = get_nal_unit_type(nal_start);
-    printf("nal unit type %d\n", nal_unit_type);
-
-    if (nal_unit_type == 7) {
-      int32_t offset = 32;
-      int32_t sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("SPS NAL (%d)\n", sps_id);
-    }
-    if (nal_unit_type == 8) {
-      int32_t offset = 8;
-      int32_t pps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      int32_t sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("PPS id: %d, SPS id: %d\n", pps_id, sps_id);
+    // The decoder reads past the end of the packet so it is copied once into
+    // a padded buffer. Buffers come from a pool and are reference counted,
+    // which lets the decoder keep them without another copy or allocation.
+    size_t padded_size = encoded_size + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (padded_size > packet_pool_size_) {
+      av_buffer_pool_uninit(&packet_pool_);
+      packet_pool_size_ = std::max(padded_size, packet_pool_size_ * 2);
+      packet_pool_ = av_buffer_pool_init(packet_pool_size_, NULL);
     }
-  }
-#endif
-  if (filtered_size > 0) {
-    if (av_new_packet(&packet_, filtered_size) < 0) {
+    packet_.buf = packet_pool_ ? av_buffer_pool_get(packet_pool_) : NULL;
+    if (packet_.buf == NULL) {
       return Result(false,
                     "could not allocate packet for feeding into decoder");
     }
-    memcpy(packet_.data, filtered_buffer, filtered_size);
+    packet_.data = packet_.buf->data;
+    packet_.size = encoded_size;
+    memcpy(packet_.data, encoded_buffer, encoded_size);
+    memset(packet_.data + encoded_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if (keyframe) {
+      packet_.flags |= AV_PKT_FLAG_KEY;
+    }
   } else {
     packet_.data = NULL;
     packet_.size = 0;
@@ -240,10 +346,6 @@ Result SoftwareVideoDecoder::feed(const uint8_t *encoded_buffer,
   feed_packet(false);
   av_packet_unref(&packet_);
 
-  if (filtered_buffer) {
-    free(filtered_buffer);
-  }
-
   return Result();
 }
 
@@ -251,26 +353,20 @@ Result SoftwareVideoDecoder::flush() {
   packet_.data = NULL;
   packet_.size = 0;
   feed_packet(true);
-  // Reinitialize filter
-  if (annexb_) {
-    av_bitstream_filter_close(annexb_);
-  }
-
-  if (cc_->extradata_size > 0 && cc_->extradata != nullptr) {
-    free(cc_->extradata);
-  }
-  cc_->extradata = (uint8_t *)malloc(extradata_.size());
-  memcpy(cc_->extradata, extradata_.data(), extradata_.size());
-  cc_->extradata_size = extradata_.size();
-
-  annexb_ = av_bitstream_filter_init(bitstream_filter_name_.c_str());
   return Result();
 }
 
+void SoftwareVideoDecoder::get_output_size(uint32_t &width,
+                                           uint32_t &height) {
+  width = geometry_.width;
+  height = geometry_.height;
+}
+
 Result SoftwareVideoDecoder::discard_frame() {
   if (decoded_frame_queue_.size() > 0) {
     AVFrame* frame;
     decoded_frame_queue_.pop(frame);
+    notify_waiters();
     av_frame_unref(frame);
     frame_pool_.push(frame);
   }
@@ -285,18 +381,61 @@ Result SoftwareVideoDecoder::get_frame(uint8_t *decoded_buffer,
   AVFrame *frame;
   if (decoded_frame_queue_.size() > 0) {
     decoded_frame_queue_.pop(frame);
+    notify_waiters();
   } else {
     return Result();
   }
 
-  if (reset_context_) {
+  AVPixelFormat decoder_pixel_format = (AVPixelFormat)frame->format;
+  const AVPixFmtDescriptor *decoded_desc =
+      av_pix_fmt_desc_get(decoder_pixel_format);
+  const FrameGeometry &geometry = geometry_;
+  int32_t scaled_width = geometry.scaled_width();
+  int32_t scaled_height = geometry.scaled_height();
+  bool resize = scaled_width != (int32_t)geometry.crop_width ||
+                scaled_height != (int32_t)geometry.crop_height;
+
+  // Crop by offsetting the plane pointers so that the conversion below only
+  // reads the pixels it keeps
+  const uint8_t *in_slices[4] = {nullptr, nullptr, nullptr, nullptr};
+  int in_planes = av_pix_fmt_count_planes(decoder_pixel_format);
+  for (int p = 0; p < in_planes; ++p) {
+    int32_t x = geometry.crop_x;
+    int32_t y = geometry.crop_y;
+    if (p == 1 || p == 2) {
+      x >>= decoded_desc->log2_chroma_w;
+      y >>= decoded_desc->log2_chroma_h;
+    }
+    int32_t pixel_step = 0;
+    for (int c = 0; c < decoded_desc->nb_components; ++c) {
+      if (decoded_desc->comp[c].plane == p) {
+        pixel_step = std::max(pixel_step, decoded_desc->comp[c].step);
+      }
+    }
+    in_slices[p] =
+        frame->data[p] + (int64_t)y * frame->linesize[p] + x * pixel_step;
+  }
+
+  // Crops that start between chroma samples need sws_scale to resample the
+  // chroma planes
+  bool chroma_aligned =
+      (geometry.crop_x & ((1 << decoded_desc->log2_chroma_w) - 1)) == 0 &&
+      (geometry.crop_y & ((1 << decoded_desc->log2_chroma_h) - 1)) == 0;
+  bool copy_planes = !resize && chroma_aligned &&
+                     can_copy_planes(decoder_pixel_format, output_format_);
+  bool convert_yuv420 =
+      !resize && chroma_aligned &&
+      can_convert_yuv420(decoder_pixel_format, output_format_,
+                         scaled_height);
+  bool use_sws = !copy_planes && !convert_yuv420;
+  if (use_sws) {
     auto get_context_start = now();
-    AVPixelFormat decoder_pixel_format = cc_->pix_fmt;
-    sws_freeContext(sws_context_);
-    sws_context_ = sws_getContext(
-        frame_width_, frame_height_, decoder_pixel_format, frame_width_,
-        frame_height_, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
-    reset_context_ = false;
+    // Returns the previous context as long as the parameters are unchanged
+    sws_context_ = sws_getCachedContext(
+        sws_context_, geometry.crop_width, geometry.crop_height,
+        decoder_pixel_format, scaled_width, scaled_height, output_format_,
+        resize ? sws_flags(geometry.interpolation) : SWS_BICUBIC, NULL, NULL,
+        NULL);
     auto get_context_end = now();
     // if (profiler_) {
     //   profiler_->add_interval("ffmpeg:get_sws_context", get_context_start,
@@ -304,28 +443,90 @@ Result SoftwareVideoDecoder::get_frame(uint8_t *decoded_buffer,
     // }
   }
 
-  if (sws_context_ == NULL) {
-    return Result(false, "Could not get sws_context for rgb conversion");
+  if (use_sws && sws_context_ == NULL) {
+    return Result(false, "Could not get sws_context for pixel conversion");
   }
 
+  // Rotation is a second pass over the cropped and resized image, which is
+  // usually much smaller than the decoded frame
   uint8_t* scale_buffer = decoded_buffer;
-
-  uint8_t* out_slices[4];
-  int out_linesizes[4];
-  int required_size =
-      av_image_fill_arrays(out_slices, out_linesizes, scale_buffer,
-                           AV_PIX_FMT_RGB24, frame_width_, frame_height_, 1);
+  int required_size = av_image_get_buffer_size(
+      output_format_, scaled_width, scaled_height, 1);
   if (required_size < 0) {
-    return Result(false, "Error in av_image_fill_arrays");
+    return Result(false, "Error in av_image_get_buffer_size");
   }
   if (required_size > decoded_size) {
     return Result(false, "Decode buffer not large enough for image");
   }
+  if (geometry.rotation != 0) {
+    rotation_buffer_.resize(required_size);
+    scale_buffer = rotation_buffer_.data();
+  }
+
+  uint8_t* out_slices[4];
+  int out_linesizes[4];
+  if (av_image_fill_arrays(out_slices, out_linesizes, scale_buffer,
+                           output_format_, scaled_width, scaled_height,
+                           1) < 0) {
+    return Result(false, "Error in av_image_fill_arrays");
+  }
+  const AVPixFmtDescriptor *output_desc = av_pix_fmt_desc_get(output_format_);
+  int out_planes = av_pix_fmt_count_planes(output_format_);
   auto scale_start = now();
-  if (sws_scale(sws_context_, frame->data, frame->linesize, 0, frame->height,
-                out_slices, out_linesizes) < 0) {
+  if (copy_planes) {
+    // The decoder already produced the planes we want, so only strip the
+    // line padding. GRAY8 takes just the luma plane.
+    for (int p = 0; p < out_planes; ++p) {
+      int plane_height = scaled_height;
+      if (p > 0) {
+        plane_height = -((-scaled_height) >> output_desc->log2_chroma_h);
+      }
+      av_image_copy_plane(out_slices[p], out_linesizes[p], in_slices[p],
+                          frame->linesize[p], out_linesizes[p], plane_height);
+    }
+  } else if (convert_yuv420) {
+    YUV420Image image;
+    image.y = in_slices[0];
+    image.y_stride = frame->linesize[0];
+    image.u = in_slices[1];
+    image.v = in_slices[2];
+    image.uv_stride = frame->linesize[1];
+    image.uv_step = 1;
+    image.width = scaled_width;
+    image.height = scaled_height;
+    image.range = (decoder_pixel_format == AV_PIX_FMT_YUVJ420P ||
+                   frame->color_range == AVCOL_RANGE_JPEG)
+                      ? ColorRange::FULL
+                      : ColorRange::LIMITED;
+    // Conversion is split across cores so that it does not limit the
+    // throughput of large frames
+    yuv420_to_rgb24(image, out_slices[0], out_linesizes[0],
+                    output_format_ == AV_PIX_FMT_BGR24,
+                    color_conversion_pool(), conversion_threads());
+  } else if (sws_scale(sws_context_, in_slices, frame->linesize, 0,
+                       geometry.crop_height, out_slices, out_linesizes) < 0) {
     return Result(false, "sws_scale failed");
   }
+
+  if (geometry.rotation != 0) {
+    uint8_t* rotated_slices[4];
+    int rotated_linesizes[4];
+    av_image_fill_arrays(rotated_slices, rotated_linesizes, decoded_buffer,
+                         output_format_, geometry.width, geometry.height, 1);
+    for (int p = 0; p < out_planes; ++p) {
+      int32_t plane_width = scaled_width;
+      int32_t plane_height = scaled_height;
+      if (p > 0) {
+        plane_width = -((-scaled_width) >> output_desc->log2_chroma_w);
+        plane_height = -((-scaled_height) >> output_desc->log2_chroma_h);
+      }
+      // Rows are unpadded, so this is 3 for RGB and 2 for interleaved UV
+      int32_t element_size = out_linesizes[p] / plane_width;
+      rotate_plane(out_slices[p], out_linesizes[p], plane_width, plane_height,
+                   element_size, geometry.rotation, rotated_slices[p],
+                   rotated_linesizes[p]);
+    }
+  }
   auto scale_end = now();
 
   av_frame_unref(frame);
@@ -342,6 +543,29 @@ int SoftwareVideoDecoder::decoded_frames_buffered() {
   return decoded_frame_queue_.size();
 }
 
+void SoftwareVideoDecoder::wait_until_frames_buffered(
+    int num_frames, const std::function<bool()> &cancel) {
+  std::unique_lock<std::mutex> lock(buffered_mutex_);
+  buffered_changed_.wait(lock, [&] {
+    return cancel() || decoded_frame_queue_.size() >= num_frames;
+  });
+}
+
+void SoftwareVideoDecoder::wait_until_space_available(
+    int num_frames, const std::function<bool()> &cancel) {
+  std::unique_lock<std::mutex> lock(buffered_mutex_);
+  buffered_changed_.wait(lock, [&] {
+    return cancel() || decoded_frame_queue_.size() <= num_frames;
+  });
+}
+
+void SoftwareVideoDecoder::notify_waiters() {
+  // Taking the lock orders this notification after any waiter that has
+  // already evaluated its predicate so the wakeup can not be lost
+  { std::unique_lock<std::mutex> lock(buffered_mutex_); }
+  buffered_changed_.notify_all();
+}
+
 Result SoftwareVideoDecoder::wait_until_frames_copied() {
   return Result();
 }
@@ -384,6 +608,7 @@ void SoftwareVideoDecoder::feed_packet(bool flush) {
     }
     if (error == 0) {
       decoded_frame_queue_.push(frame);
+      notify_waiters();
     } else if (error == AVERROR(EAGAIN)) {
       frame_pool_.push(frame);
       break;
@@ -442,6 +667,7 @@ void SoftwareVideoDecoder::feed_packet(bool flush) {
         // Frame is reference counted so we can just take it directly
         decoded_frame_queue_.push(frame);
       }
+      notify_waiters();
     } else {
       frame_pool_.push(frame);
     }
@@ -17,6 +17,7 @@
 
 #include "hwang/video_decoder_interface.h"
 #include "hwang/common.h"
+#include "hwang/impls/software/frame_arena.h"
 #include "hwang/util/queue.h"
 
 extern "C" {
@@ -30,6 +31,7 @@ extern "C" {
 #include "libswscale/swscale.h"
 }
 
+#include <condition_variable>
 #include <deque>
 #include <mutex>
 #include <vector>
@@ -40,8 +42,7 @@ namespace hwang {
 /// SoftwareVideoDecoder
 class SoftwareVideoDecoder : public VideoDecoderInterface {
 public:
-  SoftwareVideoDecoder(int32_t device_id, DeviceType output_type,
-                       int32_t thread_count);
+  SoftwareVideoDecoder(int32_t device_id, DeviceType output_type);
 
   ~SoftwareVideoDecoder();
 
@@ -53,36 +54,69 @@ public:
 
   Result flush() override;
 
+  void get_output_size(uint32_t &width, uint32_t &height) override;
+
   Result discard_frame() override;
 
   Result get_frame(uint8_t *decoded_buffer, size_t decoded_size) override;
 
   int decoded_frames_buffered() override;
 
+  void wait_until_frames_buffered(
+      int num_frames, const std::function<bool()> &cancel) override;
+
+  void wait_until_space_available(
+      int num_frames, const std::function<bool()> &cancel) override;
+
+  void notify_waiters() override;
+
   Result wait_until_frames_copied() override;
 
+  // Threads used to convert a decoded frame to the output format. Conversion
+  // and decoding take turns on the threads granted to the codec, so this is
+  // bounded by that grant rather than taken from the budget on top of it.
+  int32_t conversion_threads() const;
+
 private:
+  // Replaces cc_ with a newly opened context for metadata_
+  Result open_codec(AVCodecID codec_id, const std::vector<uint8_t> &extradata);
+
+  void close_codec();
+
   void feed_packet(bool flush);
 
   int device_id_;
   DeviceType output_type_;
-  int thread_count_;
+  // Threads taken from ThreadBudget::global() for cc_
+  int32_t budget_threads_;
   AVPacket packet_;
   AVCodec* codec_;
   AVCodecContext* cc_;
-  std::string bitstream_filter_name_;
-  AVBitStreamFilterContext* annexb_;
-  std::vector<uint8_t> extradata_;
+  // Padded buffers for packets sent to the decoder, each packet_pool_size_
+  // bytes
+  AVBufferPool* packet_pool_;
+  size_t packet_pool_size_;
 
   FrameInfo metadata_;
   int32_t frame_width_;
   int32_t frame_height_;
-  std::vector<uint8_t> conversion_buffer_;
-  bool reset_context_;
+  AVPixelFormat output_format_;
+  // metadata_.geometry scaled to the decoded resolution with its defaults
+  // filled in
+  FrameGeometry geometry_;
   SwsContext* sws_context_;
+  // Holds the cropped and resized frame when it still has to be rotated
+  std::vector<uint8_t> rotation_buffer_;
 
+  // Picture buffers of the decoded frames
+  FrameArena frame_arena_;
   Queue<AVFrame*> frame_pool_;
   Queue<AVFrame*> decoded_frame_queue_;
+
+  // Signaled whenever a frame is added to or removed from
+  // decoded_frame_queue_
+  std::mutex buffered_mutex_;
+  std::condition_variable buffered_changed_;
 };
 
 } // namespace hwang
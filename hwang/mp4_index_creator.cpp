@@ -14,17 +14,143 @@
 #include "hwang/mp4_index_creator.h"
 #include "hwang/util/mp4.h"
 #include "hwang/util/bits.h"
+#include "hwang/util/thread_pool.h"
 
 #include <thread>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <iostream>
+#include <cerrno>
+#include <condition_variable>
+#include <functional>
 #include <cstring>
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace hwang {
 
-MP4IndexCreator::MP4IndexCreator(uint64_t file_size)
-    : file_size_(file_size), done_(false), error_(false) {
+namespace {
+
+// Converts the sample_depends_on and sample_is_depended_on fields found in
+// 'sdtp' boxes and 'trun' sample flags to SampleFlags
+uint8_t dependency_to_sample_flags(uint32_t depends_on,
+                                   uint32_t is_depended_on) {
+  // Zero means the encoder did not say. An intra sample is still marked as
+  // one, and is assumed to be referenced.
+  if (is_depended_on == 0) {
+    return depends_on == 2 ? SAMPLE_FLAG_KNOWN | SAMPLE_FLAG_INTRA : 0;
+  }
+  uint8_t flags = SAMPLE_FLAG_KNOWN;
+  if (depends_on == 2) {
+    flags |= SAMPLE_FLAG_INTRA;
+  }
+  if (is_depended_on == 2) {
+    flags |= SAMPLE_FLAG_DISPOSABLE;
+  }
+  return flags;
+}
+
+// Appends count samples with value to runs, extending the last run if it has
+// the same value
+void append_sample_run(std::vector<SampleRun> &runs, uint64_t count,
+                       int64_t value) {
+  if (count == 0) {
+    return;
+  }
+  if (!runs.empty() && runs.back().value == value) {
+    runs.back().count += count;
+  } else {
+    runs.push_back({count, value});
+  }
+}
+
+uint64_t sample_run_total(const std::vector<SampleRun> &runs) {
+  uint64_t total = 0;
+  for (const SampleRun &run : runs) {
+    total += run.count;
+  }
+  return total;
+}
+
+// Points data at size bytes of the file starting at offset
+using ReadFn =
+    std::function<Result(uint64_t offset, uint64_t size, const uint8_t *&data)>;
+
+// Feeds an MP4IndexCreator the ranges it asks for until it is done
+Result run_index_creator(uint64_t file_size, const ReadFn &read,
+                         const IndexOptions &options, VideoIndex &index) {
+  MP4IndexCreator indexer(file_size, options);
+  uint64_t offset = 0;
+  uint64_t size = std::min((uint64_t)1024, file_size);
+  while (!indexer.is_done()) {
+    if (offset > file_size || size > file_size - offset) {
+      return Result(false, "Index points past the end of the file");
+    }
+    const uint8_t *data = nullptr;
+    HWANG_RETURN_ON_ERROR(read(offset, size, data));
+    if (!indexer.feed(data, size, offset, size)) {
+      break;
+    }
+  }
+  if (indexer.is_error()) {
+    return Result(false, indexer.error_message());
+  }
+  if (!indexer.is_done()) {
+    return Result(false, "Indexer stopped before reaching the end of the file");
+  }
+  index = indexer.get_video_index();
+  return Result();
+}
+
+// Appends the file offset of every sample to offsets in one pass over the
+// runs of chunks in the 'stsc' box at bs, so no per-sample or per-chunk
+// table is built. Samples are placed from offsets.size() onwards. Returns
+// false if the chunks do not hold exactly the samples in sizes.
+bool append_sample_offsets(GetBitsState &bs,
+                           const std::vector<uint64_t> &chunk_offsets,
+                           const std::vector<uint64_t> &sizes,
+                           std::vector<uint64_t> &offsets) {
+  FullBox stsc = parse_full_box(bs);
+  assert(stsc.type == string_to_type("stsc"));
+  uint32_t entry_count = get_bits(bs, 32);
+
+  size_t sample = offsets.size();
+  for (uint32_t i = 0; i < entry_count && sample < sizes.size(); ++i) {
+    uint64_t first_chunk = get_bits(bs, 32);
+    uint32_t samples_per_chunk = get_bits(bs, 32);
+    get_bits(bs, 32); // sample_description_index
+    if (first_chunk == 0) {
+      return false;
+    }
+    // The run lasts until the next entry's first chunk or the last chunk
+    uint64_t end_chunk = chunk_offsets.size();
+    if (i + 1 < entry_count) {
+      GetBitsState next = bs;
+      end_chunk = std::min(end_chunk, get_bits(next, 32) - 1);
+    }
+    for (uint64_t chunk = first_chunk - 1;
+         chunk < end_chunk && sample < sizes.size(); ++chunk) {
+      uint64_t offset = chunk_offsets[chunk];
+      for (uint32_t j = 0; j < samples_per_chunk && sample < sizes.size();
+           ++j) {
+        offsets.push_back(offset);
+        offset += sizes[sample++];
+      }
+    }
+  }
+  return sample == sizes.size();
+}
+
+}
+
+MP4IndexCreator::MP4IndexCreator(uint64_t file_size,
+                                 const IndexOptions &options)
+    : file_size_(file_size), options_(options), done_(false), error_(false) {
 }
 
 bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
@@ -42,12 +168,10 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
   // 7.  Search for 'dref' to check data is in this file by checking entry_flags
   // 8.  Search for 'stbl' Sample Table Box
 
-  // Note: 9 - 10 only needed if we want finer access than random access points
-  // 9.  Search for 'stts' Time To Sample Box to use for determining decode
-  //     order
-  // 10.  Search for 'ctts' Composition Offset Box to use for precise ordering
-  //      of frames
-  // End note.
+  // 9.  Search for 'stts' Time To Sample Box for the decode time of each
+  //     sample
+  // 10. Search for 'ctts' Composition Offset Box for the presentation time of
+  //     each sample. If missing, presentation time equals decode time
 
 
   // 11.  Search for 'stsz' or 'stz2' Sample Size Box to determine number and
@@ -58,6 +182,8 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
   //     byte offsets in the file.
   // 14. Search for 'stss' Sync Sample Box for location of random access points.
   //     If missing, then all samples are randoma access points
+  // 15. Search for 'sdtp' Sample Dependency Type Box to find samples no other
+  //     sample depends on. If missing, parse the slice header of each sample.
 
   // TODO(apoms): Make sure the data is in h264 format by parsing stsd
   // 16.  Search for 'stsd' to get avc metadata
@@ -73,13 +199,16 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
     printf("first bs size: %lu\n", bs.size);
   }
 
+  if (probing_samples_) {
+    return probe_samples(data, size, next_offset, next_size);
+  }
+
   auto type = [](const std::string &s) { return string_to_type(s); };
   auto size_left = [&]() { return bs.size - (bs.offset / 8); };
 
 #define MORE_DATA(__offset, __size)                                            \
   if (__offset + __size > file_size_) {                                        \
     error_message_ = "EOF in middle of box";                                   \
-    std::cerr << error_message_ << std::endl;                                  \
     done_ = true;                                                              \
     error_ = true;                                                             \
     return false;                                                              \
@@ -100,7 +229,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
           return false;                                                        \
         }                                                                      \
         error_message_ = "Reached EOF without being done";                     \
-        std::cerr << error_message_ << std::endl;                              \
         done_ = true;                                                          \
         error_ = true;                                                         \
         return false;                                                          \
@@ -121,6 +249,11 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                type_to_string(type).c_str(), type_to_string(b.type).c_str(),
                b.size, bs.offset / 8, bs.size);
       }
+      if (b.size < 8) {
+        // Corrupt box, stop searching this container
+        bs.offset = bs.size * 8;
+        return false;
+      }
       if (b.type == type) {
         GetBitsState bs2 = bs;
         bool result = fn(bs2);
@@ -134,10 +267,25 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
     return false;
   };
 
-  while ((bs.offset / 8) < bs.size && !is_done()) {
+  while ((bs.offset / 8) < bs.size && !is_done() && !probing_samples_) {
+    // Fetch the next box header if it is cut off by the end of the data. A
+    // header is at most 16 bytes with a 64-bit size.
+    if (size_left() < 16 && offset_ + size_left() < file_size_) {
+      MORE_DATA_LIMIT(offset_, 1024);
+    }
     // Get type of next box
     FullBox b = probe_box_type(bs);
-    assert(b.size != 0);
+    if (b.size == 0) {
+      // The last box in the file may extend to the end of the file
+      b.size = file_size_ - offset_;
+    }
+    if (b.size < 8) {
+      error_message_ = "Invalid size for box at offset " +
+                       std::to_string(offset_);
+      done_ = true;
+      error_ = true;
+      return false;
+    }
     if (PRINT_DEBUG) {
       printf("parsed box type: %s, size: %ld, bs off %ld, size %ld\n",
              type_to_string(b.type).c_str(), b.size, bs.offset / 8, bs.size);
@@ -163,7 +311,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
           brands += type_to_string(c) + ", ";
         }
         std::string error = "No supported mp4 brands: " + brands;
-        std::cerr << error << std::endl;
         error_message_ = error;
         error_ = true;
         done_ = true;
@@ -215,7 +362,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
         bool found_trak = search_for_box(moov_bs, type("trak"), trak_verify_fn);
         if (!found_trak) {
           std::string error = "Could not find a trak box";
-          std::cerr << error << std::endl;
           error_message_ = error;
           error_ = true;
           done_ = true;
@@ -229,7 +375,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
       }
       if (!found_valid_trak) {
         std::string error = "Could not find a video trak file";
-        std::cerr << error << std::endl;
         error_message_ = error;
         error_ = true;
         done_ = true;
@@ -262,70 +407,80 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                   // number and size of samples.
                   FullBox stbl = parse_stbl(stbl_bs);
 
-                  SampleSizeBox sample_size_box;
+                  // Samples from this table are appended after those
+                  // already indexed
+                  const size_t first_sample = sample_sizes_.size();
+
+                  bool found_sizes = false;
+                  bool valid_sizes = true;
+                  for (const char *size_type : {"stsz", "stz2"}) {
+                    GetBitsState bs = stbl_bs;
+                    found_sizes = search_for_box(
+                        bs, type(size_type), [&](GetBitsState &bs) {
+                          valid_sizes = append_sample_sizes(bs, file_size_,
+                                                            sample_sizes_);
+                          return true;
+                        });
+                    if (found_sizes) {
+                      break;
+                    }
+                  }
+                  if (!found_sizes || !valid_sizes) {
+                    std::string error =
+                        found_sizes ? "Sample count of 'stsz' or 'stz2' does "
+                                      "not fit in the box"
+                                    : "Could not find 'stsz' or 'stz2'";
+                    error_message_ = error;
+                    error_ = true;
+                    done_ = true;
+                    return false;
+                  }
+                  const size_t num_samples = sample_sizes_.size() - first_sample;
 
-                  bool found_stsz;
+                  // Search for 'stco' or 'co64' Chunk Offset Box to determine
+                  // the chunk byte offsets in the file.
+                  ChunkOffsetBox chunk_offset_box;
+                  bool found_stco;
                   {
                     GetBitsState bs = stbl_bs;
-                    found_stsz =
-                        search_for_box(bs, type("stsz"), [&](GetBitsState &bs) {
-                          sample_size_box = parse_stsz(bs);
+                    found_stco =
+                        search_for_box(bs, type("stco"), [&](GetBitsState &bs) {
+                          chunk_offset_box = parse_stco(bs);
                           return true;
                         });
                   }
-                  bool found_stz2;
+                  bool found_co64;
                   {
                     GetBitsState bs = stbl_bs;
-                    found_stz2 =
-                        search_for_box(bs, type("stz2"), [&](GetBitsState &bs) {
-
-                          sample_size_box = parse_stz2(bs);
+                    found_co64 =
+                        search_for_box(bs, type("co64"), [&](GetBitsState &bs) {
+                          chunk_offset_box = parse_co64(bs);
                           return true;
                         });
                   }
-
-                  if (!(found_stsz || found_stz2)) {
-                    std::string error = "Could not find 'stsz' or 'stz2'";
-                    std::cerr << error << std::endl;
+                  if (!(found_stco || found_co64)) {
+                    std::string error = "Could not find 'stco' or 'co64'";
                     error_message_ = error;
                     error_ = true;
                     done_ = true;
                     return false;
                   }
 
-                  std::vector<uint64_t> sample_sizes;
-                  for (int i = 0; i < sample_size_box.sample_count; ++i) {
-                    if (sample_size_box.sample_size == 0) {
-                      sample_sizes.push_back(sample_size_box.entry_size[i]);
-                    } else {
-                      sample_sizes.push_back(sample_size_box.sample_size);
-                    }
-                  }
-
-                  // Search for 'stsc' Sample To Chunk Box to determine which
-                  // chunk a sample is in.
-
-                  std::vector<uint64_t> sample_chunk_assignment;
+                  // Search for 'stsc' Sample To Chunk Box and walk its runs
+                  // of chunks to place each sample in the file
+                  sample_offsets_.reserve(sample_sizes_.size());
                   {
                     GetBitsState bs = stbl_bs;
                     bool found_stsc =
                         search_for_box(bs, type("stsc"), [&](GetBitsState &bs) {
-                          SampleToChunkBox stsc =
-                              parse_stsc(bs, sample_sizes.size());
-                          for (size_t i = 0; i < stsc.chunk_entries.size();
-                               ++i) {
-                            uint64_t chunk_index = i + 1;
-                            for (size_t j = 0;
-                                 j < stsc.chunk_entries[i].num_samples; ++j) {
-                              sample_chunk_assignment.push_back(chunk_index);
-                            }
-                          }
-                          return true;
+                          return append_sample_offsets(
+                              bs, chunk_offset_box.chunk_offsets,
+                              sample_sizes_, sample_offsets_);
                         });
-
                     if (!found_stsc) {
-                      std::string error = "Could not find 'stsc'";
-                      std::cerr << error << std::endl;
+                      std::string error =
+                          "Could not find 'stsc' or it does not match the "
+                          "number of samples";
                       error_message_ = error;
                       error_ = true;
                       done_ = true;
@@ -333,88 +488,119 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                     }
                   }
 
-                  assert(sample_chunk_assignment.size() == sample_sizes.size());
-
-                  // Search for 'stco' or 'co64' Chunk Offset Box to determine
-                  // the chunk byte offsets in the file.
-
-                  std::vector<uint64_t> sample_offsets;
+                  // Search for 'stss' Sync Sample Box for location of random
+                  // access points. If missing, then all samples are randoma
+                  // access points
                   {
-                    ChunkOffsetBox chunk_offset_box;
-                    bool found_stco;
-                    {
-                      GetBitsState bs = stbl_bs;
-                      found_stco = search_for_box(
-                          bs, type("stco"), [&](GetBitsState &bs) {
-                            chunk_offset_box = parse_stco(bs);
-                            return true;
-                          });
-                    }
-                    bool found_co64;
-                    {
-                      GetBitsState bs = stbl_bs;
-                      found_co64 = search_for_box(
-                          bs, type("co64"), [&](GetBitsState &bs) {
-                            chunk_offset_box = parse_co64(bs);
-                            return true;
-                          });
-                    }
-
-                    if (!(found_stco || found_co64)) {
-                      std::string error = "Could not find 'stco' or 'co64'";
-                      std::cerr << error << std::endl;
+                    GetBitsState bs = stbl_bs;
+                    bool valid_stss = true;
+                    bool found_stss =
+                        search_for_box(bs, type("stss"), [&](GetBitsState &bs) {
+                          SyncSampleBox stss;
+                          valid_stss = parse_stss(bs, stss);
+                          for (uint32_t sample_number : stss.sample_number) {
+                            if (sample_number == 0 ||
+                                sample_number > num_samples) {
+                              valid_stss = false;
+                            }
+                          }
+                          if (valid_stss) {
+                            keyframe_indices_.reserve(
+                                keyframe_indices_.size() +
+                                stss.sample_number.size());
+                            for (uint32_t sample_number : stss.sample_number) {
+                              keyframe_indices_.push_back(first_sample +
+                                                          sample_number - 1);
+                            }
+                          }
+                          return true;
+                        });
+                    if (!valid_stss) {
+                      std::string error =
+                          "'stss' does not fit in the box or refers to "
+                          "samples that do not exist";
                       error_message_ = error;
                       error_ = true;
                       done_ = true;
                       return false;
                     }
 
-                    uint64_t current_offset = 0;
-                    uint64_t current_chunk_index = 1;
-                    if (chunk_offset_box.chunk_offsets.size() > 0) {
-                      current_offset = chunk_offset_box.chunk_offsets[0];
-                    }
-                    for (size_t i = 0; i < sample_sizes.size(); ++i) {
-                      // Determine if this sample is in this chunk
-                      if (sample_chunk_assignment[i] != current_chunk_index) {
-                        assert(current_chunk_index <
-                               chunk_offset_box.chunk_offsets.size());
-                        current_offset =
-                            chunk_offset_box
-                                .chunk_offsets[++current_chunk_index - 1];
+                    if (!found_stss) {
+                      keyframe_indices_.reserve(keyframe_indices_.size() +
+                                                num_samples);
+                      for (size_t i = 0; i < num_samples; ++i) {
+                        keyframe_indices_.push_back(first_sample + i);
                       }
-                      sample_offsets.push_back(current_offset);
-                      // printf("chunk %ld (%lu), sample %lu, sample offset %lu\n",
-                      //        current_chunk_index,
-                      //        chunk_offset_box.chunk_offsets.size(),
-                      //        i,
-                      //        current_offset);
-                      current_offset += sample_sizes[i];
                     }
                   }
-                  assert(sample_offsets.size() == sample_sizes.size());
 
-                  // Search for 'stss' Sync Sample Box for location of random
-                  // access points. If missing, then all samples are randoma
-                  // access points
-                  std::vector<uint64_t> keyframe_indices;
+                  sample_flags_.resize(first_sample + num_samples, 0);
                   {
                     GetBitsState bs = stbl_bs;
-                    bool found_stss =
-                        search_for_box(bs, type("stss"), [&](GetBitsState &bs) {
-                          SyncSampleBox stss = parse_stss(bs);
-                          for (size_t i = 0; i < stss.sample_number.size();
-                               ++i) {
-                            keyframe_indices.push_back(stss.sample_number[i] - 1);
+                    search_for_box(bs, type("sdtp"), [&](GetBitsState &bs) {
+                      SampleDependencyTypeBox sdtp = parse_sdtp(bs);
+                      size_t count = std::min(sdtp.samples.size(), num_samples);
+                      for (size_t i = 0; i < count; ++i) {
+                        sample_flags_[first_sample + i] =
+                            dependency_to_sample_flags(
+                                sdtp.samples[i].sample_depends_on,
+                                sdtp.samples[i].sample_is_depended_on);
+                      }
+                      return true;
+                    });
+                  }
+
+                  // Timestamps come in runs of samples that must cover every
+                  // sample of the table exactly
+                  std::vector<SampleRun> decode_time_runs;
+                  bool valid_stts = true;
+                  {
+                    GetBitsState bs = stbl_bs;
+                    bool found_stts =
+                        search_for_box(bs, type("stts"), [&](GetBitsState &bs) {
+                          TimeToSampleBox stts;
+                          valid_stts = parse_stts(bs, stts);
+                          for (const auto &entry : stts.entries) {
+                            append_sample_run(decode_time_runs,
+                                              entry.sample_count,
+                                              entry.sample_delta);
                           }
                           return true;
                         });
-
-                    if (!found_stss) {
-                      for (size_t i = 0; i < sample_sizes.size(); ++i) {
-                        keyframe_indices.push_back(sample_offsets_.size() + i);
-                      }
-                    }
+                    valid_stts = valid_stts &&
+                                 (!found_stts ||
+                                  sample_run_total(decode_time_runs) ==
+                                      num_samples);
+                  }
+                  std::vector<SampleRun> composition_offset_runs;
+                  bool valid_ctts = true;
+                  {
+                    GetBitsState bs = stbl_bs;
+                    bool found_ctts =
+                        search_for_box(bs, type("ctts"), [&](GetBitsState &bs) {
+                          CompositionOffsetBox ctts;
+                          valid_ctts = parse_ctts(bs, ctts);
+                          for (const auto &entry : ctts.entries) {
+                            append_sample_run(composition_offset_runs,
+                                              entry.sample_count,
+                                              entry.sample_offset);
+                          }
+                          return true;
+                        });
+                    valid_ctts = valid_ctts &&
+                                 (!found_ctts ||
+                                  sample_run_total(composition_offset_runs) ==
+                                      num_samples);
+                  }
+                  if (!valid_stts || !valid_ctts) {
+                    std::string error =
+                        std::string("Sample runs of '") +
+                        (valid_stts ? "ctts" : "stts") +
+                        "' do not match the number of samples";
+                    error_message_ = error;
+                    error_ = true;
+                    done_ = true;
+                    return false;
                   }
 
                   int16_t width;
@@ -451,7 +637,8 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                                          vs_bs2.buffer + vs_bs2.offset / 8,
                                          size);
                                 }
-                              } else if (vs.type == string_to_type("hev1")) {
+                              } else if (vs.type == string_to_type("hev1") ||
+                                         vs.type == string_to_type("hvc1")) {
                                 GetBitsState vs_bs2 = vs_bs;
                                 FullBox b2 = parse_box(vs_bs2);
                                 if (b2.type == string_to_type("hvcC")) {
@@ -475,7 +662,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
 
                     if (!found_stsd) {
                       std::string error = "Could not find 'stsd'";
-                      std::cerr << error << std::endl;
                       error_message_ = error;
                       error_ = true;
                       done_ = true;
@@ -487,12 +673,12 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                   height_ = height;
                   format_ = format;
 
-                  for (size_t i = 0; i < sample_sizes.size(); ++i) {
-                    sample_offsets_.push_back(sample_offsets[i]);
-                    sample_sizes_.push_back(sample_sizes[i]);
+                  for (const SampleRun &run : decode_time_runs) {
+                    append_sample_run(decode_time_runs_, run.count, run.value);
                   }
-                  for (uint64_t ki : keyframe_indices) {
-                    keyframe_indices_.push_back(ki);
+                  for (const SampleRun &run : composition_offset_runs) {
+                    append_sample_run(composition_offset_runs_, run.count,
+                                      run.value);
                   }
 
                   extradata_ = extradata;
@@ -503,7 +689,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
         });
         if (!parsed_stbl) {
           std::string error = "Could not parse 'stbl' correctly";
-          std::cerr << error << std::endl;
           if (!error_) {
             error_message_ = error;
             error_ = true;
@@ -535,17 +720,25 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
               while (mvex_bs.offset / 8 < mvex_bs.size) {
                 (void)search_for_box(
                     mvex_bs, type("leva"), [&](GetBitsState &bs) {
-                      std::cerr << "leva not supported" << std::endl;
-                      exit(-1);
+                      std::string error = "'leva' boxes are not supported";
+                      error_message_ = error;
+                      error_ = true;
+                      done_ = true;
                       return false;
                     });
               }
               return true;
             });
+        if (error_) {
+          return false;
+        }
       }
 
       bs.offset = (before_moov_offset + moov.size) * 8;
       parsed_moov_ = true;
+      if (!fragments_present_) {
+        start_probing_samples();
+      }
     } else if (b.type == type("moof")) {
       if (size_left() < b.size) {
         // Get more data since we don't have this entire box
@@ -559,6 +752,9 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
       std::vector<uint64_t> sample_offsets;
       std::vector<uint64_t> sample_sizes;
       std::vector<bool> keyframe_indicators;
+      std::vector<uint8_t> sample_flag_values;
+      std::vector<uint32_t> sample_durations;
+      std::vector<int32_t> sample_composition_offsets;
 
       bool first_traf = true;
       uint64_t prev_traf_offset = 0;
@@ -578,7 +774,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                   });
               if (!found_tfhd) {
                 std::string error = "Could not find 'tfhd'";
-                std::cerr << error << std::endl;
                 if (!error_) {
                   error_message_ = error;
                   error_ = true;
@@ -595,19 +790,25 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                 }
                 case TrackFragmentHeaderBox::BaseOffsetType::IS_RELATIVE: {
                   if (first_traf) {
-                    base_data_offset = offset_ + before_moof_offset;
+                    // offset_ is the position of the moof in the file
+                    base_data_offset = offset_;
                   } else {
                     base_data_offset = prev_traf_offset;
                   }
                   break;
                 }
                 case TrackFragmentHeaderBox::BaseOffsetType::IS_MOOF: {
-                  base_data_offset = offset_ + before_moof_offset;
+                  base_data_offset = offset_;
                   break;
                 }
                 default: {
-                  exit(-1);
-                  break;
+                  std::string error = "Invalid base offset in 'tfhd'";
+                  if (!error_) {
+                    error_message_ = error;
+                    error_ = true;
+                  }
+                  done_ = true;
+                  return false;
                 }
               }
               // Find trex from tfhd
@@ -622,7 +823,6 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                 }
                 if (!found_trex) {
                   std::string error = "Could not find 'trex' for track id in 'tfhd'";
-                  std::cerr << error << std::endl;
                   if (!error_) {
                     error_message_ = error;
                     error_ = true;
@@ -701,6 +901,24 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
                         sample_sizes.push_back(sample_size);
                         sample_offsets.push_back(current_offset);
                         keyframe_indicators.push_back(is_keyframe);
+                        sample_flag_values.push_back(dependency_to_sample_flags(
+                            (sample_flags >> 24) & 0x3,
+                            (sample_flags >> 22) & 0x3));
+
+                        uint32_t sample_duration;
+                        if (tr.sample_duration_present()) {
+                          sample_duration = sample.sample_duration;
+                        } else if (tfhd.default_sample_duration_present()) {
+                          sample_duration = tfhd.default_sample_duration;
+                        } else {
+                          sample_duration = trex.default_sample_duration;
+                        }
+                        sample_durations.push_back(sample_duration);
+                        // Signed in version 1 of 'trun'
+                        sample_composition_offsets.push_back(
+                            tr.sample_composition_time_offsets_present()
+                                ? (int32_t)sample.sample_composition_time_offset
+                                : 0);
 
                         current_offset += sample_size;
                       }
@@ -721,12 +939,26 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
       assert(sample_offsets.size() == sample_sizes.size());
       // Append samples to sample list
 
+      // Samples from the 'moov' may not have had timestamps
+      for (std::vector<SampleRun> *runs :
+           {&decode_time_runs_, &composition_offset_runs_}) {
+        uint64_t timed_samples = sample_run_total(*runs);
+        if (timed_samples < sample_sizes_.size()) {
+          append_sample_run(*runs, sample_sizes_.size() - timed_samples, 0);
+        }
+      }
+      for (size_t i = 0; i < sample_sizes.size(); ++i) {
+        append_sample_run(decode_time_runs_, 1, sample_durations[i]);
+        append_sample_run(composition_offset_runs_, 1,
+                          sample_composition_offsets[i]);
+      }
       for (size_t i = 0; i < sample_sizes.size(); ++i) {
         if (keyframe_indicators[i]) {
           keyframe_indices_.push_back(sample_sizes_.size());
         }
         sample_offsets_.push_back(sample_offsets[i]);
         sample_sizes_.push_back(sample_sizes[i]);
+        sample_flags_.push_back(sample_flag_values[i]);
       }
 
 
@@ -748,17 +980,263 @@ bool MP4IndexCreator::feed(const uint8_t* data, size_t size,
     return false;
   }
 
+  if (probing_samples_) {
+    request_probe_run(next_offset, next_size);
+    return true;
+  }
+
   MORE_DATA_LIMIT(offset_, 1024);
 
 
   return true;
 }
 
+void MP4IndexCreator::start_probing_samples() {
+  // Only h264 slice headers are supported
+  if (!options_.probe_samples || format_ != "avc1" ||
+      !parse_avcc(extradata_.data(), extradata_.size(), avc_config_)) {
+    return;
+  }
+  next_probe_sample_ = 0;
+  while (next_probe_sample_ < sample_flags_.size() &&
+         (sample_flags_[next_probe_sample_] & SAMPLE_FLAG_KNOWN)) {
+    next_probe_sample_++;
+  }
+  probing_samples_ = next_probe_sample_ < sample_flags_.size();
+}
+
+void MP4IndexCreator::request_probe_run(uint64_t &next_offset,
+                                        uint64_t &next_size) {
+  // Samples of other tracks in between are read along with the video
+  uint64_t start = sample_offsets_[next_probe_sample_];
+  uint64_t end =
+      start + std::min(sample_sizes_[next_probe_sample_], SAMPLE_PROBE_SIZE);
+  uint64_t sample = next_probe_sample_ + 1;
+  for (; sample < sample_flags_.size(); ++sample) {
+    uint64_t sample_end =
+        sample_offsets_[sample] +
+        std::min(sample_sizes_[sample], SAMPLE_PROBE_SIZE);
+    if (sample_offsets_[sample] < end ||
+        sample_end - start > PROBE_READ_LIMIT) {
+      break;
+    }
+    end = sample_end;
+  }
+  probe_run_offset_ = start;
+  probe_run_end_ = sample;
+  next_offset = start;
+  next_size = end - start;
+}
+
+bool MP4IndexCreator::probe_samples(const uint8_t *data, size_t size,
+                                    uint64_t &next_offset,
+                                    uint64_t &next_size) {
+  for (; next_probe_sample_ < probe_run_end_; ++next_probe_sample_) {
+    uint64_t sample = next_probe_sample_;
+    uint64_t pos = sample_offsets_[sample] - probe_run_offset_;
+    if (pos >= size) {
+      break;
+    }
+    if (sample_flags_[sample] & SAMPLE_FLAG_KNOWN) {
+      continue;
+    }
+    SliceHeader header;
+    if (!parse_avcc_sample_slice_header(
+            data + pos, std::min(sample_sizes_[sample], size - pos),
+            avc_config_, header)) {
+      continue;
+    }
+    uint8_t flags = SAMPLE_FLAG_KNOWN;
+    // Slice types 5-9 are the same as 0-4 but apply to the entire picture
+    uint32_t slice_type = header.slice_type % 5;
+    if (slice_type == 2 || slice_type == 4) {
+      // I or SI
+      flags |= SAMPLE_FLAG_INTRA;
+    } else if (slice_type == 1) {
+      flags |= SAMPLE_FLAG_BIDIR;
+    }
+    if (header.nal_ref_idc == 0) {
+      flags |= SAMPLE_FLAG_DISPOSABLE;
+    }
+    if (header.nal_unit_type == 5) {
+      flags |= SAMPLE_FLAG_IDR;
+    }
+    sample_flags_[sample] = flags;
+  }
+
+  while (next_probe_sample_ < sample_flags_.size() &&
+         (sample_flags_[next_probe_sample_] & SAMPLE_FLAG_KNOWN)) {
+    next_probe_sample_++;
+  }
+  if (next_probe_sample_ >= sample_flags_.size()) {
+    probing_samples_ = false;
+    return false;
+  }
+  request_probe_run(next_offset, next_size);
+  return true;
+}
+
 
 VideoIndex MP4IndexCreator::get_video_index() {
   return VideoIndex(timescale_, duration_, width_, height_, format_,
                     sample_offsets_, sample_sizes_, keyframe_indices_,
-                    extradata_);
+                    extradata_, sample_flags_, decode_time_runs_,
+                    composition_offset_runs_);
+}
+
+namespace {
+
+// Counting semaphore bounding the reads in flight across threads
+class ReadSlots {
+ public:
+  explicit ReadSlots(int32_t slots) : free_(slots) {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    slot_freed_.wait(lk, [this] { return free_ > 0; });
+    free_--;
+  }
+
+  void release() {
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      free_++;
+    }
+    slot_freed_.notify_one();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable slot_freed_;
+  int32_t free_;
+};
+
+// Reads exactly size bytes at offset, retrying short reads
+Result pread_fully(int fd, const std::string &path, uint8_t *data,
+                   uint64_t size, uint64_t offset, IndexStats &stats) {
+  uint64_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, data + done, size - done, offset + done);
+    stats.syscalls++;
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return Result(false, "Could not read " + path + ": " + strerror(errno));
+    }
+    if (n == 0) {
+      return Result(false, path + " was truncated while being indexed");
+    }
+    done += n;
+  }
+  stats.bytes_read += size;
+  return Result();
+}
+
+// index_file, taking a read slot from slots for every read if not null
+Result index_file_with_limit(const std::string &path,
+                             const IndexOptions &options, VideoIndex &index,
+                             IndexStats *stats, ReadSlots *slots) {
+  IndexStats local_stats;
+  IndexStats &s = stats != nullptr ? *stats : local_stats;
+  s = IndexStats();
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  s.syscalls++;
+  if (fd < 0) {
+    return Result(false, "Could not open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  s.syscalls++;
+  if (fstat(fd, &st) != 0) {
+    Result result(false, "Could not stat " + path + ": " + strerror(errno));
+    close(fd);
+    s.syscalls++;
+    return result;
+  }
+  uint64_t file_size = st.st_size;
+
+  // The last range read from the file
+  std::vector<uint8_t> window;
+  uint64_t window_offset = 0;
+  uint64_t window_size = 0;
+  auto read = [&](uint64_t offset, uint64_t size, const uint8_t *&data) {
+    if (offset >= window_offset &&
+        offset + size <= window_offset + window_size) {
+      data = window.data() + (offset - window_offset);
+      return Result();
+    }
+    uint64_t read_size =
+        std::min(std::max(size, INDEX_READ_AHEAD), file_size - offset);
+    if (window.size() < read_size) {
+      window.resize(read_size);
+    }
+    window_size = 0;
+    if (slots != nullptr) {
+      slots->acquire();
+    }
+    Result result = pread_fully(fd, path, window.data(), read_size, offset, s);
+    if (slots != nullptr) {
+      slots->release();
+    }
+    HWANG_RETURN_ON_ERROR(result);
+    window_offset = offset;
+    window_size = read_size;
+    data = window.data();
+    return Result();
+  };
+  Result result = run_index_creator(file_size, read, options, index);
+  close(fd);
+  s.syscalls++;
+  return result;
+}
+
+}
+
+Result index_buffer(const uint8_t *data, size_t size, VideoIndex &index,
+                    IndexStats *stats, const IndexOptions &options) {
+  IndexStats local_stats;
+  IndexStats &s = stats != nullptr ? *stats : local_stats;
+  s = IndexStats();
+  auto read = [&](uint64_t offset, uint64_t read_size, const uint8_t *&out) {
+    out = data + offset;
+    s.bytes_read += read_size;
+    return Result();
+  };
+  return run_index_creator(size, read, options, index);
+}
+
+Result index_file(const std::string &path, VideoIndex &index,
+                  IndexStats *stats, const IndexOptions &options) {
+  return index_file_with_limit(path, options, index, stats, nullptr);
+}
+
+uint64_t index_files(const std::vector<std::string> &paths,
+                     const IndexFileCallback &callback,
+                     const BatchIndexOptions &options) {
+  int32_t num_threads = options.num_threads;
+  if (num_threads <= 0) {
+    num_threads = std::max((int32_t)std::thread::hardware_concurrency(), 1);
+  }
+  std::unique_ptr<ReadSlots> slots;
+  if (options.max_concurrent_reads > 0) {
+    slots.reset(new ReadSlots(options.max_concurrent_reads));
+  }
+
+  std::atomic<uint64_t> failed{0};
+  // The calling thread indexes files too
+  ThreadPool pool(num_threads - 1);
+  pool.parallel_for(paths.size(), [&](int64_t i) {
+    VideoIndex index;
+    IndexStats stats;
+    Result result = index_file_with_limit(paths[i], options.index, index,
+                                          &stats, slots.get());
+    if (!result.ok) {
+      failed++;
+    }
+    callback(i, result, index, stats);
+  });
+  return failed;
 }
 
 } // namespace hwang
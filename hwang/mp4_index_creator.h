@@ -13,16 +13,29 @@
 
 #pragma once
 
+#include "hwang/common.h"
 #include "hwang/video_index.h"
 #include "hwang/util/mp4.h"
+#include "hwang/util/h264.h"
 
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace hwang {
 
+struct IndexOptions {
+  // For H.264 files without an 'sdtp' box, read the slice header of every
+  // sample to find the samples no other sample depends on, which lets the
+  // decoder skip them. Costs a read per run of samples, so indexing reads
+  // most of the file.
+  bool probe_samples = false;
+};
+
 class MP4IndexCreator {
  public:
-  MP4IndexCreator(uint64_t file_size);
+  MP4IndexCreator(uint64_t file_size,
+                  const IndexOptions &options = IndexOptions());
 
   // Parse chunks of data from an mp4 file
   // @param[in] data A buffer of data from the mp4 file
@@ -37,7 +50,8 @@ class MP4IndexCreator {
   VideoIndex get_video_index();
 
   bool is_done() {
-    return done_ || (parsed_ftyp_ && parsed_moov_ && !fragments_present_);
+    return done_ || (parsed_ftyp_ && parsed_moov_ && !fragments_present_ &&
+                     !probing_samples_);
   }
 
   bool is_error() { return error_; }
@@ -45,7 +59,21 @@ class MP4IndexCreator {
   const std::string& error_message() { return error_message_; }
 
  private:
+  void start_probing_samples();
+
+  bool probe_samples(const uint8_t *data, size_t size, uint64_t &next_offset,
+                     uint64_t &next_size);
+
+  // Requests the samples from next_probe_sample_ onwards that fit in one
+  // read of at most PROBE_READ_LIMIT bytes
+  void request_probe_run(uint64_t &next_offset, uint64_t &next_size);
+
+  // Number of bytes read from the start of a sample to find its slice header
+  const uint64_t SAMPLE_PROBE_SIZE = 256;
+  const uint64_t PROBE_READ_LIMIT = 1024 * 1024;
+
   const uint64_t file_size_;
+  const IndexOptions options_;
   bool done_;
   bool error_;
   std::string error_message_;
@@ -57,6 +85,15 @@ class MP4IndexCreator {
   bool parsed_moov_ = false;
   bool fragments_present_ = false;
 
+  // When the container does not say which samples other samples depend on,
+  // the flags are read from the slice header at the start of each sample
+  bool probing_samples_ = false;
+  uint64_t next_probe_sample_ = 0;
+  // Samples and file offset covered by the last probe request
+  uint64_t probe_run_end_ = 0;
+  uint64_t probe_run_offset_ = 0;
+  AVCConfig avc_config_;
+
   std::vector<TrackExtendsBox> track_extends_boxes_;
 
   uint32_t timescale_;
@@ -67,7 +104,55 @@ class MP4IndexCreator {
   std::vector<uint64_t> sample_offsets_;
   std::vector<uint64_t> sample_sizes_;
   std::vector<uint64_t> keyframe_indices_;
+  std::vector<uint8_t> sample_flags_;
+  std::vector<SampleRun> decode_time_runs_;
+  std::vector<SampleRun> composition_offset_runs_;
   std::vector<uint8_t> extradata_;
 };
 
+// I/O performed while indexing a file
+struct IndexStats {
+  uint64_t bytes_read = 0;
+  uint64_t syscalls = 0;
+};
+
+// Indexes an mp4 file held in memory. The indexer reads the file in place,
+// so bytes_read counts the bytes it looked at and no syscalls are made.
+Result index_buffer(const uint8_t *data, size_t size, VideoIndex &index,
+                    IndexStats *stats = nullptr,
+                    const IndexOptions &options = IndexOptions());
+
+// Smallest read made by index_file
+const uint64_t INDEX_READ_AHEAD = 4096;
+
+// Indexes an mp4 file on disk with pread, reading only the box headers, the
+// 'moov' and 'moof' boxes and, when probing samples, the samples themselves.
+// Requests that fall inside the previous read are served without another
+// syscall.
+Result index_file(const std::string &path, VideoIndex &index,
+                  IndexStats *stats = nullptr,
+                  const IndexOptions &options = IndexOptions());
+
+struct BatchIndexOptions {
+  // Threads indexing files, one per core if 0
+  int32_t num_threads = 0;
+  // Reads in flight at once across all threads, unlimited if 0. Lower it
+  // for disks that slow down under many concurrent requests.
+  int32_t max_concurrent_reads = 0;
+  IndexOptions index;
+};
+
+// Receives the outcome of indexing paths[file]. Called from the indexing
+// threads, possibly several at once.
+using IndexFileCallback =
+    std::function<void(size_t file, const Result &result,
+                       const VideoIndex &index, const IndexStats &stats)>;
+
+// Indexes many files in parallel with index_file. A file that can not be
+// indexed is reported to callback and does not stop the others. Returns the
+// number of files that failed.
+uint64_t index_files(const std::vector<std::string> &paths,
+                     const IndexFileCallback &callback,
+                     const BatchIndexOptions &options = BatchIndexOptions());
+
 }
@@ -12,11 +12,17 @@
  */
 
 #include "hwang/mp4_index_creator.h"
+#include "hwang/util/bits.h"
 #include "hwang/util/fs.h"
+#include "hwang/util/h264.h"
+#include "hwang/video_index_view.h"
 #include "hwang/tests/videos.h"
 
 #include <gtest/gtest.h>
 
+#include <cstdio>
+#include <fstream>
+#include <random>
 #include <thread>
 
 namespace hwang {
@@ -40,7 +46,501 @@ TEST(MP4IndexCreator, SimpleTest) {
                    current_offset, size_to_read);
     }
     ASSERT_FALSE(indexer.is_error());
-    indexer.get_video_index();
+    VideoIndex index = indexer.get_video_index();
+
+    // Every sample has flags and they survive serialization
+    EXPECT_EQ(index.sample_flags().size(), index.frames());
+    VideoIndex index2 = VideoIndex::deserialize(index.serialize());
+    EXPECT_EQ(index2.sample_flags(), index.sample_flags());
+    EXPECT_EQ(index2.num_non_ref_frames(), index.num_non_ref_frames());
+
+    // Frames are found again from their timestamps
+    EXPECT_TRUE(index.has_timestamps());
+    for (uint64_t i = 0; i < index.frames(); ++i) {
+      int64_t timestamp = index2.frame_timestamp(i);
+      if (i > 0) {
+        ASSERT_GT(timestamp, index2.frame_timestamp(i - 1));
+      }
+      ASSERT_EQ(index2.frame_at_timestamp(timestamp), i);
+    }
+  }
+}
+
+TEST(MP4IndexCreator, IndexFile) {
+  std::vector<TestVideoInfo> videos = {
+      test_video_fragmented,
+      test_video_unfragmented,
+      test_video_hevc};
+
+  for (const auto &video : videos) {
+    std::string path = download_video(video);
+    std::vector<uint8_t> video_bytes = read_entire_file(path);
+
+    VideoIndex file_index;
+    IndexStats file_stats;
+    Result result = index_file(path, file_index, &file_stats);
+    ASSERT_TRUE(result.ok) << result.message;
+
+    VideoIndex buffer_index;
+    IndexStats buffer_stats;
+    result = index_buffer(video_bytes.data(), video_bytes.size(),
+                          buffer_index, &buffer_stats);
+    ASSERT_TRUE(result.ok) << result.message;
+
+    EXPECT_EQ(file_index.serialize(), buffer_index.serialize());
+    EXPECT_GT(file_index.frames(), 0);
+    // Sample data is skipped
+    EXPECT_LT(file_stats.bytes_read, video_bytes.size());
+    EXPECT_GT(file_stats.syscalls, 0);
+    EXPECT_EQ(buffer_stats.syscalls, 0);
+  }
+
+  VideoIndex index;
+  EXPECT_FALSE(index_file("/nonexistent.mp4", index).ok);
+}
+
+TEST(MP4IndexCreator, IndexFiles) {
+  std::vector<std::string> paths = {download_video(test_video_fragmented),
+                                    "/nonexistent.mp4",
+                                    download_video(test_video_unfragmented)};
+  std::vector<Result> results(paths.size());
+  std::vector<uint64_t> frames(paths.size());
+  BatchIndexOptions options;
+  options.num_threads = 2;
+  options.max_concurrent_reads = 1;
+  uint64_t failed = index_files(
+      paths,
+      [&](size_t i, const Result &result, const VideoIndex &index,
+          const IndexStats &stats) {
+        results[i] = result;
+        frames[i] = index.frames();
+      },
+      options);
+
+  // A missing file does not stop the others
+  EXPECT_EQ(failed, 1);
+  EXPECT_TRUE(results[0].ok);
+  EXPECT_FALSE(results[1].ok);
+  EXPECT_TRUE(results[2].ok);
+  EXPECT_GT(frames[0], 0);
+  EXPECT_GT(frames[2], 0);
+}
+
+namespace {
+
+// Baseline profile, poc type 0 with 6 bit lsb, 4 bit frame_num
+const std::vector<uint8_t> test_avcc = {
+    0x01, 0x42, 0x00, 0x1E, 0xFF,
+    // One SPS
+    0xE1, 0x00, 0x08, 0x67, 0x42, 0x00, 0x1E, 0xED, 0x02, 0x83, 0xF2,
+    // One PPS
+    0x01, 0x00, 0x04, 0x68, 0xCE, 0x3C, 0x80};
+
+}
+
+TEST(H264, ParseAvcc) {
+  AVCConfig config;
+  ASSERT_TRUE(parse_avcc(test_avcc.data(), test_avcc.size(), config));
+  EXPECT_EQ(config.nal_length_size, 4);
+  ASSERT_EQ(config.sps_map.count(0), 1);
+  ASSERT_EQ(config.pps_map.count(0), 1);
+  const SPS &sps = config.sps_map.at(0);
+  EXPECT_EQ(sps.profile_idc, 66);
+  EXPECT_EQ(sps.log2_max_frame_num, 4);
+  EXPECT_EQ(sps.poc_type, 0);
+  EXPECT_EQ(sps.log2_max_pic_order_cnt_lsb, 6);
+  EXPECT_TRUE(sps.frame_mbs_only_flag);
+  EXPECT_EQ(config.pps_map.at(0).sps_id, 0);
+
+  // Wrong version, and a PPS that runs past the end
+  std::vector<uint8_t> bad = test_avcc;
+  bad[0] = 2;
+  EXPECT_FALSE(parse_avcc(bad.data(), bad.size(), config));
+  EXPECT_FALSE(parse_avcc(test_avcc.data(), test_avcc.size() - 1, config));
+}
+
+TEST(H264, ParseSampleSliceHeader) {
+  AVCConfig config;
+  ASSERT_TRUE(parse_avcc(test_avcc.data(), test_avcc.size(), config));
+
+  // IDR I slice preceded by an SEI NAL unit
+  std::vector<uint8_t> idr = {0x00, 0x00, 0x00, 0x02, 0x06, 0x80,
+                              0x00, 0x00, 0x00, 0x05, 0x65, 0x88,
+                              0x84, 0x0A, 0x80};
+  SliceHeader header;
+  ASSERT_TRUE(
+      parse_avcc_sample_slice_header(idr.data(), idr.size(), config, header));
+  EXPECT_EQ(header.nal_unit_type, 5);
+  EXPECT_EQ(header.nal_ref_idc, 3);
+  EXPECT_EQ(header.slice_type, 7);
+  EXPECT_EQ(header.frame_num, 0);
+  EXPECT_EQ(header.pic_order_cnt_lsb, 0);
+
+  // Non-reference B slice, truncated after the header
+  std::vector<uint8_t> b = {0x00, 0x00, 0x10, 0x00, 0x01, 0x9E, 0x42, 0x59};
+  ASSERT_TRUE(
+      parse_avcc_sample_slice_header(b.data(), b.size(), config, header));
+  EXPECT_EQ(header.nal_unit_type, 1);
+  EXPECT_EQ(header.nal_ref_idc, 0);
+  EXPECT_EQ(header.slice_type, 6);
+  EXPECT_EQ(header.frame_num, 2);
+  EXPECT_EQ(header.pic_order_cnt_lsb, 4);
+
+  // Unknown PPS
+  config.pps_map.clear();
+  EXPECT_FALSE(
+      parse_avcc_sample_slice_header(b.data(), b.size(), config, header));
+}
+
+TEST(MP4, AppendSampleSizes) {
+  auto stsz = [](uint32_t sample_size, uint32_t count,
+                 const std::vector<uint32_t> &entries) {
+    std::vector<uint8_t> box;
+    auto put32 = [&](uint32_t v) {
+      for (int shift = 24; shift >= 0; shift -= 8) {
+        box.push_back(v >> shift);
+      }
+    };
+    put32(20 + 4 * entries.size());
+    put32(string_to_type("stsz"));
+    put32(0);
+    put32(sample_size);
+    put32(count);
+    for (uint32_t entry : entries) {
+      put32(entry);
+    }
+    return box;
+  };
+  auto append = [](const std::vector<uint8_t> &box, uint64_t media_size,
+                   std::vector<uint64_t> &sizes) {
+    GetBitsState bs;
+    bs.buffer = box.data();
+    bs.offset = 0;
+    bs.size = box.size();
+    return append_sample_sizes(bs, media_size, sizes);
+  };
+
+  std::vector<uint64_t> sizes;
+  EXPECT_TRUE(append(stsz(0, 3, {10, 20, 30}), 1000, sizes));
+  EXPECT_TRUE(append(stsz(7, 2, {}), 1000, sizes));
+  EXPECT_EQ(sizes, std::vector<uint64_t>({10, 20, 30, 7, 7}));
+  // Counts the box or the file can not hold are rejected before allocating
+  EXPECT_FALSE(append(stsz(0, 0xFFFFFFFF, {10, 20}), 1000, sizes));
+  EXPECT_FALSE(append(stsz(1, 0xFFFFFFFF, {}), 1000, sizes));
+  EXPECT_EQ(sizes.size(), 5);
+}
+
+TEST(MP4, SampleTableEntryCounts) {
+  // Full box of the given type with an entry count and fields
+  auto table = [](const char *type, uint32_t count,
+                  const std::vector<uint32_t> &fields) {
+    std::vector<uint8_t> box;
+    auto put32 = [&](uint32_t v) {
+      for (int shift = 24; shift >= 0; shift -= 8) {
+        box.push_back(v >> shift);
+      }
+    };
+    put32(16 + 4 * fields.size());
+    put32(string_to_type(type));
+    put32(0);
+    put32(count);
+    for (uint32_t field : fields) {
+      put32(field);
+    }
+    return box;
+  };
+  auto reader = [](const std::vector<uint8_t> &box) {
+    GetBitsState bs;
+    bs.buffer = box.data();
+    bs.offset = 0;
+    bs.size = box.size();
+    return bs;
+  };
+
+  std::vector<uint8_t> box = table("stts", 2, {3, 100, 1, 50});
+  GetBitsState bs = reader(box);
+  TimeToSampleBox stts;
+  ASSERT_TRUE(parse_stts(bs, stts));
+  ASSERT_EQ(stts.entries.size(), 2);
+  EXPECT_EQ(stts.entries[1].sample_delta, 50);
+
+  box = table("ctts", 1, {4, (uint32_t)-2});
+  bs = reader(box);
+  CompositionOffsetBox ctts;
+  ASSERT_TRUE(parse_ctts(bs, ctts));
+  EXPECT_EQ(ctts.entries[0].sample_offset, -2);
+
+  box = table("stss", 2, {1, 5});
+  bs = reader(box);
+  SyncSampleBox stss;
+  ASSERT_TRUE(parse_stss(bs, stss));
+  EXPECT_EQ(stss.sample_number, std::vector<uint32_t>({1, 5}));
+
+  // Counts the box can not hold are rejected before allocating
+  for (const char *type : {"stts", "ctts", "stss"}) {
+    box = table(type, 0xFFFFFFFF, {1, 2});
+    bs = reader(box);
+    TimeToSampleBox stts;
+    CompositionOffsetBox ctts;
+    SyncSampleBox stss;
+    bool ok = std::string(type) == "stts"   ? parse_stts(bs, stts)
+              : std::string(type) == "ctts" ? parse_ctts(bs, ctts)
+                                            : parse_stss(bs, stss);
+    EXPECT_FALSE(ok) << type;
+  }
+}
+
+TEST(Bits, GetBits) {
+  // Exp-Golomb codes for 0, 1, 2 and 7, -1 and 2 as signed codes, then
+  // 0xABCD at an odd bit offset
+  std::vector<uint8_t> data = {0xA6, 0x21, 0x90, 0x55, 0xE6, 0x80};
+  GetBitsState gb = {data.data(), 0, (int64_t)data.size()};
+  EXPECT_EQ(get_ue_golomb(gb), 0);
+  EXPECT_EQ(get_ue_golomb(gb), 1);
+  EXPECT_EQ(get_ue_golomb(gb), 2);
+  EXPECT_EQ(get_ue_golomb(gb), 7);
+  EXPECT_EQ(get_se_golomb(gb), -1);
+  EXPECT_EQ(get_se_golomb(gb), 2);
+  EXPECT_EQ(gb.offset, 22);
+  EXPECT_EQ(get_bits(gb, 3), 0);
+  EXPECT_EQ(get_bits(gb, 16), 0xABCD);
+  // Reads past the end return zeros
+  EXPECT_EQ(get_bits(gb, 8), 0);
+  EXPECT_EQ(get_ue_golomb(gb), 0xFFFFFFFF);
+
+  // Random fields agree with reading one bit at a time
+  std::mt19937_64 rng(0);
+  std::vector<uint8_t> random(1024);
+  for (uint8_t &b : random) {
+    b = rng();
+  }
+  GetBitsState fast = {random.data(), 0, (int64_t)random.size()};
+  GetBitsState slow = fast;
+  while (fast.offset < 8000) {
+    int32_t bits = rng() % 65;
+    uint64_t expected = 0;
+    for (int32_t i = 0; i < bits; ++i) {
+      expected = (expected << 1) | get_bit(slow);
+    }
+    ASSERT_EQ(get_bits(fast, bits), expected) << bits << " bits";
+  }
+}
+
+TEST(VideoIndex, Timestamps) {
+  // IPBB... ordering: each P frame is shown after the two B frames
+  // following it in decode order
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+  for (uint64_t i = 0; i < 7; ++i) {
+    offsets.push_back(i * 1000);
+    sizes.push_back(1000);
+  }
+  VideoIndex index(10, 70, 16, 16, "avc1", offsets, sizes, {0}, {}, {},
+                   {{7, 10}}, {{1, 10}, {1, 30}, {2, 0}, {1, 30}, {2, 0}});
+
+  EXPECT_EQ(index.sample_decode_timestamp(3), 30);
+  EXPECT_EQ(index.sample_presentation_timestamp(1), 40);
+  EXPECT_EQ(index.sample_presentation_timestamp(2), 20);
+  for (uint64_t i = 0; i < 7; ++i) {
+    EXPECT_EQ(index.frame_timestamp(i), (int64_t)(i + 1) * 10);
+  }
+  EXPECT_EQ(index.frame_at_timestamp(0), 0);
+  EXPECT_EQ(index.frame_at_timestamp(25), 1);
+  EXPECT_EQ(index.frame_at_timestamp(1000), 6);
+  EXPECT_EQ(index.frames_at_interval(2.0), std::vector<uint64_t>({0, 2, 4, 6}));
+}
+
+TEST(VideoIndex, Compact) {
+  // Samples interleaved with other tracks: runs of three contiguous samples
+  // with gaps between them and a chunk placed out of order
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+  uint64_t offset = 1000;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    if (i % 3 == 0) {
+      offset += 5000;
+    }
+    offsets.push_back(i == 500 ? 10 : offset);
+    sizes.push_back(100 + i % 50);
+    offset += sizes.back();
+  }
+  std::vector<uint64_t> keyframes = {0, 250, 500, 999};
+  VideoIndex index(1, 1000, 16, 16, "avc1", offsets, sizes, keyframes, {});
+  VideoIndex compact = index;
+  ASSERT_TRUE(compact.compact());
+  EXPECT_TRUE(compact.is_compact());
+  EXPECT_LT(compact.sample_table_bytes() * 10, index.sample_table_bytes() * 6);
+
+  for (uint64_t i = 0; i < index.frames(); ++i) {
+    ASSERT_EQ(compact.sample_offset(i), offsets[i]);
+    ASSERT_EQ(compact.sample_size(i), sizes[i]);
+    ASSERT_EQ(compact.is_keyframe(i), index.is_keyframe(i));
+  }
+  EXPECT_EQ(compact.serialize(), index.serialize());
+  VideoIntervals a = slice_into_video_intervals(index, {1, 260, 700});
+  VideoIntervals b = slice_into_video_intervals(compact, {1, 260, 700});
+  EXPECT_EQ(a.sample_index_intervals, b.sample_index_intervals);
+  EXPECT_EQ(a.estimated_cost, b.estimated_cost);
+
+  // The vectors are built on demand
+  EXPECT_EQ(compact.sample_offsets(), offsets);
+  EXPECT_EQ(compact.sample_sizes(), sizes);
+  EXPECT_EQ(compact.keyframe_indices(), keyframes);
+
+  // Samples of 4 GB or more do not fit
+  VideoIndex huge(1, 1, 16, 16, "avc1", {0}, {1ULL << 32}, {0}, {});
+  EXPECT_FALSE(huge.compact());
+  EXPECT_EQ(huge.sample_size(0), 1ULL << 32);
+}
+
+TEST(VideoIndex, SerializeVersions) {
+  // Contiguous samples apart from a gap and one sample placed before the rest
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+  uint64_t offset = 48;
+  for (uint64_t i = 0; i < 300; ++i) {
+    offset += i == 100 ? 70000 : 0;
+    offsets.push_back(i == 200 ? 8 : offset);
+    sizes.push_back(1000 + (i * 7919) % 30000);
+    offset += sizes.back();
+  }
+  VideoIndex index(1, 300, 16, 16, "avc1", offsets, sizes, {0, 120, 240},
+                   {1, 2, 3}, std::vector<uint8_t>(300, SAMPLE_FLAG_KNOWN),
+                   {{300, 1}});
+
+  // Version 1 stays the default for older readers
+  std::vector<uint8_t> v1 = index.serialize(1);
+  std::vector<uint8_t> v2 = index.serialize(2);
+  EXPECT_EQ(index.serialize(), v1);
+  EXPECT_LT(v2.size() * 4, v1.size() * 3);
+  for (const std::vector<uint8_t> &data : {v1, v2}) {
+    VideoIndex read;
+    Result result = VideoIndex::deserialize(data.data(), data.size(), read);
+    ASSERT_TRUE(result.ok) << result.message;
+    EXPECT_EQ(read.sample_offsets(), offsets);
+    EXPECT_EQ(read.sample_sizes(), sizes);
+    EXPECT_EQ(read.serialize(1), v1);
+    EXPECT_EQ(read.serialize(2), v2);
+  }
+
+  // Truncated data is rejected
+  VideoIndex read;
+  EXPECT_FALSE(VideoIndex::deserialize(v2.data(), v2.size() / 2, read).ok);
+}
+
+TEST(VideoIndexView, Open) {
+  std::vector<uint64_t> offsets = {48, 148, 9000, 9500, 9600};
+  std::vector<uint64_t> sizes = {100, 8000, 500, 100, 1ULL << 33};
+  std::vector<uint64_t> keyframes = {1, 3};
+  VideoIndex index(90000, 15000, 640, 480, "hev1", offsets, sizes, keyframes,
+                   {1, 2, 3}, std::vector<uint8_t>(5, SAMPLE_FLAG_KNOWN));
+  std::vector<uint8_t> data = index.serialize_flat();
+
+  std::string path;
+  temp_file(path);
+  std::ofstream(path, std::ios::binary)
+      .write((const char *)data.data(), data.size());
+  VideoIndexView view;
+  Result result = VideoIndexView::open(path, view);
+  std::remove(path.c_str());
+  ASSERT_TRUE(result.ok) << result.message;
+
+  EXPECT_EQ(view.timescale(), 90000);
+  EXPECT_EQ(view.duration(), 15000);
+  EXPECT_EQ(view.frame_width(), 640);
+  EXPECT_EQ(view.frame_height(), 480);
+  EXPECT_EQ(view.format(), "hev1");
+  ASSERT_EQ(view.frames(), 5);
+  for (uint64_t i = 0; i < view.frames(); ++i) {
+    EXPECT_EQ(view.sample_offset(i), offsets[i]);
+    EXPECT_EQ(view.sample_size(i), sizes[i]);
+    EXPECT_EQ(view.sample_flags(i), SAMPLE_FLAG_KNOWN);
+    EXPECT_EQ(view.is_keyframe(i), i == 1 || i == 3);
+  }
+  EXPECT_EQ(view.keyframe_at_or_before(0), 1);
+  EXPECT_EQ(view.keyframe_at_or_before(2), 1);
+  EXPECT_EQ(view.keyframe_at_or_before(4), 3);
+  EXPECT_EQ(std::vector<uint8_t>(view.metadata_bytes(),
+                                 view.metadata_bytes() + view.metadata_size()),
+            std::vector<uint8_t>({1, 2, 3}));
+
+  // Arrays that run past the end of the data are rejected
+  VideoIndexView truncated;
+  EXPECT_FALSE(
+      VideoIndexView::from_buffer(data.data(), data.size() - 16, truncated)
+          .ok);
+  EXPECT_FALSE(VideoIndexView::from_buffer(data.data() + 8, data.size() - 8,
+                                           truncated)
+                   .ok);
+}
+
+TEST(VideoIndex, SliceIntoVideoIntervals) {
+  // Four GOPs of ten 1000 byte frames
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> sizes;
+  for (uint64_t i = 0; i < 40; ++i) {
+    offsets.push_back(i * 1000);
+    sizes.push_back(1000);
+  }
+  VideoIndex index(1, 40, 16, 16, "hev1", offsets, sizes, {0, 10, 20, 30},
+                   {});
+
+  // Sparse rows are cheaper to seek to
+  VideoIntervals sparse = slice_into_video_intervals(index, {0, 35});
+  ASSERT_EQ(sparse.sample_index_intervals.size(), 2);
+  EXPECT_EQ(sparse.sample_index_intervals[0], std::make_tuple(0, 10));
+  EXPECT_EQ(sparse.sample_index_intervals[1], std::make_tuple(30, 40));
+  EXPECT_EQ(sparse.estimated_frames_decoded, 7);
+
+  // Rows on both sides of a keyframe are decoded in one interval
+  VideoIntervals dense = slice_into_video_intervals(index, {9, 10});
+  ASSERT_EQ(dense.sample_index_intervals.size(), 1);
+  EXPECT_EQ(dense.sample_index_intervals[0], std::make_tuple(0, 20));
+  EXPECT_EQ(dense.estimated_frames_decoded, 11);
+
+  // Decoding through GOPs wins when seeking is expensive
+  IntervalCosts costs;
+  costs.seek = 100;
+  VideoIntervals merged = slice_into_video_intervals(index, {0, 35}, costs);
+  ASSERT_EQ(merged.sample_index_intervals.size(), 1);
+  EXPECT_EQ(merged.sample_index_intervals[0], std::make_tuple(0, 40));
+  EXPECT_EQ(merged.valid_frames[0], std::vector<uint64_t>({0, 35}));
+  EXPECT_EQ(merged.estimated_frames_decoded, 36);
+
+  // Disposable h264 frames are only skipped in GOPs that start with an IDR
+  std::vector<uint8_t> flags(40, SAMPLE_FLAG_KNOWN);
+  for (uint64_t i = 0; i < 40; ++i) {
+    if (i % 2 == 1) {
+      flags[i] |= SAMPLE_FLAG_DISPOSABLE;
+    }
+  }
+  flags[0] |= SAMPLE_FLAG_INTRA | SAMPLE_FLAG_IDR;
+  flags[10] |= SAMPLE_FLAG_INTRA;
+  VideoIndex avc_index(1, 40, 16, 16, "avc1", offsets, sizes, {0, 10, 20, 30},
+                       test_avcc, flags);
+  VideoIntervals skipped = slice_into_video_intervals(avc_index, {8, 18});
+  EXPECT_EQ(skipped.estimated_frames_decoded, 5 + 9);
+  IntervalCosts no_skip;
+  no_skip.skip_non_ref_frames = false;
+  VideoIntervals all = slice_into_video_intervals(avc_index, {8, 18}, no_skip);
+  EXPECT_EQ(all.estimated_frames_decoded, 19);
+
+  // Keyframes are looked up without building the keyframe list
+  for (int compact = 0; compact < 2; ++compact) {
+    if (compact == 1) {
+      ASSERT_TRUE(index.compact());
+    }
+    size_t table_bytes = index.sample_table_bytes();
+    EXPECT_EQ(index.keyframe_at_or_before(0), 0);
+    EXPECT_EQ(index.keyframe_at_or_before(19), 10);
+    EXPECT_EQ(index.keyframe_at_or_before(20), 20);
+    EXPECT_EQ(index.keyframe_at_or_before(100), 30);
+    EXPECT_EQ(index.keyframe_at_or_after(0), 0);
+    EXPECT_EQ(index.keyframe_at_or_after(11), 20);
+    EXPECT_EQ(index.keyframe_at_or_after(31), 40);
+    VideoIntervals again = slice_into_video_intervals(index, {0, 35});
+    EXPECT_EQ(again.sample_index_intervals, sparse.sample_index_intervals);
+    EXPECT_EQ(index.sample_table_bytes(), table_bytes);
   }
 }
 
@@ -35,6 +35,11 @@ const TestVideoInfo
     test_video_hevc("https://test-videos.co.uk/vids/bigbuckbunny/mp4/h265/1080/"
                     "Big_Buck_Bunny_1080_10s_1MB.mp4");
 
+// H.264 with B frames, which exercises dropping non-reference frames
+const TestVideoInfo
+    test_video_h264("https://test-videos.co.uk/vids/bigbuckbunny/mp4/h264/360/"
+                    "Big_Buck_Bunny_360_10s_1MB.mp4");
+
 inline std::string download_video(const TestVideoInfo& info) {
   std::string local_video_path;
   temp_file(local_video_path);
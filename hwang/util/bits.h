@@ -13,27 +13,72 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+
 namespace hwang {
 
+// Big-endian bit reader. offset is in bits and size in bytes. Bits past the
+// end of the buffer read as zero.
 struct GetBitsState {
   const uint8_t* buffer;
   int64_t offset;
   int64_t size;
 };
 
+inline uint64_t big_endian_64(uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(v);
+#else
+  return v;
+#endif
+}
+
+// The 8 bytes starting at byte, most significant first
+inline uint64_t load_bits_word(const GetBitsState& gb, int64_t byte) {
+  if (byte + 8 <= gb.size) {
+    uint64_t v;
+    memcpy(&v, gb.buffer + byte, 8);
+    return big_endian_64(v);
+  }
+  uint64_t v = 0;
+  for (int64_t i = byte; i < byte + 8; ++i) {
+    v = (v << 8) | (i < gb.size ? gb.buffer[i] : 0);
+  }
+  return v;
+}
+
+// The bits from offset onwards in the most significant bits of the result.
+// At least the top 57 bits are valid.
+inline uint64_t peek_bits_word(const GetBitsState& gb) {
+  return load_bits_word(gb, gb.offset >> 3) << (gb.offset & 0x7);
+}
+
 inline uint8_t get_bit(GetBitsState& gb) {
-  uint8_t v =
-      ((*(gb.buffer + (gb.offset >> 0x3))) >> (0x7 - (gb.offset & 0x7))) & 0x1;
-  //((*(gb.buffer + (gb.offset >> 0x3))) >> ((gb.offset & 0x7))) & 0x1;
+  int64_t byte = gb.offset >> 0x3;
+  uint8_t v = byte < gb.size
+                  ? (gb.buffer[byte] >> (0x7 - (gb.offset & 0x7))) & 0x1
+                  : 0;
   gb.offset++;
   return v;
 }
 
 inline uint64_t get_bits(GetBitsState& gb, int32_t bits) {
-  uint64_t v = 0;
-  for (int i = bits - 1; i >= 0; i--) {
-    v |= (uint64_t)(get_bit(gb)) << i;
+  if (bits <= 0) {
+    return 0;
+  }
+  if ((gb.offset & 0x7) == 0 && bits == 64) {
+    uint64_t v = load_bits_word(gb, gb.offset >> 3);
+    gb.offset += 64;
+    return v;
+  }
+  if (bits > 57) {
+    uint64_t high = get_bits(gb, bits - 32);
+    return (high << 32) | get_bits(gb, 32);
   }
+  // One unaligned load covers the field whether or not it is byte aligned
+  uint64_t v = peek_bits_word(gb) >> (64 - bits);
+  gb.offset += bits;
   return v;
 }
 
@@ -44,38 +89,29 @@ inline void align(GetBitsState& gb, int32_t alignment) {
   }
 }
 
+// Exp-Golomb code number. Returns 0xFFFFFFFF and skips to the end of the
+// buffer if there are more than 32 leading zeros, which only happens in
+// corrupt streams.
 inline uint64_t get_ue_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
-  int32_t zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
+  uint64_t word = peek_bits_word(gb);
+  int32_t zeros = word != 0 ? __builtin_clzll(word) : 64;
+  if (2 * zeros + 1 <= 57) {
+    // The whole code is in the word
+    gb.offset += 2 * zeros + 1;
+    return (word >> (64 - (2 * zeros + 1))) - 1;
   }
-
-  // insert first 1 bit
-  uint32_t info = 1 << zeros;
-
-  for (int32_t i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
+  if (zeros > 32) {
+    gb.offset = gb.size * 8;
+    return 0xFFFFFFFF;
   }
-
-  return (info - 1);
+  gb.offset += zeros + 1;
+  return ((1ULL << zeros) | get_bits(gb, zeros)) - 1;
 }
 
-inline uint32_t get_se_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
-  int32_t zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
-  }
-
-  // insert first 1 bit
-  int32_t info = 1 << zeros;
-
-  for (int32_t i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
-  }
-
-  return (info - 1);
+// Signed Exp-Golomb: code numbers 1, 2, 3, 4, ... map to 1, -1, 2, -2, ...
+inline int32_t get_se_golomb(GetBitsState& gb) {
+  uint64_t k = get_ue_golomb(gb);
+  return (k & 1) ? (int32_t)((k + 1) / 2) : -(int32_t)(k / 2);
 }
 
 }
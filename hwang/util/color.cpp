@@ -0,0 +1,505 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hwang/util/color.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HWANG_X86 1
+#include <immintrin.h>
+#endif
+
+namespace hwang {
+
+namespace {
+
+// All kernels compute, in 16-bit lanes with 6 fractional bits:
+//   yc = mulhrs((Y - y_offset) * 128, y) + 32
+//   R  = (yc + mulhrs(E, rv)) >> 6
+//   G  = (yc + mulhrs(D, gu) + mulhrs(E, gv)) >> 6
+//   B  = (yc + D + mulhrs(D, bu)) >> 6
+// where D = (U - 128) * 128, E = (V - 128) * 128 and mulhrs rounds a * b /
+// 2^15 like pmulhrsw. Coefficients are in units of 2^-14; bu is the blue
+// coefficient minus 2 so that it fits in 16 bits. Sums saturate to 16 bits
+// and results are clamped to [0, 255].
+struct Coefficients {
+  int16_t y_offset;
+  int16_t y;
+  int16_t rv;
+  int16_t gu;
+  int16_t gv;
+  int16_t bu;
+};
+
+// BT.601
+const Coefficients LIMITED_RANGE = {16, 19077, 26149, -6419, -13320, 282};
+const Coefficients FULL_RANGE = {0, 16384, 22970, -5638, -11700, -3736};
+
+inline int32_t mulhrs(int32_t a, int32_t b) { return (a * b + 0x4000) >> 15; }
+
+inline int32_t sat16(int32_t v) {
+  return std::min(std::max(v, (int32_t)INT16_MIN), (int32_t)INT16_MAX);
+}
+
+inline uint8_t clamp8(int32_t v) {
+  return (uint8_t)std::min(std::max(v, 0), 255);
+}
+
+// Converts pixels [begin, width) of a row
+void convert_row_scalar(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                        int32_t uv_step, uint8_t *rgb, int32_t begin,
+                        int32_t width, const Coefficients &c, bool bgr) {
+  for (int32_t x = begin; x < width; ++x) {
+    int32_t cx = (x / 2) * uv_step;
+    int32_t yc = mulhrs((y[x] - c.y_offset) * 128, c.y) + 32;
+    int32_t d = (u[cx] - 128) * 128;
+    int32_t e = (v[cx] - 128) * 128;
+    uint8_t r = clamp8(sat16(yc + mulhrs(e, c.rv)) >> 6);
+    uint8_t g =
+        clamp8(sat16(sat16(yc + mulhrs(d, c.gu)) + mulhrs(e, c.gv)) >> 6);
+    uint8_t b = clamp8(sat16(sat16(yc + d) + mulhrs(d, c.bu)) >> 6);
+    uint8_t *out = rgb + x * 3;
+    out[0] = bgr ? b : r;
+    out[1] = g;
+    out[2] = bgr ? r : b;
+  }
+}
+
+#ifdef HWANG_X86
+
+#define HWANG_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define HWANG_TARGET_AVX2 __attribute__((target("avx2")))
+#define HWANG_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+// Interleaves 16 pixels of three channels into 48 bytes
+HWANG_TARGET_SSE41 inline void store_rgb24(uint8_t *out, __m128i c0,
+                                           __m128i c1, __m128i c2) {
+  const __m128i m00 =
+      _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i m10 =
+      _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i m20 =
+      _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i m01 =
+      _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i m11 =
+      _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i m21 =
+      _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i m02 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14,
+                                    -1, -1, 15, -1, -1);
+  const __m128i m12 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1,
+                                    14, -1, -1, 15, -1);
+  const __m128i m22 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1,
+                                    -1, 14, -1, -1, 15);
+  __m128i o0 = _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(c0, m00), _mm_shuffle_epi8(c1, m10)),
+      _mm_shuffle_epi8(c2, m20));
+  __m128i o1 = _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(c0, m01), _mm_shuffle_epi8(c1, m11)),
+      _mm_shuffle_epi8(c2, m21));
+  __m128i o2 = _mm_or_si128(
+      _mm_or_si128(_mm_shuffle_epi8(c0, m02), _mm_shuffle_epi8(c1, m12)),
+      _mm_shuffle_epi8(c2, m22));
+  _mm_storeu_si128((__m128i *)out, o0);
+  _mm_storeu_si128((__m128i *)(out + 16), o1);
+  _mm_storeu_si128((__m128i *)(out + 32), o2);
+}
+
+// Loads 16 chroma samples starting at sample cx. Interleaved UV is split
+// with a shuffle.
+HWANG_TARGET_SSE41 inline void load_chroma16(const uint8_t *u,
+                                             const uint8_t *v, int32_t uv_step,
+                                             int32_t cx, __m128i &us,
+                                             __m128i &vs) {
+  if (uv_step == 1) {
+    us = _mm_loadu_si128((const __m128i *)(u + cx));
+    vs = _mm_loadu_si128((const __m128i *)(v + cx));
+  } else {
+    const __m128i split =
+        _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    __m128i a = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(u + cx * 2)), split);
+    __m128i b = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(u + cx * 2 + 16)), split);
+    us = _mm_unpacklo_epi64(a, b);
+    vs = _mm_unpackhi_epi64(a, b);
+  }
+}
+
+HWANG_TARGET_SSE41 inline void load_chroma8(const uint8_t *u, const uint8_t *v,
+                                            int32_t uv_step, int32_t cx,
+                                            __m128i &us, __m128i &vs) {
+  if (uv_step == 1) {
+    us = _mm_loadl_epi64((const __m128i *)(u + cx));
+    vs = _mm_loadl_epi64((const __m128i *)(v + cx));
+  } else {
+    const __m128i split =
+        _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    __m128i a = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(u + cx * 2)), split);
+    us = a;
+    vs = _mm_srli_si128(a, 8);
+  }
+}
+
+// Eight pixels of 16-bit Y, U and V to 16-bit R, G and B
+HWANG_TARGET_SSE41 inline void yuv_to_rgb_epi16(__m128i y, __m128i u,
+                                                __m128i v,
+                                                const Coefficients &c,
+                                                __m128i &r, __m128i &g,
+                                                __m128i &b) {
+  const __m128i bias = _mm_set1_epi16(128);
+  __m128i yc = _mm_add_epi16(
+      _mm_mulhrs_epi16(
+          _mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(c.y_offset)), 7),
+          _mm_set1_epi16(c.y)),
+      _mm_set1_epi16(32));
+  __m128i d = _mm_slli_epi16(_mm_sub_epi16(u, bias), 7);
+  __m128i e = _mm_slli_epi16(_mm_sub_epi16(v, bias), 7);
+  r = _mm_srai_epi16(
+      _mm_adds_epi16(yc, _mm_mulhrs_epi16(e, _mm_set1_epi16(c.rv))), 6);
+  g = _mm_srai_epi16(
+      _mm_adds_epi16(
+          _mm_adds_epi16(yc, _mm_mulhrs_epi16(d, _mm_set1_epi16(c.gu))),
+          _mm_mulhrs_epi16(e, _mm_set1_epi16(c.gv))),
+      6);
+  b = _mm_srai_epi16(
+      _mm_adds_epi16(_mm_adds_epi16(yc, d),
+                     _mm_mulhrs_epi16(d, _mm_set1_epi16(c.bu))),
+      6);
+}
+
+HWANG_TARGET_SSE41 void convert_row_sse41(const uint8_t *y, const uint8_t *u,
+                                          const uint8_t *v, int32_t uv_step,
+                                          uint8_t *rgb, int32_t width,
+                                          const Coefficients &c, bool bgr) {
+  int32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i ys = _mm_loadu_si128((const __m128i *)(y + x));
+    __m128i us, vs;
+    load_chroma8(u, v, uv_step, x / 2, us, vs);
+    us = _mm_unpacklo_epi8(us, us);
+    vs = _mm_unpacklo_epi8(vs, vs);
+
+    __m128i r[2], g[2], b[2];
+    for (int32_t h = 0; h < 2; ++h) {
+      yuv_to_rgb_epi16(_mm_cvtepu8_epi16(ys), _mm_cvtepu8_epi16(us),
+                       _mm_cvtepu8_epi16(vs), c, r[h], g[h], b[h]);
+      ys = _mm_srli_si128(ys, 8);
+      us = _mm_srli_si128(us, 8);
+      vs = _mm_srli_si128(vs, 8);
+    }
+    __m128i r8 = _mm_packus_epi16(r[0], r[1]);
+    __m128i g8 = _mm_packus_epi16(g[0], g[1]);
+    __m128i b8 = _mm_packus_epi16(b[0], b[1]);
+    store_rgb24(rgb + x * 3, bgr ? b8 : r8, g8, bgr ? r8 : b8);
+  }
+  convert_row_scalar(y, u, v, uv_step, rgb, x, width, c, bgr);
+}
+
+// Sixteen pixels of 16-bit Y, U and V to 16-bit R, G and B
+HWANG_TARGET_AVX2 inline void yuv_to_rgb_epi16(__m256i y, __m256i u,
+                                               __m256i v,
+                                               const Coefficients &c,
+                                               __m256i &r, __m256i &g,
+                                               __m256i &b) {
+  const __m256i bias = _mm256_set1_epi16(128);
+  __m256i yc = _mm256_add_epi16(
+      _mm256_mulhrs_epi16(
+          _mm256_slli_epi16(_mm256_sub_epi16(y, _mm256_set1_epi16(c.y_offset)),
+                            7),
+          _mm256_set1_epi16(c.y)),
+      _mm256_set1_epi16(32));
+  __m256i d = _mm256_slli_epi16(_mm256_sub_epi16(u, bias), 7);
+  __m256i e = _mm256_slli_epi16(_mm256_sub_epi16(v, bias), 7);
+  r = _mm256_srai_epi16(
+      _mm256_adds_epi16(yc, _mm256_mulhrs_epi16(e, _mm256_set1_epi16(c.rv))),
+      6);
+  g = _mm256_srai_epi16(
+      _mm256_adds_epi16(
+          _mm256_adds_epi16(yc,
+                            _mm256_mulhrs_epi16(d, _mm256_set1_epi16(c.gu))),
+          _mm256_mulhrs_epi16(e, _mm256_set1_epi16(c.gv))),
+      6);
+  b = _mm256_srai_epi16(
+      _mm256_adds_epi16(_mm256_adds_epi16(yc, d),
+                        _mm256_mulhrs_epi16(d, _mm256_set1_epi16(c.bu))),
+      6);
+}
+
+HWANG_TARGET_AVX2 void convert_row_avx2(const uint8_t *y, const uint8_t *u,
+                                        const uint8_t *v, int32_t uv_step,
+                                        uint8_t *rgb, int32_t width,
+                                        const Coefficients &c, bool bgr) {
+  int32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m128i us, vs;
+    load_chroma16(u, v, uv_step, x / 2, us, vs);
+    __m128i ud[2] = {_mm_unpacklo_epi8(us, us), _mm_unpackhi_epi8(us, us)};
+    __m128i vd[2] = {_mm_unpacklo_epi8(vs, vs), _mm_unpackhi_epi8(vs, vs)};
+
+    __m256i r[2], g[2], b[2];
+    for (int32_t h = 0; h < 2; ++h) {
+      __m128i ys = _mm_loadu_si128((const __m128i *)(y + x + h * 16));
+      yuv_to_rgb_epi16(_mm256_cvtepu8_epi16(ys), _mm256_cvtepu8_epi16(ud[h]),
+                       _mm256_cvtepu8_epi16(vd[h]), c, r[h], g[h], b[h]);
+    }
+    // packus works within 128-bit lanes so put the quadwords back in order
+    __m256i r8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(r[0], r[1]),
+                                          0xD8);
+    __m256i g8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(g[0], g[1]),
+                                          0xD8);
+    __m256i b8 = _mm256_permute4x64_epi64(_mm256_packus_epi16(b[0], b[1]),
+                                          0xD8);
+    if (bgr) {
+      std::swap(r8, b8);
+    }
+    store_rgb24(rgb + x * 3, _mm256_castsi256_si128(r8),
+                _mm256_castsi256_si128(g8), _mm256_castsi256_si128(b8));
+    store_rgb24(rgb + x * 3 + 48, _mm256_extracti128_si256(r8, 1),
+                _mm256_extracti128_si256(g8, 1),
+                _mm256_extracti128_si256(b8, 1));
+  }
+  convert_row_scalar(y, u, v, uv_step, rgb, x, width, c, bgr);
+}
+
+// Thirty-two pixels of 16-bit Y, U and V to 8-bit R, G and B
+HWANG_TARGET_AVX512 inline void yuv_to_rgb_epi8(__m512i y, __m512i u,
+                                                __m512i v,
+                                                const Coefficients &c,
+                                                __m256i &r, __m256i &g,
+                                                __m256i &b) {
+  const __m512i bias = _mm512_set1_epi16(128);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i max = _mm512_set1_epi16(255);
+  __m512i yc = _mm512_add_epi16(
+      _mm512_mulhrs_epi16(
+          _mm512_slli_epi16(_mm512_sub_epi16(y, _mm512_set1_epi16(c.y_offset)),
+                            7),
+          _mm512_set1_epi16(c.y)),
+      _mm512_set1_epi16(32));
+  __m512i d = _mm512_slli_epi16(_mm512_sub_epi16(u, bias), 7);
+  __m512i e = _mm512_slli_epi16(_mm512_sub_epi16(v, bias), 7);
+  __m512i r16 = _mm512_srai_epi16(
+      _mm512_adds_epi16(yc, _mm512_mulhrs_epi16(e, _mm512_set1_epi16(c.rv))),
+      6);
+  __m512i g16 = _mm512_srai_epi16(
+      _mm512_adds_epi16(
+          _mm512_adds_epi16(yc,
+                            _mm512_mulhrs_epi16(d, _mm512_set1_epi16(c.gu))),
+          _mm512_mulhrs_epi16(e, _mm512_set1_epi16(c.gv))),
+      6);
+  __m512i b16 = _mm512_srai_epi16(
+      _mm512_adds_epi16(_mm512_adds_epi16(yc, d),
+                        _mm512_mulhrs_epi16(d, _mm512_set1_epi16(c.bu))),
+      6);
+  r = _mm512_cvtepi16_epi8(_mm512_min_epi16(_mm512_max_epi16(r16, zero), max));
+  g = _mm512_cvtepi16_epi8(_mm512_min_epi16(_mm512_max_epi16(g16, zero), max));
+  b = _mm512_cvtepi16_epi8(_mm512_min_epi16(_mm512_max_epi16(b16, zero), max));
+}
+
+HWANG_TARGET_AVX512 void convert_row_avx512(const uint8_t *y, const uint8_t *u,
+                                            const uint8_t *v, int32_t uv_step,
+                                            uint8_t *rgb, int32_t width,
+                                            const Coefficients &c, bool bgr) {
+  int32_t x = 0;
+  for (; x + 64 <= width; x += 64) {
+    for (int32_t h = 0; h < 2; ++h) {
+      int32_t px = x + h * 32;
+      __m128i us, vs;
+      load_chroma16(u, v, uv_step, px / 2, us, vs);
+      __m256i ud = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_unpacklo_epi8(us, us)),
+          _mm_unpackhi_epi8(us, us), 1);
+      __m256i vd = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_unpacklo_epi8(vs, vs)),
+          _mm_unpackhi_epi8(vs, vs), 1);
+      __m256i ys = _mm256_loadu_si256((const __m256i *)(y + px));
+
+      __m256i r8, g8, b8;
+      yuv_to_rgb_epi8(_mm512_cvtepu8_epi16(ys), _mm512_cvtepu8_epi16(ud),
+                      _mm512_cvtepu8_epi16(vd), c, r8, g8, b8);
+      if (bgr) {
+        std::swap(r8, b8);
+      }
+      store_rgb24(rgb + px * 3, _mm256_castsi256_si128(r8),
+                  _mm256_castsi256_si128(g8), _mm256_castsi256_si128(b8));
+      store_rgb24(rgb + px * 3 + 48, _mm256_extracti128_si256(r8, 1),
+                  _mm256_extracti128_si256(g8, 1),
+                  _mm256_extracti128_si256(b8, 1));
+    }
+  }
+  convert_row_scalar(y, u, v, uv_step, rgb, x, width, c, bgr);
+}
+
+#endif
+
+}
+
+SIMDLevel best_simd_level() {
+#ifdef HWANG_X86
+  static const SIMDLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+      return SIMDLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return SIMDLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+      return SIMDLevel::SSE41;
+    }
+    return SIMDLevel::SCALAR;
+  }();
+  return level;
+#else
+  return SIMDLevel::SCALAR;
+#endif
+}
+
+void yuv420_to_rgb24(const YUV420Image &image, uint8_t *rgb,
+                     int32_t rgb_stride, bool bgr, SIMDLevel level) {
+  const Coefficients &c =
+      image.range == ColorRange::FULL ? FULL_RANGE : LIMITED_RANGE;
+  level = std::min(level, best_simd_level());
+  for (int32_t row = 0; row < image.height; ++row) {
+    const uint8_t *y = image.y + (int64_t)row * image.y_stride;
+    const uint8_t *u = image.u + (int64_t)(row / 2) * image.uv_stride;
+    const uint8_t *v = image.v + (int64_t)(row / 2) * image.uv_stride;
+    uint8_t *out = rgb + (int64_t)row * rgb_stride;
+    switch (level) {
+#ifdef HWANG_X86
+      case SIMDLevel::AVX512:
+        convert_row_avx512(y, u, v, image.uv_step, out, image.width, c, bgr);
+        break;
+      case SIMDLevel::AVX2:
+        convert_row_avx2(y, u, v, image.uv_step, out, image.width, c, bgr);
+        break;
+      case SIMDLevel::SSE41:
+        convert_row_sse41(y, u, v, image.uv_step, out, image.width, c, bgr);
+        break;
+#endif
+      default:
+        convert_row_scalar(y, u, v, image.uv_step, out, 0, image.width, c,
+                           bgr);
+        break;
+    }
+  }
+}
+
+void yuv420_to_rgb24(const YUV420Image &image, uint8_t *rgb,
+                     int32_t rgb_stride, bool bgr, ThreadPool &pool,
+                     int32_t max_threads) {
+  // Slices start on even rows so they do not share chroma rows. Small slices
+  // are not worth the synchronization.
+  const int32_t MIN_SLICE_ROWS = 64;
+  int32_t max_slices = std::max(image.height / MIN_SLICE_ROWS, 1);
+  int32_t threads = pool.num_workers() + 1;
+  if (max_threads > 0) {
+    threads = std::min(threads, max_threads);
+  }
+  int32_t num_slices = std::min(threads, max_slices);
+  int32_t slice_rows = (image.height + num_slices - 1) / num_slices;
+  slice_rows += slice_rows % 2;
+  num_slices = (image.height + slice_rows - 1) / slice_rows;
+
+  pool.parallel_for(num_slices, [&](int64_t slice) {
+    int32_t first_row = slice * slice_rows;
+    YUV420Image part = image;
+    part.y += (int64_t)first_row * image.y_stride;
+    part.u += (int64_t)(first_row / 2) * image.uv_stride;
+    part.v += (int64_t)(first_row / 2) * image.uv_stride;
+    part.height = std::min(slice_rows, image.height - first_row);
+    yuv420_to_rgb24(part, rgb + (int64_t)first_row * rgb_stride, rgb_stride,
+                    bgr);
+  });
+}
+
+namespace {
+
+template <int32_t N>
+void rotate_elements(const uint8_t *src, int32_t src_stride, int32_t width,
+                     int32_t height, int32_t rotation, uint8_t *dst,
+                     int32_t dst_stride) {
+  // Destination position of source element (x, y) is
+  // dst + x * x_step + y * y_step. Walking the source in tiles keeps both
+  // the rows read and the columns written in cache.
+  int64_t x_step, y_step;
+  uint8_t *origin;
+  if (rotation == 90) {
+    x_step = dst_stride;
+    y_step = -N;
+    origin = dst + (int64_t)(height - 1) * N;
+  } else if (rotation == 180) {
+    x_step = -N;
+    y_step = -(int64_t)dst_stride;
+    origin =
+        dst + (int64_t)(height - 1) * dst_stride + (int64_t)(width - 1) * N;
+  } else {
+    x_step = -(int64_t)dst_stride;
+    y_step = N;
+    origin = dst + (int64_t)(width - 1) * dst_stride;
+  }
+  const int32_t TILE = 32;
+  for (int32_t ty = 0; ty < height; ty += TILE) {
+    int32_t y_end = std::min(ty + TILE, height);
+    for (int32_t tx = 0; tx < width; tx += TILE) {
+      int32_t x_end = std::min(tx + TILE, width);
+      for (int32_t y = ty; y < y_end; ++y) {
+        const uint8_t *s = src + (int64_t)y * src_stride + (int64_t)tx * N;
+        uint8_t *d = origin + y * y_step + tx * x_step;
+        for (int32_t x = tx; x < x_end; ++x) {
+          memcpy(d, s, N);
+          s += N;
+          d += x_step;
+        }
+      }
+    }
+  }
+}
+
+}
+
+void rotate_plane(const uint8_t *src, int32_t src_stride, int32_t width,
+                  int32_t height, int32_t element_size, int32_t rotation,
+                  uint8_t *dst, int32_t dst_stride) {
+  switch (element_size) {
+    case 1:
+      rotate_elements<1>(src, src_stride, width, height, rotation, dst,
+                         dst_stride);
+      break;
+    case 2:
+      rotate_elements<2>(src, src_stride, width, height, rotation, dst,
+                         dst_stride);
+      break;
+    case 3:
+      rotate_elements<3>(src, src_stride, width, height, rotation, dst,
+                         dst_stride);
+      break;
+    case 4:
+      rotate_elements<4>(src, src_stride, width, height, rotation, dst,
+                         dst_stride);
+      break;
+  }
+}
+
+ThreadPool &color_conversion_pool() {
+  static ThreadPool pool(
+      std::max((int32_t)std::thread::hardware_concurrency() - 1, 0));
+  return pool;
+}
+
+}
@@ -0,0 +1,81 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "hwang/util/thread_pool.h"
+
+#include <cstdint>
+
+namespace hwang {
+
+// Instruction sets the color conversion kernels are written for
+enum class SIMDLevel {
+  SCALAR = 0,
+  SSE41 = 1,
+  AVX2 = 2,
+  AVX512 = 3,
+};
+
+// Highest level supported by the CPU we are running on
+SIMDLevel best_simd_level();
+
+enum class ColorRange {
+  // Y in [16, 235], as produced by most encoders
+  LIMITED = 0,
+  // Y in [0, 255], as in yuvj420p
+  FULL = 1,
+};
+
+// A 4:2:0 image with separate U and V planes (uv_step = 1) or with a single
+// interleaved UV plane as in NV12 (u points to it, v = u + 1, uv_step = 2)
+struct YUV420Image {
+  const uint8_t *y;
+  const uint8_t *u;
+  const uint8_t *v;
+  int32_t y_stride;
+  int32_t uv_stride;
+  int32_t uv_step;
+  int32_t width;
+  int32_t height;
+  ColorRange range;
+};
+
+// Converts image to packed RGB24, or BGR24 if bgr is set, using BT.601
+// coefficients. Each chroma sample is used for its 2x2 block of pixels
+// without interpolation, like sws_scale does for YUV420P images of even
+// height, and the result is within 3 of sws_scale's. All levels produce
+// identical output; level is lowered to best_simd_level() if the CPU does not
+// support it.
+void yuv420_to_rgb24(const YUV420Image &image, uint8_t *rgb,
+                     int32_t rgb_stride, bool bgr = false,
+                     SIMDLevel level = best_simd_level());
+
+// Same as above but converts horizontal slices of the image on pool, using at
+// most max_threads threads including the calling one, or every worker if 0
+void yuv420_to_rgb24(const YUV420Image &image, uint8_t *rgb,
+                     int32_t rgb_stride, bool bgr, ThreadPool &pool,
+                     int32_t max_threads = 0);
+
+// Rotates a plane of width x height elements, each element_size bytes,
+// clockwise by rotation degrees (90, 180 or 270) into dst, which holds
+// height x width elements for 90 and 270
+void rotate_plane(const uint8_t *src, int32_t src_stride, int32_t width,
+                  int32_t height, int32_t element_size, int32_t rotation,
+                  uint8_t *dst, int32_t dst_stride);
+
+// Shared pool for color conversion with a worker per core besides the
+// calling thread
+ThreadPool &color_conversion_pool();
+
+}
@@ -17,6 +17,10 @@
 
 #include "hwang/util/bits.h"
 
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 #include <map>
 
@@ -384,4 +388,137 @@ inline bool is_new_access_unit(std::map<uint32_t, SPS>& sps_map,
   }
   return false;
 }
+
+// Parameter sets and NAL unit length prefix size from an 'avcC'
+// AVCDecoderConfigurationRecord (the extradata of mp4 encapsulated h264)
+struct AVCConfig {
+  int32_t nal_length_size;
+  std::map<uint32_t, SPS> sps_map;
+  std::map<uint32_t, PPS> pps_map;
+};
+
+// Copies the payload of a NAL unit (excluding the one byte NAL header) with
+// emulation prevention bytes removed. At most max_size bytes of the payload
+// are copied. The result is padded with ones so that exp-golomb parsing of a
+// truncated buffer terminates.
+inline std::vector<uint8_t> nal_to_rbsp(const uint8_t* nal, int32_t nal_size,
+                                        int32_t max_size) {
+  std::vector<uint8_t> rbsp;
+  rbsp.reserve(std::min(nal_size, max_size) + 8);
+  int32_t zeros = 0;
+  for (int32_t i = 1; i < nal_size && (int32_t)rbsp.size() < max_size; ++i) {
+    if (zeros >= 2 && nal[i] == 0x03) {
+      zeros = 0;
+      continue;
+    }
+    zeros = (nal[i] == 0x00) ? zeros + 1 : 0;
+    rbsp.push_back(nal[i]);
+  }
+  rbsp.insert(rbsp.end(), 8, 0xFF);
+  return rbsp;
+}
+
+inline bool parse_avcc(const uint8_t* data, size_t size, AVCConfig& config) {
+  if (size < 7 || data[0] != 1) {
+    return false;
+  }
+  config.nal_length_size = (data[4] & 0x3) + 1;
+  config.sps_map.clear();
+  config.pps_map.clear();
+
+  size_t offset = 5;
+  for (int32_t type = 7; type <= 8; ++type) {
+    if (offset >= size) {
+      return false;
+    }
+    int32_t num_sets = (type == 7) ? (data[offset] & 0x1F) : data[offset];
+    offset += 1;
+    for (int32_t i = 0; i < num_sets; ++i) {
+      if (offset + 2 > size) {
+        return false;
+      }
+      int32_t nal_size = (data[offset] << 8) | data[offset + 1];
+      offset += 2;
+      if (nal_size < 1 || offset + nal_size > size ||
+          get_nal_unit_type(data + offset) != type) {
+        return false;
+      }
+      std::vector<uint8_t> rbsp =
+          nal_to_rbsp(data + offset, nal_size, nal_size);
+      GetBitsState gb;
+      gb.buffer = rbsp.data();
+      gb.offset = 0;
+      gb.size = rbsp.size();
+      if (type == 7) {
+        SPS sps = {};
+        if (!parse_sps(gb, sps)) {
+          return false;
+        }
+        config.sps_map[sps.sps_id] = sps;
+      } else {
+        PPS pps = {};
+        if (!parse_pps(gb, pps)) {
+          return false;
+        }
+        config.pps_map[pps.pps_id] = pps;
+      }
+      offset += nal_size;
+    }
+  }
+  return !config.sps_map.empty() && !config.pps_map.empty();
+}
+
+// Parses the slice header of the first VCL NAL unit in a length prefixed
+// (mp4) sample. The sample may be truncated anywhere after the start of that
+// NAL unit.
+inline bool parse_avcc_sample_slice_header(const uint8_t* sample, size_t size,
+                                           AVCConfig& config,
+                                           SliceHeader& header) {
+  // The slice header fields we parse fit well within this many bytes
+  const int32_t MAX_SLICE_HEADER_SIZE = 64;
+
+  size_t offset = 0;
+  while (offset + config.nal_length_size < size) {
+    uint64_t nal_size = 0;
+    for (int32_t i = 0; i < config.nal_length_size; ++i) {
+      nal_size = (nal_size << 8) | sample[offset + i];
+    }
+    offset += config.nal_length_size;
+    if (nal_size < 1 || offset >= size) {
+      return false;
+    }
+    const uint8_t* nal = sample + offset;
+    int32_t nal_unit_type = get_nal_unit_type(nal);
+    if (is_vcl_nal(nal_unit_type)) {
+      std::vector<uint8_t> rbsp = nal_to_rbsp(
+          nal, std::min(nal_size, (uint64_t)(size - offset)),
+          MAX_SLICE_HEADER_SIZE);
+      GetBitsState gb;
+      gb.buffer = rbsp.data();
+      gb.offset = 0;
+      gb.size = rbsp.size();
+      // Look up the parameter sets before parsing the full header since
+      // parse_slice_header expects them to exist
+      GetBitsState peek = gb;
+      get_ue_golomb(peek);  // first_mb_in_slice
+      get_ue_golomb(peek);  // slice_type
+      uint32_t pps_id = get_ue_golomb(peek);
+      auto pps_it = config.pps_map.find(pps_id);
+      if (pps_it == config.pps_map.end()) {
+        return false;
+      }
+      auto sps_it = config.sps_map.find(pps_it->second.sps_id);
+      if (sps_it == config.sps_map.end()) {
+        return false;
+      }
+      return parse_slice_header(gb, sps_it->second, config.pps_map,
+                                nal_unit_type, get_nal_ref_idc(nal), header);
+    }
+    if (offset + nal_size > size) {
+      return false;
+    }
+    offset += nal_size;
+  }
+  return false;
+}
 }
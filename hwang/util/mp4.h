@@ -15,6 +15,7 @@
 
 #include "hwang/util/bits.h"
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <cassert>
@@ -406,6 +407,74 @@ inline VisualSampleEntry parse_visual_sample_entry(GetBitsState& bs) {
   return entry;
 }
 
+struct TimeToSampleBox : public FullBox {
+  struct Entry {
+    uint32_t sample_count;
+    uint32_t sample_delta;
+  };
+  std::vector<Entry> entries;
+};
+
+// Bytes between the reader and the end of the box that starts at box_start,
+// or the end of the buffer if the box runs past it
+inline uint64_t bytes_left_in_box(const GetBitsState& bs, int64_t box_start,
+                                  uint64_t box_size) {
+  uint64_t box_end = std::min<uint64_t>(box_start + box_size, bs.size);
+  uint64_t offset = bs.offset / 8;
+  return box_end > offset ? box_end - offset : 0;
+}
+
+// Returns false if the box is too short for its entry count
+inline bool parse_stts(GetBitsState& bs, TimeToSampleBox& ts) {
+  int64_t box_start = bs.offset / 8;
+  *((FullBox*)&ts) = parse_full_box(bs);
+  assert(ts.type == string_to_type("stts"));
+
+  uint32_t entry_count = get_bits(bs, 32);
+  if (entry_count > bytes_left_in_box(bs, box_start, ts.size) / 8) {
+    return false;
+  }
+  ts.entries.reserve(entry_count);
+  for (uint32_t i = 0; i < entry_count; ++i) {
+    TimeToSampleBox::Entry entry;
+    entry.sample_count = get_bits(bs, 32);
+    entry.sample_delta = get_bits(bs, 32);
+    ts.entries.push_back(entry);
+  }
+
+  return true;
+}
+
+struct CompositionOffsetBox : public FullBox {
+  struct Entry {
+    uint32_t sample_count;
+    int32_t sample_offset;
+  };
+  std::vector<Entry> entries;
+};
+
+// Returns false if the box is too short for its entry count
+inline bool parse_ctts(GetBitsState& bs, CompositionOffsetBox& co) {
+  int64_t box_start = bs.offset / 8;
+  *((FullBox*)&co) = parse_full_box(bs);
+  assert(co.type == string_to_type("ctts"));
+
+  uint32_t entry_count = get_bits(bs, 32);
+  if (entry_count > bytes_left_in_box(bs, box_start, co.size) / 8) {
+    return false;
+  }
+  co.entries.reserve(entry_count);
+  for (uint32_t i = 0; i < entry_count; ++i) {
+    CompositionOffsetBox::Entry entry;
+    entry.sample_count = get_bits(bs, 32);
+    // Unsigned in version 0 but offsets that large do not occur in practice
+    entry.sample_offset = (int32_t)get_bits(bs, 32);
+    co.entries.push_back(entry);
+  }
+
+  return true;
+}
+
 struct SampleSizeBox : public FullBox {
   uint32_t sample_size;
   uint32_t sample_count;
@@ -449,6 +518,50 @@ inline SampleSizeBox parse_stz2(GetBitsState& bs) {
   return sb;
 }
 
+// Appends the size of every sample in a 'stsz' or 'stz2' box to sizes
+// without building SampleSizeBox::entry_size. Returns false without appending
+// anything if the box is too short for its sample count, or its samples
+// would not fit in media_size bytes.
+inline bool append_sample_sizes(GetBitsState& bs, uint64_t media_size,
+                                std::vector<uint64_t>& sizes) {
+  int64_t box_start = bs.offset / 8;
+  FullBox b = parse_full_box(bs);
+  assert(b.type == string_to_type("stsz") || b.type == string_to_type("stz2"));
+
+  uint32_t sample_size = 0;
+  int field_size = 32;
+  if (b.type == string_to_type("stsz")) {
+    sample_size = get_bits(bs, 32);
+  } else {
+    get_bits(bs, 24); // reserved
+    field_size = get_bits(bs, 8);
+    if (field_size != 4 && field_size != 8 && field_size != 16) {
+      return false;
+    }
+  }
+  uint32_t sample_count = get_bits(bs, 32);
+
+  // Checked before reserving so a corrupt count can not allocate gigabytes
+  uint64_t remaining = bytes_left_in_box(bs, box_start, b.size);
+  if (sample_size != 0) {
+    if (sample_count > media_size / sample_size) {
+      return false;
+    }
+  } else if (sample_count > remaining * 8 / field_size) {
+    return false;
+  }
+
+  sizes.reserve(sizes.size() + sample_count);
+  if (sample_size != 0) {
+    sizes.resize(sizes.size() + sample_count, sample_size);
+  } else {
+    for (uint32_t i = 0; i < sample_count; ++i) {
+      sizes.push_back(get_bits(bs, field_size));
+    }
+  }
+  return true;
+}
+
 struct SampleToChunkBox : public FullBox {
   struct ChunkEntry {
     uint32_t num_samples;
@@ -538,18 +651,53 @@ struct SyncSampleBox : public FullBox {
   std::vector<uint32_t> sample_number;
 };
 
-inline SyncSampleBox parse_stss(GetBitsState& bs) {
-  SyncSampleBox ss;
+// Returns false if the box is too short for its entry count
+inline bool parse_stss(GetBitsState& bs, SyncSampleBox& ss) {
+  int64_t box_start = bs.offset / 8;
   *((FullBox*)&ss) = parse_full_box(bs);
   assert(ss.type == string_to_type("stss"));
 
   uint32_t entry_count = get_bits(bs, 32);
-
-  for (int i = 0; i < entry_count; ++i) {
+  if (entry_count > bytes_left_in_box(bs, box_start, ss.size) / 4) {
+    return false;
+  }
+  ss.sample_number.reserve(entry_count);
+  for (uint32_t i = 0; i < entry_count; ++i) {
     ss.sample_number.push_back(get_bits(bs, 32));
   }
 
-  return ss;
+  return true;
+}
+
+struct SampleDependencyTypeBox : public FullBox {
+  struct Sample {
+    uint8_t is_leading;
+    uint8_t sample_depends_on;
+    uint8_t sample_is_depended_on;
+    uint8_t sample_has_redundancy;
+  };
+  std::vector<Sample> samples;
+};
+
+inline SampleDependencyTypeBox parse_sdtp(GetBitsState& bs) {
+  SampleDependencyTypeBox sd;
+  int64_t start_offset = bs.offset / 8;
+  *((FullBox*)&sd) = parse_full_box(bs);
+  assert(sd.type == string_to_type("sdtp"));
+
+  // Sample count is implied by the box size
+  uint64_t sample_count = bytes_left_in_box(bs, start_offset, sd.size);
+  sd.samples.reserve(sample_count);
+  for (uint64_t i = 0; i < sample_count; ++i) {
+    SampleDependencyTypeBox::Sample sample;
+    sample.is_leading = get_bits(bs, 2);
+    sample.sample_depends_on = get_bits(bs, 2);
+    sample.sample_is_depended_on = get_bits(bs, 2);
+    sample.sample_has_redundancy = get_bits(bs, 2);
+    sd.samples.push_back(sample);
+  }
+
+  return sd;
 }
 
 inline FullBox parse_moof(GetBitsState& bs) {
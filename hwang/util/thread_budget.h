@@ -0,0 +1,92 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace hwang {
+
+// Number of decoder threads shared by all decoders in the process, so that
+// many decoders running at once do not oversubscribe the machine. Decoders
+// register for their lifetime and take threads whenever they open a codec.
+class ThreadBudget {
+ public:
+  // The budget shared by all decoders, one thread per core by default
+  static ThreadBudget &global();
+
+  explicit ThreadBudget(int32_t total) : total_(std::max(total, 1)) {}
+
+  void set_total(int32_t total) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    total_ = std::max(total, 1);
+  }
+
+  int32_t total() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return total_;
+  }
+
+  // Threads currently held by decoders
+  int32_t in_use() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return in_use_;
+  }
+
+  void register_decoder() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    decoders_++;
+  }
+
+  void unregister_decoder() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    decoders_--;
+  }
+
+  // Takes requested threads, or an equal share of the budget between the
+  // registered decoders if requested is 0. Explicit requests are always
+  // granted in full and shares are limited to what is left, but every
+  // decoder gets at least one thread. Returns the number taken, which must be
+  // given back with release.
+  int32_t acquire(int32_t requested) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    int32_t granted = requested;
+    if (granted <= 0) {
+      int32_t share = total_ / std::max(decoders_, 1);
+      granted = std::max(std::min(share, total_ - in_use_), 1);
+    }
+    in_use_ += granted;
+    return granted;
+  }
+
+  void release(int32_t threads) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    in_use_ -= threads;
+  }
+
+ private:
+  std::mutex mutex_;
+  int32_t total_;
+  int32_t in_use_ = 0;
+  int32_t decoders_ = 0;
+};
+
+inline ThreadBudget &ThreadBudget::global() {
+  static ThreadBudget budget(std::thread::hardware_concurrency());
+  return budget;
+}
+
+}
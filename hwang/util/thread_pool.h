@@ -0,0 +1,142 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hwang {
+
+// Fixed set of worker threads that split loops between them. The thread
+// calling parallel_for works on the loop too, so a pool without workers runs
+// loops inline. Several threads may call parallel_for at the same time.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int32_t num_workers);
+
+  ~ThreadPool();
+
+  int32_t num_workers() const { return workers_.size(); }
+
+  // Calls fn(i) for every i in [0, n) and returns once all calls finished
+  void parallel_for(int64_t n, const std::function<void(int64_t)> &fn);
+
+ private:
+  struct Job {
+    const std::function<void(int64_t)> *fn;
+    int64_t n;
+    std::atomic<int64_t> next{0};
+    std::atomic<int64_t> completed{0};
+  };
+
+  void run(Job &job);
+
+  void worker();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  // Jobs that may still have iterations left to claim
+  std::deque<std::shared_ptr<Job>> jobs_;
+  bool stopping_ = false;
+};
+
+inline ThreadPool::ThreadPool(int32_t num_workers) {
+  for (int32_t i = 0; i < num_workers; ++i) {
+    workers_.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    stopping_ = true;
+  }
+  work_available_.notify_all();
+  for (std::thread &t : workers_) {
+    t.join();
+  }
+}
+
+inline void ThreadPool::parallel_for(int64_t n,
+                                     const std::function<void(int64_t)> &fn) {
+  if (n <= 0) {
+    return;
+  }
+  if (workers_.empty() || n == 1) {
+    for (int64_t i = 0; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  auto job = std::make_shared<Job>();
+  job->fn = &fn;
+  job->n = n;
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    jobs_.push_back(job);
+  }
+  work_available_.notify_all();
+
+  run(*job);
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto it = std::find(jobs_.begin(), jobs_.end(), job);
+  if (it != jobs_.end()) {
+    jobs_.erase(it);
+  }
+  work_done_.wait(lk, [&] { return job->completed == job->n; });
+}
+
+inline void ThreadPool::run(Job &job) {
+  int64_t i;
+  while ((i = job.next++) < job.n) {
+    (*job.fn)(i);
+    if (++job.completed == job.n) {
+      // Taking the lock orders this notification after the caller has
+      // checked its predicate so the wakeup can not be lost
+      { std::unique_lock<std::mutex> lk(mutex_); }
+      work_done_.notify_all();
+    }
+  }
+}
+
+inline void ThreadPool::worker() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (true) {
+    work_available_.wait(lk, [this] { return stopping_ || !jobs_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    std::shared_ptr<Job> job = jobs_.front();
+    lk.unlock();
+    run(*job);
+    lk.lock();
+    // All iterations have been claimed so stop offering the job
+    if (!jobs_.empty() && jobs_.front() == job) {
+      jobs_.pop_front();
+    }
+  }
+}
+
+}
@@ -0,0 +1,69 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace hwang {
+
+// Little-endian base 128 varints, as used by protobuf
+
+inline void put_varint(std::vector<uint8_t> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+// Advances p past the varint. Returns false if the data ends inside it or it
+// is longer than 10 bytes.
+inline bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+  if (p < end && *p < 0x80) {
+    v = *p++;
+    return true;
+  }
+  v = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = *p++;
+    v |= (uint64_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Number of varints in the data, counting a truncated one at the end
+inline size_t count_varints(const uint8_t *p, const uint8_t *end) {
+  size_t count = 0;
+  for (; p < end; ++p) {
+    count += *p < 0x80;
+  }
+  return count;
+}
+
+// Maps signed values to unsigned ones so that small magnitudes stay small:
+// 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+inline uint64_t zigzag_encode(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+}
@@ -87,8 +87,8 @@ VideoDecoderInterface *VideoDecoderFactory::make_from_config(
       break;
     }
     case VideoDecoderType::SOFTWARE: {
-      decoder = new SoftwareVideoDecoder(device_handle.id, device_handle.type,
-                                         num_devices);
+      // Threads come from the process-wide ThreadBudget
+      decoder = new SoftwareVideoDecoder(device_handle.id, device_handle.type);
       break;
     }
     default: {}
@@ -20,9 +20,159 @@
 #include <vector>
 #include <cstdint>
 #include <cstddef>
+#include <functional>
 
 namespace hwang {
 
+// Layout of the frames returned by a decoder. Planes are stored back to back
+// without padding.
+enum class PixelFormat {
+  // Packed 8-bit RGB
+  RGB24 = 0,
+  // I420: Y plane followed by quarter size U and V planes
+  YUV420P = 1,
+  // Y plane followed by a quarter size plane of interleaved U and V
+  NV12 = 2,
+  // Y plane only
+  GRAY8 = 3,
+  // Packed 8-bit BGR, as OpenCV expects
+  BGR24 = 4,
+};
+
+// Bytes needed to hold one frame
+inline size_t frame_buffer_size(PixelFormat format, uint32_t width,
+                                uint32_t height) {
+  size_t luma = (size_t)width * height;
+  size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+  switch (format) {
+    case PixelFormat::RGB24:
+    case PixelFormat::BGR24:
+      return luma * 3;
+    case PixelFormat::YUV420P:
+    case PixelFormat::NV12:
+      return luma + chroma * 2;
+    case PixelFormat::GRAY8:
+      return luma;
+  }
+  return 0;
+}
+
+// Trades decoded picture accuracy for decode speed
+enum class DecodeQuality {
+  // Bit-exact output
+  EXACT = 0,
+  // Skips the deblocking filter on frames no other frame references, so
+  // errors do not propagate
+  FAST = 1,
+  // For thumbnails and coarse analysis: skips deblocking on all frames and
+  // the inverse transform of non-reference frames. Frames keep their full
+  // resolution.
+  PREVIEW = 2,
+};
+
+// How a software decoder splits work between its threads
+enum class ThreadingMode {
+  // Slice threading for short intervals and frame threading for long ones
+  AUTO = 0,
+  // Decodes several frames at once. Highest throughput, but each frame is
+  // delayed by one frame per thread, which dominates short intervals.
+  FRAME = 1,
+  // Splits each frame between threads. No added delay, but only helps
+  // streams encoded with several slices per frame.
+  SLICE = 2,
+};
+
+struct ThreadingPolicy {
+  ThreadingMode mode = ThreadingMode::AUTO;
+  // Decoder threads, or 0 for a share of the process-wide ThreadBudget
+  int32_t thread_count = 0;
+
+  bool operator==(const ThreadingPolicy &other) const {
+    return mode == other.mode && thread_count == other.thread_count;
+  }
+  bool operator!=(const ThreadingPolicy &other) const {
+    return !(*this == other);
+  }
+};
+
+// Filter used when a frame is resized
+enum class Interpolation {
+  NEAREST = 0,
+  BILINEAR = 1,
+  BICUBIC = 2,
+  // Averages all covered source pixels, best for large reductions
+  AREA = 3,
+};
+
+// Crop, resize and clockwise rotation applied to decoded frames, in that
+// order. The default geometry returns frames as decoded.
+struct FrameGeometry {
+  // Region of the decoded frame to keep, the whole frame if the size is 0
+  uint32_t crop_x = 0;
+  uint32_t crop_y = 0;
+  uint32_t crop_width = 0;
+  uint32_t crop_height = 0;
+  // Size of the returned frames after rotation, the crop size (rotated) if 0
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // Degrees clockwise: 0, 90, 180 or 270
+  int32_t rotation = 0;
+  Interpolation interpolation = Interpolation::BILINEAR;
+
+  bool operator==(const FrameGeometry &other) const {
+    return crop_x == other.crop_x && crop_y == other.crop_y &&
+           crop_width == other.crop_width &&
+           crop_height == other.crop_height && width == other.width &&
+           height == other.height && rotation == other.rotation &&
+           interpolation == other.interpolation;
+  }
+  bool operator!=(const FrameGeometry &other) const {
+    return !(*this == other);
+  }
+
+  bool transposed() const { return rotation == 90 || rotation == 270; }
+
+  // Size of the image between resizing and rotation
+  uint32_t scaled_width() const { return transposed() ? height : width; }
+  uint32_t scaled_height() const { return transposed() ? width : height; }
+};
+
+// Fills in the defaults of geometry for frames of frame_width x frame_height
+// and checks that the crop lies within the frame
+inline Result resolve_geometry(const FrameGeometry &geometry,
+                               uint32_t frame_width, uint32_t frame_height,
+                               FrameGeometry &resolved) {
+  resolved = geometry;
+  if (resolved.crop_width == 0 || resolved.crop_height == 0) {
+    resolved.crop_x = 0;
+    resolved.crop_y = 0;
+    resolved.crop_width = frame_width;
+    resolved.crop_height = frame_height;
+  }
+  if ((uint64_t)resolved.crop_x + resolved.crop_width > frame_width ||
+      (uint64_t)resolved.crop_y + resolved.crop_height > frame_height) {
+    return Result(false, "Crop rectangle " + std::to_string(geometry.crop_x) +
+                             "," + std::to_string(geometry.crop_y) + " " +
+                             std::to_string(geometry.crop_width) + "x" +
+                             std::to_string(geometry.crop_height) +
+                             " is outside of the " +
+                             std::to_string(frame_width) + "x" +
+                             std::to_string(frame_height) + " frame");
+  }
+  if (resolved.rotation != 0 && resolved.rotation != 90 &&
+      resolved.rotation != 180 && resolved.rotation != 270) {
+    return Result(false, "Rotation must be 0, 90, 180 or 270 degrees, not " +
+                             std::to_string(geometry.rotation));
+  }
+  if (resolved.width == 0 || resolved.height == 0) {
+    resolved.width =
+        resolved.transposed() ? resolved.crop_height : resolved.crop_width;
+    resolved.height =
+        resolved.transposed() ? resolved.crop_width : resolved.crop_height;
+  }
+  return Result();
+}
+
 class VideoDecoderInterface {
  public:
   virtual ~VideoDecoderInterface(){};
@@ -31,6 +181,14 @@ class VideoDecoderInterface {
     uint32_t width;
     uint32_t height;
     std::string format;
+    PixelFormat output_format = PixelFormat::RGB24;
+    // Applied to every frame before it is returned by get_frame
+    FrameGeometry geometry;
+    DecodeQuality quality = DecodeQuality::EXACT;
+    // The mode is FRAME or SLICE, DecoderAutomata resolves AUTO
+    ThreadingPolicy threading;
+    // Back large decoded pictures with transparent huge pages
+    bool huge_pages = false;
   };
   virtual Result configure(const FrameInfo &metadata,
                            const std::vector<uint8_t> &extradata) = 0;
@@ -40,12 +198,33 @@ class VideoDecoderInterface {
 
   virtual Result flush() = 0;
 
+  // Size of the frames returned by get_frame since the last configure, with
+  // the defaults of the geometry filled in
+  virtual void get_output_size(uint32_t &width, uint32_t &height) = 0;
+
   virtual Result discard_frame() = 0;
 
   virtual Result get_frame(uint8_t *decoded_buffer, size_t decoded_size) = 0;
 
   virtual int decoded_frames_buffered() = 0;
 
+  // Blocks until at least num_frames decoded frames are buffered or cancel
+  // returns true. cancel is re-evaluated every time the number of buffered
+  // frames changes and whenever notify_waiters() is called.
+  virtual void wait_until_frames_buffered(
+      int num_frames, const std::function<bool()> &cancel) = 0;
+
+  // Blocks until at most num_frames decoded frames are buffered or cancel
+  // returns true.
+  virtual void wait_until_space_available(
+      int num_frames, const std::function<bool()> &cancel) = 0;
+
+  // Wakes up all threads blocked in wait_until_frames_buffered or
+  // wait_until_space_available so that they re-evaluate their cancel
+  // condition. Must be called after changing any state a cancel condition
+  // depends on.
+  virtual void notify_waiters() = 0;
+
   virtual Result wait_until_frames_copied() = 0;
 
   // void set_profiler(Profiler* profiler);
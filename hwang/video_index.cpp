@@ -13,98 +13,690 @@
 
 #include "hwang/video_index.h"
 #include "hwang/hwang_descriptors.pb.h"
+#include "hwang/util/h264.h"
+#include "hwang/util/varint.h"
+#include "hwang/video_index_view.h"
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <tuple>
 
 namespace hwang {
 
-VideoIndex VideoIndex::deserialize(const std::vector<uint8_t> &data) {
+namespace {
+
+Result decode_sample_table_v2(const proto::VideoIndex &desc,
+                              std::vector<uint64_t> &offsets,
+                              std::vector<uint64_t> &sizes,
+                              std::vector<uint64_t> &keyframes) {
+  const Result corrupt(false, "Corrupt version 2 sample table");
+  const uint8_t *p = (const uint8_t *)desc.sample_sizes_v2().data();
+  const uint8_t *end = p + desc.sample_sizes_v2().size();
+  sizes.resize(count_varints(p, end));
+  for (uint64_t &size : sizes) {
+    if (!get_varint(p, end, size)) {
+      return corrupt;
+    }
+  }
+
+  p = (const uint8_t *)desc.sample_offset_deltas_v2().data();
+  end = p + desc.sample_offset_deltas_v2().size();
+  offsets.resize(sizes.size());
+  uint64_t expected = 0;
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    uint64_t delta;
+    if (!get_varint(p, end, delta)) {
+      return corrupt;
+    }
+    offsets[i] = expected + zigzag_decode(delta);
+    expected = offsets[i] + sizes[i];
+  }
+  if (p != end) {
+    return corrupt;
+  }
+
+  p = (const uint8_t *)desc.keyframe_gaps_v2().data();
+  end = p + desc.keyframe_gaps_v2().size();
+  keyframes.resize(count_varints(p, end));
+  uint64_t keyframe = 0;
+  for (uint64_t &k : keyframes) {
+    uint64_t gap;
+    if (!get_varint(p, end, gap)) {
+      return corrupt;
+    }
+    keyframe += gap;
+    k = keyframe;
+  }
+  return Result();
+}
+
+void encode_sample_table_v2(const VideoIndex &index,
+                            proto::VideoIndex &desc) {
+  std::vector<uint8_t> sizes;
+  std::vector<uint8_t> deltas;
+  sizes.reserve(index.frames() * 2);
+  deltas.reserve(index.frames());
+  uint64_t expected = 0;
+  for (uint64_t i = 0; i < index.frames(); ++i) {
+    uint64_t offset = index.sample_offset(i);
+    put_varint(sizes, index.sample_size(i));
+    put_varint(deltas, zigzag_encode(offset - expected));
+    expected = offset + index.sample_size(i);
+  }
+  std::vector<uint8_t> gaps;
+  uint64_t previous = 0;
+  for (uint64_t k : index.keyframe_indices()) {
+    put_varint(gaps, k - previous);
+    previous = k;
+  }
+  desc.set_sample_sizes_v2(sizes.data(), sizes.size());
+  desc.set_sample_offset_deltas_v2(deltas.data(), deltas.size());
+  desc.set_keyframe_gaps_v2(gaps.data(), gaps.size());
+}
+
+}
+
+const uint32_t VideoIndex::SERIALIZE_VERSION;
+const uint32_t VideoIndex::DEFAULT_SERIALIZE_VERSION;
+
+Result VideoIndex::deserialize(const uint8_t *data, size_t size,
+                               VideoIndex &index) {
   proto::VideoIndex desc;
-  desc.ParseFromArray(data.data(), data.size());
-  return VideoIndex(desc.timescale(), desc.duration(),
-                    desc.frame_width(), desc.frame_height(),
-                    desc.format(),
-                    std::vector<uint64_t>(desc.sample_offsets().begin(),
-                                          desc.sample_offsets().end()),
-                    std::vector<uint64_t>(desc.sample_sizes().begin(),
-                                          desc.sample_sizes().end()),
-                    std::vector<uint64_t>(desc.keyframe_indices().begin(),
-                                          desc.keyframe_indices().end()),
-                    std::vector<uint8_t>(desc.metadata_bytes().begin(),
-                                         desc.metadata_bytes().end()));
-}
-
-std::vector<uint8_t> VideoIndex::serialize() const {
+  if (!desc.ParseFromArray(data, size)) {
+    return Result(false, "Could not parse video index");
+  }
+  if (desc.version() > SERIALIZE_VERSION) {
+    return Result(false, "Video index format version " +
+                             std::to_string(desc.version()) +
+                             " is newer than the supported version " +
+                             std::to_string(SERIALIZE_VERSION));
+  }
+  std::vector<uint64_t> sample_offsets;
+  std::vector<uint64_t> sample_sizes;
+  std::vector<uint64_t> keyframe_indices;
+  if (desc.version() >= 2) {
+    HWANG_RETURN_ON_ERROR(decode_sample_table_v2(desc, sample_offsets,
+                                                 sample_sizes,
+                                                 keyframe_indices));
+  } else {
+    sample_offsets.assign(desc.sample_offsets().begin(),
+                          desc.sample_offsets().end());
+    sample_sizes.assign(desc.sample_sizes().begin(),
+                        desc.sample_sizes().end());
+    keyframe_indices.assign(desc.keyframe_indices().begin(),
+                            desc.keyframe_indices().end());
+  }
+  std::vector<SampleRun> decode_time_runs;
+  for (int i = 0; i < desc.decode_time_run_counts_size() &&
+                  i < desc.decode_time_run_deltas_size();
+       ++i) {
+    decode_time_runs.push_back(
+        {desc.decode_time_run_counts(i), desc.decode_time_run_deltas(i)});
+  }
+  std::vector<SampleRun> composition_offset_runs;
+  for (int i = 0; i < desc.composition_offset_run_counts_size() &&
+                  i < desc.composition_offset_run_values_size();
+       ++i) {
+    composition_offset_runs.push_back({desc.composition_offset_run_counts(i),
+                                       desc.composition_offset_run_values(i)});
+  }
+  index = VideoIndex(desc.timescale(), desc.duration(),
+                     desc.frame_width(), desc.frame_height(),
+                     desc.format(),
+                     std::move(sample_offsets), std::move(sample_sizes),
+                     std::move(keyframe_indices),
+                     std::vector<uint8_t>(desc.metadata_bytes().begin(),
+                                          desc.metadata_bytes().end()),
+                     std::vector<uint8_t>(desc.sample_flags().begin(),
+                                          desc.sample_flags().end()),
+                     std::move(decode_time_runs),
+                     std::move(composition_offset_runs));
+  return Result();
+}
+
+VideoIndex VideoIndex::deserialize(const std::vector<uint8_t> &data) {
+  VideoIndex index;
+  if (!deserialize(data.data(), data.size(), index).ok) {
+    index = VideoIndex(0, 0, 0, 0, "", {}, {}, {}, {});
+  }
+  return index;
+}
+
+std::vector<uint8_t> VideoIndex::serialize(uint32_t version) const {
   proto::VideoIndex desc;
   desc.set_timescale(timescale_);
   desc.set_duration(duration_);
   desc.set_frame_width(frame_width_);
   desc.set_frame_height(frame_height_);
   desc.set_format(format_);
-  for (uint64_t s : sample_offsets_) {
-    desc.add_sample_offsets(s);
+  if (version >= 2) {
+    desc.set_version(2);
+    encode_sample_table_v2(*this, desc);
+  } else {
+    // Leave the version unset so that the output matches older writers
+    desc.mutable_sample_offsets()->Reserve(num_frames_);
+    desc.mutable_sample_sizes()->Reserve(num_frames_);
+    for (uint64_t i = 0; i < num_frames_; ++i) {
+      desc.add_sample_offsets(sample_offset(i));
+      desc.add_sample_sizes(sample_size(i));
+    }
+    for (uint64_t k : keyframe_indices()) {
+      desc.add_keyframe_indices(k);
+    }
   }
-  for (uint64_t s : sample_sizes_) {
-    desc.add_sample_sizes(s);
+  desc.set_metadata_bytes(metadata_bytes_.data(), metadata_bytes_.size());
+  desc.set_sample_flags(sample_flags_.data(), sample_flags_.size());
+  for (const SampleRun &run : decode_time_runs_) {
+    desc.add_decode_time_run_counts(run.count);
+    desc.add_decode_time_run_deltas(run.value);
   }
-  for (uint64_t k : keyframe_indices_) {
-    desc.add_keyframe_indices(k);
+  for (const SampleRun &run : composition_offset_runs_) {
+    desc.add_composition_offset_run_counts(run.count);
+    desc.add_composition_offset_run_values(run.value);
   }
-  desc.set_metadata_bytes(metadata_bytes_.data(), metadata_bytes_.size());
   std::vector<uint8_t> data(desc.ByteSizeLong());
   desc.SerializeToArray(data.data(), data.size());
   return data;
 }
 
+std::vector<uint8_t> VideoIndex::serialize_flat() const {
+  auto align8 = [](uint64_t pos) { return (pos + 7) & ~7ULL; };
+  const std::vector<uint64_t> &keyframes = keyframe_indices();
+  FlatIndexHeader header = {};
+  header.magic = little_endian_64(FLAT_INDEX_MAGIC);
+  header.version = little_endian_32(FLAT_INDEX_VERSION);
+  header.header_size = little_endian_32(sizeof(FlatIndexHeader));
+  header.timescale = little_endian_32(timescale_);
+  header.frame_width = little_endian_32(frame_width_);
+  header.frame_height = little_endian_32(frame_height_);
+  memcpy(header.format, format_.data(),
+         std::min(format_.size(), sizeof(header.format)));
+  header.duration = little_endian_64(duration_);
+  header.num_frames = little_endian_64(num_frames_);
+  header.num_keyframes = little_endian_64(keyframes.size());
+  uint64_t num_sample_flags =
+      sample_flags_.size() == num_frames_ ? num_frames_ : 0;
+  header.num_sample_flags = little_endian_64(num_sample_flags);
+  header.metadata_size = little_endian_64(metadata_bytes_.size());
+
+  uint64_t offsets_pos = sizeof(FlatIndexHeader);
+  uint64_t sizes_pos = offsets_pos + num_frames_ * 8;
+  uint64_t keyframes_pos = sizes_pos + num_frames_ * 8;
+  uint64_t flags_pos = keyframes_pos + keyframes.size() * 8;
+  uint64_t metadata_pos = flags_pos + num_sample_flags;
+  header.sample_offsets_pos = little_endian_64(offsets_pos);
+  header.sample_sizes_pos = little_endian_64(sizes_pos);
+  header.keyframe_indices_pos = little_endian_64(keyframes_pos);
+  header.sample_flags_pos = little_endian_64(flags_pos);
+  header.metadata_pos = little_endian_64(metadata_pos);
+
+  std::vector<uint8_t> data(align8(metadata_pos + metadata_bytes_.size()));
+  memcpy(data.data(), &header, sizeof(header));
+  uint64_t *offsets = (uint64_t *)(data.data() + offsets_pos);
+  uint64_t *sizes = (uint64_t *)(data.data() + sizes_pos);
+  for (uint64_t i = 0; i < num_frames_; ++i) {
+    offsets[i] = little_endian_64(sample_offset(i));
+    sizes[i] = little_endian_64(sample_size(i));
+  }
+  uint64_t *keyframe_out = (uint64_t *)(data.data() + keyframes_pos);
+  for (size_t i = 0; i < keyframes.size(); ++i) {
+    keyframe_out[i] = little_endian_64(keyframes[i]);
+  }
+  memcpy(data.data() + flags_pos, sample_flags_.data(), num_sample_flags);
+  memcpy(data.data() + metadata_pos, metadata_bytes_.data(),
+         metadata_bytes_.size());
+  return data;
+}
+
+bool VideoIndex::compact() {
+  if (compact_ != nullptr) {
+    return true;
+  }
+  if (sample_offsets_.size() != num_frames_) {
+    return false;
+  }
+  auto table = std::make_shared<CompactSampleTable>();
+  uint64_t num_blocks =
+      (num_frames_ + COMPACT_BLOCK_SAMPLES - 1) / COMPACT_BLOCK_SAMPLES;
+  table->block_offsets.reserve(num_blocks);
+  table->offset_deltas.reserve(num_frames_);
+  table->sizes.reserve(num_frames_);
+  for (uint64_t block = 0; block < num_blocks; ++block) {
+    uint64_t start = block * COMPACT_BLOCK_SAMPLES;
+    uint64_t end = std::min(start + COMPACT_BLOCK_SAMPLES, num_frames_);
+    uint64_t base = *std::min_element(sample_offsets_.begin() + start,
+                                      sample_offsets_.begin() + end);
+    table->block_offsets.push_back(base);
+    for (uint64_t i = start; i < end; ++i) {
+      if (sample_offsets_[i] - base > UINT32_MAX ||
+          sample_sizes_[i] > UINT32_MAX) {
+        return false;
+      }
+      table->offset_deltas.push_back(sample_offsets_[i] - base);
+      table->sizes.push_back(sample_sizes_[i]);
+    }
+  }
+  table->keyframe_bits.resize((num_frames_ + 63) / 64);
+  for (size_t i = 0; i < keyframe_indices_.size(); ++i) {
+    uint64_t k = keyframe_indices_[i];
+    // The bitmap can only give keyframes back in order
+    if (k >= num_frames_ || (i > 0 && k <= keyframe_indices_[i - 1])) {
+      return false;
+    }
+    table->keyframe_bits[k / 64] |= 1ULL << (k % 64);
+  }
+
+  compact_ = table;
+  expanded_ = std::make_shared<ExpandedSampleTable>();
+  std::vector<uint64_t>().swap(sample_offsets_);
+  std::vector<uint64_t>().swap(sample_sizes_);
+  std::vector<uint64_t>().swap(keyframe_indices_);
+  return true;
+}
+
+uint64_t VideoIndex::sample_offset(uint64_t sample) const {
+  if (compact_ != nullptr) {
+    return compact_->block_offsets[sample / COMPACT_BLOCK_SAMPLES] +
+           compact_->offset_deltas[sample];
+  }
+  return sample_offsets_[sample];
+}
+
+uint64_t VideoIndex::sample_size(uint64_t sample) const {
+  if (compact_ != nullptr) {
+    return compact_->sizes[sample];
+  }
+  return sample_sizes_[sample];
+}
+
+bool VideoIndex::is_keyframe(uint64_t sample) const {
+  if (compact_ != nullptr) {
+    return (compact_->keyframe_bits[sample / 64] >> (sample % 64)) & 1;
+  }
+  return std::binary_search(keyframe_indices_.begin(), keyframe_indices_.end(),
+                            sample);
+}
+
+uint64_t VideoIndex::keyframe_at_or_before(uint64_t sample) const {
+  if (compact_ != nullptr) {
+    if (num_frames_ == 0) {
+      return 0;
+    }
+    sample = std::min(sample, num_frames_ - 1);
+    const std::vector<uint64_t> &bits = compact_->keyframe_bits;
+    size_t w = sample / 64;
+    // Bits up to and including the sample's
+    uint64_t word = bits[w] & ((2ULL << (sample % 64)) - 1);
+    while (word == 0) {
+      if (w == 0) {
+        uint64_t first = keyframe_at_or_after(0);
+        return first < num_frames_ ? first : 0;
+      }
+      word = bits[--w];
+    }
+    return w * 64 + 63 - __builtin_clzll(word);
+  }
+  if (keyframe_indices_.empty()) {
+    return 0;
+  }
+  auto it = std::upper_bound(keyframe_indices_.begin(),
+                             keyframe_indices_.end(), sample);
+  return it == keyframe_indices_.begin() ? *it : *(it - 1);
+}
+
+uint64_t VideoIndex::keyframe_at_or_after(uint64_t sample) const {
+  if (compact_ != nullptr) {
+    const std::vector<uint64_t> &bits = compact_->keyframe_bits;
+    size_t w = sample / 64;
+    if (w >= bits.size()) {
+      return num_frames_;
+    }
+    uint64_t word = bits[w] & (~0ULL << (sample % 64));
+    while (word == 0) {
+      if (++w == bits.size()) {
+        return num_frames_;
+      }
+      word = bits[w];
+    }
+    return w * 64 + __builtin_ctzll(word);
+  }
+  auto it = std::lower_bound(keyframe_indices_.begin(),
+                             keyframe_indices_.end(), sample);
+  return it == keyframe_indices_.end() ? num_frames_ : *it;
+}
+
+size_t VideoIndex::sample_table_bytes() const {
+  size_t bytes = (sample_offsets_.capacity() + sample_sizes_.capacity() +
+                  keyframe_indices_.capacity()) *
+                 sizeof(uint64_t);
+  if (compact_ != nullptr) {
+    bytes += (compact_->block_offsets.capacity() +
+              compact_->keyframe_bits.capacity()) *
+                 sizeof(uint64_t) +
+             (compact_->offset_deltas.capacity() + compact_->sizes.capacity()) *
+                 sizeof(uint32_t);
+    bytes += (expanded_->offsets.capacity() + expanded_->sizes.capacity() +
+              expanded_->keyframes.capacity()) *
+             sizeof(uint64_t);
+  }
+  return bytes;
+}
+
+const std::vector<uint64_t> &VideoIndex::sample_offsets() const {
+  if (compact_ == nullptr) {
+    return sample_offsets_;
+  }
+  std::call_once(expanded_->offsets_once, [this] {
+    expanded_->offsets.resize(num_frames_);
+    for (uint64_t i = 0; i < num_frames_; ++i) {
+      expanded_->offsets[i] = sample_offset(i);
+    }
+  });
+  return expanded_->offsets;
+}
+
+const std::vector<uint64_t> &VideoIndex::sample_sizes() const {
+  if (compact_ == nullptr) {
+    return sample_sizes_;
+  }
+  std::call_once(expanded_->sizes_once, [this] {
+    expanded_->sizes.assign(compact_->sizes.begin(), compact_->sizes.end());
+  });
+  return expanded_->sizes;
+}
+
+const std::vector<uint64_t> &VideoIndex::keyframe_indices() const {
+  if (compact_ == nullptr) {
+    return keyframe_indices_;
+  }
+  std::call_once(expanded_->keyframes_once, [this] {
+    const std::vector<uint64_t> &bits = compact_->keyframe_bits;
+    for (size_t w = 0; w < bits.size(); ++w) {
+      for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+        expanded_->keyframes.push_back(w * 64 + __builtin_ctzll(word));
+      }
+    }
+  });
+  return expanded_->keyframes;
+}
+
+namespace {
+
+// Index of the run containing the sample or frame
+template <typename Run>
+size_t find_run(const std::vector<Run> &runs, uint64_t index) {
+  auto it = std::upper_bound(
+      runs.begin(), runs.end(), index,
+      [](uint64_t i, const Run &run) { return i < run.first; });
+  return (it == runs.begin()) ? 0 : (it - runs.begin()) - 1;
+}
+
+template <typename Run>
+int64_t lookup_timestamp(const std::vector<Run> &runs, uint64_t index) {
+  if (runs.empty()) {
+    return 0;
+  }
+  const Run &run = runs[find_run(runs, index)];
+  return run.timestamp + run.delta * (int64_t)(index - run.first);
+}
+
+// lookup_timestamp for increasing indices, advancing run instead of searching
+template <typename Run>
+int64_t next_timestamp(const std::vector<Run> &runs, size_t &run,
+                       uint64_t index) {
+  if (runs.empty()) {
+    return 0;
+  }
+  while (run + 1 < runs.size() && runs[run + 1].first <= index) {
+    run++;
+  }
+  return runs[run].timestamp +
+         runs[run].delta * (int64_t)(index - runs[run].first);
+}
+
+}
+
+void VideoIndex::build_timestamp_lookups() {
+  decode_lookup_.clear();
+  composition_lookup_.clear();
+  frame_lookup_.clear();
+  if (num_frames_ == 0) {
+    return;
+  }
+
+  std::vector<SampleRun> decode_runs = decode_time_runs_;
+  if (decode_runs.empty()) {
+    decode_runs.push_back(
+        {num_frames_,
+         (int64_t)(duration_ / std::max<uint64_t>(num_frames_, 1))});
+  }
+  uint64_t sample = 0;
+  int64_t timestamp = 0;
+  for (const SampleRun &run : decode_runs) {
+    if (run.count == 0) {
+      continue;
+    }
+    decode_lookup_.push_back({sample, timestamp, run.value});
+    sample += run.count;
+    timestamp += run.value * (int64_t)run.count;
+  }
+  sample = 0;
+  for (const SampleRun &run : composition_offset_runs_) {
+    if (run.count == 0) {
+      continue;
+    }
+    composition_lookup_.push_back({sample, run.value, 0});
+    sample += run.count;
+  }
+
+  // Frames are shown in order of presentation timestamp
+  std::vector<int64_t> frame_timestamps(num_frames_);
+  size_t decode_run = 0;
+  size_t composition_run = 0;
+  for (uint64_t i = 0; i < num_frames_; ++i) {
+    frame_timestamps[i] = next_timestamp(decode_lookup_, decode_run, i) +
+                          next_timestamp(composition_lookup_, composition_run, i);
+  }
+  if (!std::is_sorted(frame_timestamps.begin(), frame_timestamps.end())) {
+    std::sort(frame_timestamps.begin(), frame_timestamps.end());
+  }
+  for (uint64_t i = 0; i < num_frames_; ++i) {
+    if (!frame_lookup_.empty()) {
+      const TimestampRun &run = frame_lookup_.back();
+      if (run.timestamp + run.delta * (int64_t)(i - run.first) ==
+          frame_timestamps[i]) {
+        continue;
+      }
+    }
+    int64_t delta = (i + 1 < num_frames_)
+                        ? frame_timestamps[i + 1] - frame_timestamps[i]
+                        : 0;
+    frame_lookup_.push_back({i, frame_timestamps[i], delta});
+  }
+}
+
+int64_t VideoIndex::sample_decode_timestamp(uint64_t sample) const {
+  return lookup_timestamp(decode_lookup_, sample);
+}
+
+int64_t VideoIndex::sample_presentation_timestamp(uint64_t sample) const {
+  int64_t offset = 0;
+  if (!composition_lookup_.empty()) {
+    offset = composition_lookup_[find_run(composition_lookup_, sample)]
+                 .timestamp;
+  }
+  return sample_decode_timestamp(sample) + offset;
+}
+
+int64_t VideoIndex::frame_timestamp(uint64_t frame) const {
+  return lookup_timestamp(frame_lookup_, frame);
+}
+
+uint64_t VideoIndex::frame_at_timestamp(int64_t timestamp) const {
+  if (frame_lookup_.empty()) {
+    return 0;
+  }
+  auto it = std::upper_bound(
+      frame_lookup_.begin(), frame_lookup_.end(), timestamp,
+      [](int64_t t, const TimestampRun &run) { return t < run.timestamp; });
+  if (it == frame_lookup_.begin()) {
+    return 0;
+  }
+  --it;
+  uint64_t run_end =
+      (it + 1 == frame_lookup_.end()) ? num_frames_ : (it + 1)->first;
+  uint64_t offset = 0;
+  if (it->delta > 0) {
+    offset = (timestamp - it->timestamp) / it->delta;
+  }
+  return std::min(it->first + offset, run_end - 1);
+}
+
+std::vector<uint64_t> VideoIndex::frames_at_interval(double interval) const {
+  std::vector<uint64_t> frames;
+  if (num_frames_ == 0 || interval <= 0) {
+    return frames;
+  }
+  int64_t start = frame_timestamp(0);
+  int64_t end = frame_timestamp(num_frames_ - 1);
+  for (int64_t i = 0;; ++i) {
+    int64_t t = start + (int64_t)(i * interval * timescale_);
+    if (t > end) {
+      break;
+    }
+    uint64_t frame = frame_at_timestamp(t);
+    if (frames.empty() || frames.back() != frame) {
+      frames.push_back(frame);
+    }
+  }
+  return frames;
+}
+
 VideoIntervals slice_into_video_intervals(const VideoIndex &index,
-                                          const std::vector<uint64_t> &rows) {
-  auto keyframe_positions = index.keyframe_indices();
-  keyframe_positions.push_back(index.frames());
+                                          const std::vector<uint64_t> &rows,
+                                          const IntervalCosts &costs) {
+  const auto &sample_flags = index.sample_flags();
   VideoIntervals info;
-  assert(keyframe_positions.size() >= 2);
-  size_t start_keyframe_index = 0;
-  size_t end_keyframe_index = 1;
-  uint64_t next_keyframe = keyframe_positions[end_keyframe_index];
-  std::vector<uint64_t> valid_frames;
-
-  for (uint64_t row : rows) {
-    if (row >= next_keyframe) {
-      // Check if this keyframe is adjacent
-      uint64_t last_endpoint = index.sample_offsets().at(next_keyframe - 1) +
-                               index.sample_sizes().at(next_keyframe - 1);
-      bool is_adjacent =
-          (last_endpoint == index.sample_offsets().at(next_keyframe));
-
-      assert(end_keyframe_index < keyframe_positions.size() - 1);
-      next_keyframe = keyframe_positions[++end_keyframe_index];
-
-      if (row >= next_keyframe || !is_adjacent) {
-        // Skipped a keyframe or keyframe is not adjacent, make a new interval
-        if (!valid_frames.empty()) {
-          info.sample_index_intervals.push_back(
-              std::make_tuple(keyframe_positions[start_keyframe_index],
-                              keyframe_positions[end_keyframe_index - 1]));
-          info.valid_frames.push_back(valid_frames);
-        }
-
-        while (row >= keyframe_positions[end_keyframe_index]) {
-          end_keyframe_index++;
-          assert(end_keyframe_index < keyframe_positions.size());
-        }
-        valid_frames.clear();
-        start_keyframe_index = end_keyframe_index - 1;
-        next_keyframe = keyframe_positions[end_keyframe_index];
+  if (rows.empty()) {
+    return info;
+  }
+
+  // The decoder skips disposable h264 frames that were not requested, but
+  // only in GOPs that start with an IDR picture and use an output order it
+  // can compute. See DecoderAutomata::plan_gop_drops.
+  bool skips_disposable = false;
+  AVCConfig avc_config;
+  if (costs.skip_non_ref_frames && index.format() == "avc1" &&
+      sample_flags.size() == index.frames() &&
+      parse_avcc(index.metadata_bytes().data(), index.metadata_bytes().size(),
+                 avc_config)) {
+    skips_disposable = true;
+    for (const auto &sps : avc_config.sps_map) {
+      if (sps.second.poc_type != 0 && sps.second.poc_type != 2) {
+        skips_disposable = false;
+      }
+    }
+  }
+  // Number of frames decoded for samples [start, end)
+  auto frames_decoded = [&](uint64_t start, uint64_t end) {
+    uint64_t frames = 0;
+    uint64_t gop_end = start;
+    bool skips = false;
+    for (uint64_t i = start; i < end; ++i) {
+      if (i >= gop_end) {
+        uint64_t keyframe = index.keyframe_at_or_before(i);
+        gop_end = index.keyframe_at_or_after(i + 1);
+        skips = skips_disposable && (sample_flags[keyframe] & SAMPLE_FLAG_IDR);
+      }
+      if (!skips || !(sample_flags[i] & SAMPLE_FLAG_DISPOSABLE) ||
+          std::binary_search(rows.begin(), rows.end(), i)) {
+        frames++;
+      }
+    }
+    return frames;
+  };
+  auto sample_end = [&](uint64_t i) {
+    return index.sample_offset(i) + index.sample_size(i);
+  };
+
+  // Group the rows by the GOP they are in. Keyframes are looked up per GOP
+  // so a compact index does not have to build its keyframe list.
+  struct GOPRows {
+    // Samples [keyframe, end) with end the next keyframe or frames()
+    uint64_t keyframe;
+    uint64_t end;
+    size_t first_row;
+    size_t last_row;
+  };
+  std::vector<GOPRows> gops;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    assert(i == 0 || rows[i - 1] < rows[i]);
+    assert(rows[i] < index.frames());
+    if (gops.empty() || rows[i] >= gops.back().end) {
+      uint64_t keyframe = index.keyframe_at_or_before(rows[i]);
+      uint64_t end =
+          index.keyframe_at_or_after(std::max(keyframe, rows[i]) + 1);
+      gops.push_back({keyframe, end, i, i});
+    } else {
+      gops.back().last_row = i;
+    }
+  }
+
+  // Every requested GOP is decoded from its keyframe to its last requested
+  // row. The choice of whether to continue the current interval into the
+  // next requested GOP only changes the cost of the samples between them,
+  // so deciding each boundary independently gives the cheapest plan.
+  uint64_t frames = 0;
+  double cost = 0;
+  size_t interval_start = 0;
+  uint64_t interval_start_offset = index.sample_offset(gops[0].keyframe);
+  auto end_interval = [&](size_t last) {
+    const GOPRows &first_gop = gops[interval_start];
+    const GOPRows &last_gop = gops[last];
+    info.sample_index_intervals.push_back(
+        std::make_tuple(first_gop.keyframe, last_gop.end));
+    info.valid_frames.emplace_back(rows.begin() + first_gop.first_row,
+                                   rows.begin() + last_gop.last_row + 1);
+    uint64_t end_offset = sample_end(last_gop.end - 1);
+    cost += costs.seek + costs.read_byte * (end_offset - interval_start_offset);
+  };
+  for (size_t i = 0; i < gops.size(); ++i) {
+    uint64_t keyframe = gops[i].keyframe;
+    uint64_t last_row = rows[gops[i].last_row];
+    uint64_t decoded = frames_decoded(keyframe, last_row + 1);
+    frames += decoded;
+    cost += costs.decode_frame * decoded;
+    if (i + 1 == gops.size()) {
+      end_interval(i);
+      break;
+    }
+
+    uint64_t gop_end = gops[i].end;
+    uint64_t next_keyframe = gops[i + 1].keyframe;
+    uint64_t gop_end_offset = sample_end(gop_end - 1);
+    uint64_t next_offset = index.sample_offset(next_keyframe);
+    // Intervals are read as a single byte range so samples must be in order
+    bool can_continue = next_offset >= gop_end_offset;
+    if (can_continue) {
+      uint64_t continue_frames = frames_decoded(last_row + 1, next_keyframe);
+      double continue_cost = costs.decode_frame * continue_frames +
+                             costs.read_byte * (next_offset - gop_end_offset);
+      if (continue_cost <= costs.seek) {
+        // The read cost of the gap is accounted for when the interval ends
+        frames += continue_frames;
+        cost += costs.decode_frame * continue_frames;
+        continue;
       }
     }
-    valid_frames.push_back(row);
+    end_interval(i);
+    interval_start = i + 1;
+    interval_start_offset = next_offset;
   }
-  info.sample_index_intervals.push_back(
-      std::make_tuple(keyframe_positions[start_keyframe_index],
-                      keyframe_positions[end_keyframe_index]));
-  info.valid_frames.push_back(valid_frames);
+  info.estimated_frames_decoded = frames;
+  info.estimated_cost = cost;
   return info;
 }
 
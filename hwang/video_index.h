@@ -13,12 +13,41 @@
 
 #pragma once
 
+#include "hwang/common.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <tuple>
 
 namespace hwang {
 
+// Bits of the per sample flags stored in VideoIndex::sample_flags()
+enum SampleFlags : uint8_t {
+  // The remaining flags were determined for this sample
+  SAMPLE_FLAG_KNOWN = 0x01,
+  // Sample does not depend on any other sample
+  SAMPLE_FLAG_INTRA = 0x02,
+  // Sample contains bidirectionally predicted slices. Only available when the
+  // flags were determined from slice headers.
+  SAMPLE_FLAG_BIDIR = 0x04,
+  // No other sample depends on this sample so it only needs to be decoded
+  // if requested
+  SAMPLE_FLAG_DISPOSABLE = 0x08,
+  // Sample is an H.264 IDR picture. Only available when the flags were
+  // determined from slice headers.
+  SAMPLE_FLAG_IDR = 0x10,
+};
+
+// A run of consecutive samples that share a value, as stored in the 'stts'
+// and 'ctts' boxes
+struct SampleRun {
+  uint64_t count;
+  int64_t value;
+};
+
 class VideoIndex {
  public:
   VideoIndex() {};
@@ -26,32 +55,108 @@ class VideoIndex {
   VideoIndex(uint32_t timescale, uint64_t duration,
              uint32_t width, uint32_t height,
              const std::string& format,
-             const std::vector<uint64_t> &sample_offsets,
-             const std::vector<uint64_t> &sample_sizes,
-             const std::vector<uint64_t> &keyframe_indices,
-             const std::vector<uint8_t> &metadata)
+             std::vector<uint64_t> sample_offsets,
+             std::vector<uint64_t> sample_sizes,
+             std::vector<uint64_t> keyframe_indices,
+             std::vector<uint8_t> metadata,
+             std::vector<uint8_t> sample_flags = {},
+             std::vector<SampleRun> decode_time_runs = {},
+             std::vector<SampleRun> composition_offset_runs = {})
       : timescale_(timescale), duration_(duration), frame_width_(width),
         frame_height_(height), format_(format),
-        num_frames_(sample_sizes.size()), sample_offsets_(sample_offsets),
-        sample_sizes_(sample_sizes), keyframe_indices_(keyframe_indices),
-        metadata_bytes_(metadata){};
-
+        num_frames_(sample_sizes.size()),
+        sample_offsets_(std::move(sample_offsets)),
+        sample_sizes_(std::move(sample_sizes)),
+        keyframe_indices_(std::move(keyframe_indices)),
+        metadata_bytes_(std::move(metadata)),
+        sample_flags_(std::move(sample_flags)),
+        decode_time_runs_(std::move(decode_time_runs)),
+        composition_offset_runs_(std::move(composition_offset_runs)) {
+    for (uint8_t flags : sample_flags_) {
+      if (flags & SAMPLE_FLAG_DISPOSABLE) {
+        num_non_ref_frames_++;
+      }
+    }
+    build_timestamp_lookups();
+  };
+
+  // Reads every format version up to SERIALIZE_VERSION. The vector overload
+  // returns an empty index for data it can not read.
+  static Result deserialize(const uint8_t *data, size_t size,
+                            VideoIndex &index);
   static VideoIndex deserialize(const std::vector<uint8_t> &data);
 
-  std::vector<uint8_t> serialize() const;
+  // Version 2 delta encodes the sample table, which then takes less than half
+  // the space. Readers before version 2 parse it as an index without
+  // samples, so version 1 stays the default until they are all updated.
+  static const uint32_t SERIALIZE_VERSION = 2;
+  static const uint32_t DEFAULT_SERIALIZE_VERSION = 1;
+  std::vector<uint8_t> serialize(
+      uint32_t version = DEFAULT_SERIALIZE_VERSION) const;
 
-  const std::vector<uint64_t> &sample_sizes() const { return sample_sizes_; }
+  // Fixed layout that VideoIndexView reads in place without parsing. Holds
+  // the sample table, sample flags and metadata but not the timestamps.
+  std::vector<uint8_t> serialize_flat() const;
 
-  const std::vector<uint64_t> &sample_offsets() const {
-    return sample_offsets_;
-  }
+  // Switches the sample table to a compact form of about 8 bytes per sample
+  // instead of 24: 32-bit sizes, 32-bit offsets from a 64-bit base offset
+  // per block of samples, and a keyframe bitmap. The vector accessors below
+  // then build their vectors the first time they are called. Returns false
+  // and leaves the index unchanged if the table does not fit the compact
+  // form, which needs samples under 4 GB and sorted keyframe indices.
+  bool compact();
 
-  const std::vector<uint64_t> &keyframe_indices() const {
-    return keyframe_indices_;
-  }
+  bool is_compact() const { return compact_ != nullptr; }
+
+  // Constant time in either form
+  uint64_t sample_offset(uint64_t sample) const;
+  uint64_t sample_size(uint64_t sample) const;
+  bool is_keyframe(uint64_t sample) const;
+  // Last keyframe at or before sample, or the first keyframe if there is
+  // none, without building keyframe_indices
+  uint64_t keyframe_at_or_before(uint64_t sample) const;
+  // First keyframe at or after sample, or frames() if there is none
+  uint64_t keyframe_at_or_after(uint64_t sample) const;
+
+  // Heap bytes held by the sample table, including vectors built from the
+  // compact form
+  size_t sample_table_bytes() const;
+
+  const std::vector<uint64_t> &sample_sizes() const;
+
+  const std::vector<uint64_t> &sample_offsets() const;
+
+  const std::vector<uint64_t> &keyframe_indices() const;
 
   const std::vector<uint8_t>& metadata_bytes() const { return metadata_bytes_; }
 
+  // SampleFlags bits for each sample, or empty if the index was created
+  // without them
+  const std::vector<uint8_t>& sample_flags() const { return sample_flags_; }
+
+  // Sample durations in decode order and the offsets from decode to
+  // presentation time, or empty if the index was created without them
+  const std::vector<SampleRun> &decode_time_runs() const {
+    return decode_time_runs_;
+  }
+  const std::vector<SampleRun> &composition_offset_runs() const {
+    return composition_offset_runs_;
+  }
+
+  bool has_timestamps() const { return !decode_time_runs_.empty(); }
+
+  // Timestamps are in timescale units. Without per sample timestamps all
+  // samples are assumed to have the same duration.
+  int64_t sample_decode_timestamp(uint64_t sample) const;
+  int64_t sample_presentation_timestamp(uint64_t sample) const;
+  // Frames are numbered in presentation order, like the rows passed to
+  // slice_into_video_intervals
+  int64_t frame_timestamp(uint64_t frame) const;
+  // Last frame presented at or before the timestamp
+  uint64_t frame_at_timestamp(int64_t timestamp) const;
+  // Frames presented every interval seconds, starting with the first frame
+  std::vector<uint64_t> frames_at_interval(double interval) const;
+
   uint32_t timescale() const { return timescale_; }
   uint64_t duration() const { return duration_; }
   double fps() const { return num_frames_ / (duration_ / (double)timescale_); }
@@ -62,6 +167,38 @@ class VideoIndex {
   uint64_t num_non_ref_frames() const { return num_non_ref_frames_; }
 
 private:
+  // Run of samples or frames whose timestamps increase by delta starting at
+  // timestamp
+  struct TimestampRun {
+    uint64_t first;
+    int64_t timestamp;
+    int64_t delta;
+  };
+
+  // Samples sharing a base offset in the compact form
+  static const uint64_t COMPACT_BLOCK_SAMPLES = 128;
+
+  struct CompactSampleTable {
+    // Lowest offset of each block of samples
+    std::vector<uint64_t> block_offsets;
+    std::vector<uint32_t> offset_deltas;
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> keyframe_bits;
+  };
+
+  // Vectors built from the compact table on first use. Shared between copies
+  // of the index like the compact table itself.
+  struct ExpandedSampleTable {
+    std::once_flag offsets_once;
+    std::once_flag sizes_once;
+    std::once_flag keyframes_once;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> keyframes;
+  };
+
+  void build_timestamp_lookups();
+
   uint32_t timescale_;
   uint64_t duration_;
   uint32_t frame_width_;
@@ -73,14 +210,45 @@ private:
   std::vector<uint64_t> sample_sizes_;
   std::vector<uint64_t> keyframe_indices_;
   std::vector<uint8_t> metadata_bytes_;
+  std::vector<uint8_t> sample_flags_;
+  std::vector<SampleRun> decode_time_runs_;
+  std::vector<SampleRun> composition_offset_runs_;
+  // Replace sample_offsets_, sample_sizes_ and keyframe_indices_ once
+  // compact() succeeds
+  std::shared_ptr<const CompactSampleTable> compact_;
+  std::shared_ptr<ExpandedSampleTable> expanded_;
+
+  std::vector<TimestampRun> decode_lookup_;
+  std::vector<TimestampRun> composition_lookup_;
+  std::vector<TimestampRun> frame_lookup_;
+};
 
+// Relative costs used to decide how to split requested rows into intervals.
+// Only the ratios between them matter.
+struct IntervalCosts {
+  // Decoding a single frame
+  double decode_frame = 1.0;
+  // Reading a single byte of the video file
+  double read_byte = 1.0 / (256 * 1024);
+  // Starting a new interval: a seek, a separate read and a decoder flush
+  double seek = 8.0;
+  // Matches DecoderAutomata::set_skip_non_ref_frames
+  bool skip_non_ref_frames = true;
 };
 
 struct VideoIntervals {
   std::vector<std::tuple<size_t, size_t>> sample_index_intervals;
   std::vector<std::vector<uint64_t>> valid_frames;
+  // Frames the plan is expected to decode and its total estimated cost
+  uint64_t estimated_frames_decoded = 0;
+  double estimated_cost = 0;
 };
 
-VideoIntervals slice_into_video_intervals(const VideoIndex &index,
-                                          const std::vector<uint64_t> &rows);
+// Splits the sorted rows into intervals of samples that start at a keyframe.
+// Consecutive requested GOPs are decoded in the same interval when decoding
+// and reading the samples between them is estimated to cost less than
+// starting a new interval.
+VideoIntervals slice_into_video_intervals(
+    const VideoIndex &index, const std::vector<uint64_t> &rows,
+    const IntervalCosts &costs = IntervalCosts());
 }
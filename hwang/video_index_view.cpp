@@ -0,0 +1,189 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hwang/video_index_view.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+namespace hwang {
+
+static_assert(sizeof(FlatIndexHeader) == 120,
+              "FlatIndexHeader layout is part of the file format");
+
+namespace {
+
+// Whether count elements of elem_size bytes at pos lie within size bytes
+bool array_fits(uint64_t pos, uint64_t count, uint64_t elem_size,
+                uint64_t size) {
+  return pos <= size && count <= (size - pos) / elem_size;
+}
+
+}
+
+VideoIndexView::~VideoIndexView() { unmap(); }
+
+VideoIndexView::VideoIndexView(VideoIndexView &&other) {
+  *this = std::move(other);
+}
+
+VideoIndexView &VideoIndexView::operator=(VideoIndexView &&other) {
+  if (this != &other) {
+    unmap();
+    map_ = other.map_;
+    map_size_ = other.map_size_;
+    timescale_ = other.timescale_;
+    duration_ = other.duration_;
+    frame_width_ = other.frame_width_;
+    frame_height_ = other.frame_height_;
+    format_ = std::move(other.format_);
+    num_frames_ = other.num_frames_;
+    num_keyframes_ = other.num_keyframes_;
+    num_sample_flags_ = other.num_sample_flags_;
+    metadata_size_ = other.metadata_size_;
+    sample_offsets_ = other.sample_offsets_;
+    sample_sizes_ = other.sample_sizes_;
+    keyframe_indices_ = other.keyframe_indices_;
+    sample_flags_ = other.sample_flags_;
+    metadata_ = other.metadata_;
+    other.map_ = nullptr;
+    other.map_size_ = 0;
+  }
+  return *this;
+}
+
+void VideoIndexView::unmap() {
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+  }
+}
+
+Result VideoIndexView::open(const std::string &path, VideoIndexView &view) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return Result(false, "Could not open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    Result result(false, "Could not stat " + path + ": " + strerror(errno));
+    close(fd);
+    return result;
+  }
+  size_t size = st.st_size;
+  if (size < sizeof(FlatIndexHeader)) {
+    close(fd);
+    return Result(false, path + " is too small to be a flat video index");
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return Result(false, "Could not map " + path + ": " + strerror(errno));
+  }
+
+  VideoIndexView mapped;
+  mapped.map_ = map;
+  mapped.map_size_ = size;
+  Result result = from_buffer((const uint8_t *)map, size, mapped);
+  if (!result.ok) {
+    return Result(false, path + ": " + result.message);
+  }
+  view = std::move(mapped);
+  return Result();
+}
+
+Result VideoIndexView::from_buffer(const uint8_t *data, size_t size,
+                                   VideoIndexView &view) {
+  if ((uintptr_t)data % 8 != 0) {
+    return Result(false, "Flat video index data is not 8 byte aligned");
+  }
+  if (size < sizeof(FlatIndexHeader)) {
+    return Result(false, "Flat video index is too small");
+  }
+  const FlatIndexHeader &header = *(const FlatIndexHeader *)data;
+  if (little_endian_64(header.magic) != FLAT_INDEX_MAGIC) {
+    return Result(false, "Not a flat video index");
+  }
+  uint32_t version = little_endian_32(header.version);
+  if (version != FLAT_INDEX_VERSION) {
+    return Result(false, "Unsupported flat video index version " +
+                             std::to_string(version));
+  }
+
+  uint64_t num_frames = little_endian_64(header.num_frames);
+  uint64_t num_keyframes = little_endian_64(header.num_keyframes);
+  uint64_t num_sample_flags = little_endian_64(header.num_sample_flags);
+  uint64_t metadata_size = little_endian_64(header.metadata_size);
+  uint64_t offsets_pos = little_endian_64(header.sample_offsets_pos);
+  uint64_t sizes_pos = little_endian_64(header.sample_sizes_pos);
+  uint64_t keyframes_pos = little_endian_64(header.keyframe_indices_pos);
+  uint64_t flags_pos = little_endian_64(header.sample_flags_pos);
+  uint64_t metadata_pos = little_endian_64(header.metadata_pos);
+  if ((offsets_pos | sizes_pos | keyframes_pos) % 8 != 0 ||
+      !array_fits(offsets_pos, num_frames, 8, size) ||
+      !array_fits(sizes_pos, num_frames, 8, size) ||
+      !array_fits(keyframes_pos, num_keyframes, 8, size) ||
+      (num_sample_flags != 0 && num_sample_flags != num_frames) ||
+      !array_fits(flags_pos, num_sample_flags, 1, size) ||
+      !array_fits(metadata_pos, metadata_size, 1, size)) {
+    return Result(false, "Corrupt flat video index header");
+  }
+
+  view.timescale_ = little_endian_32(header.timescale);
+  view.duration_ = little_endian_64(header.duration);
+  view.frame_width_ = little_endian_32(header.frame_width);
+  view.frame_height_ = little_endian_32(header.frame_height);
+  view.format_.assign(header.format,
+                      strnlen(header.format, sizeof(header.format)));
+  view.num_frames_ = num_frames;
+  view.num_keyframes_ = num_keyframes;
+  view.num_sample_flags_ = num_sample_flags;
+  view.metadata_size_ = metadata_size;
+  view.sample_offsets_ = (const uint64_t *)(data + offsets_pos);
+  view.sample_sizes_ = (const uint64_t *)(data + sizes_pos);
+  view.keyframe_indices_ = (const uint64_t *)(data + keyframes_pos);
+  view.sample_flags_ = data + flags_pos;
+  view.metadata_ = data + metadata_pos;
+  return Result();
+}
+
+uint64_t VideoIndexView::keyframe_at_or_before(uint64_t sample) const {
+  // Last keyframe index <= sample, or the first keyframe if there is none
+  uint64_t low = 0;
+  uint64_t high = num_keyframes_;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    if (keyframe_index(mid) <= sample) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (num_keyframes_ == 0) {
+    return 0;
+  }
+  return keyframe_index(low > 0 ? low - 1 : 0);
+}
+
+bool VideoIndexView::is_keyframe(uint64_t sample) const {
+  return num_keyframes_ > 0 && keyframe_at_or_before(sample) == sample;
+}
+
+}
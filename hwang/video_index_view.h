@@ -0,0 +1,144 @@
+/* Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "hwang/common.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace hwang {
+
+// "HWIDXFLT" read as a little endian integer
+const uint64_t FLAT_INDEX_MAGIC = 0x544C465844495748ULL;
+const uint32_t FLAT_INDEX_VERSION = 1;
+
+// Start of an index written by VideoIndex::serialize_flat. All fields are
+// little endian. The arrays follow the header, each starting at a multiple
+// of 8 bytes from the start of the data.
+struct FlatIndexHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t timescale;
+  uint32_t frame_width;
+  uint32_t frame_height;
+  uint32_t reserved;
+  // Sample entry type, zero padded
+  char format[8];
+  uint64_t duration;
+  uint64_t num_frames;
+  uint64_t num_keyframes;
+  // 0 or num_frames
+  uint64_t num_sample_flags;
+  uint64_t metadata_size;
+  // Byte positions of the arrays: uint64_t offsets, sizes and keyframe
+  // indices, then uint8_t sample flags and metadata
+  uint64_t sample_offsets_pos;
+  uint64_t sample_sizes_pos;
+  uint64_t keyframe_indices_pos;
+  uint64_t sample_flags_pos;
+  uint64_t metadata_pos;
+};
+
+inline uint64_t little_endian_64(uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return v;
+#else
+  return __builtin_bswap64(v);
+#endif
+}
+
+inline uint32_t little_endian_32(uint32_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return v;
+#else
+  return __builtin_bswap32(v);
+#endif
+}
+
+// Read-only VideoIndex sample table that works on a flat index in place.
+// Opening reads only the header, so a single lookup does not pay for
+// parsing or copying the whole table.
+class VideoIndexView {
+ public:
+  VideoIndexView() {}
+  ~VideoIndexView();
+
+  VideoIndexView(const VideoIndexView &) = delete;
+  VideoIndexView &operator=(const VideoIndexView &) = delete;
+  VideoIndexView(VideoIndexView &&other);
+  VideoIndexView &operator=(VideoIndexView &&other);
+
+  // Maps a flat index file into memory for the lifetime of the view
+  static Result open(const std::string &path, VideoIndexView &view);
+
+  // Views a flat index the caller keeps alive. data must be 8 byte aligned.
+  static Result from_buffer(const uint8_t *data, size_t size,
+                            VideoIndexView &view);
+
+  uint32_t timescale() const { return timescale_; }
+  uint64_t duration() const { return duration_; }
+  double fps() const { return num_frames_ / (duration_ / (double)timescale_); }
+  uint32_t frame_width() const { return frame_width_; }
+  uint32_t frame_height() const { return frame_height_; }
+  const std::string &format() const { return format_; }
+  uint64_t frames() const { return num_frames_; }
+
+  uint64_t sample_offset(uint64_t sample) const {
+    return little_endian_64(sample_offsets_[sample]);
+  }
+  uint64_t sample_size(uint64_t sample) const {
+    return little_endian_64(sample_sizes_[sample]);
+  }
+  // SampleFlags of the sample, 0 if the index has none
+  uint8_t sample_flags(uint64_t sample) const {
+    return sample < num_sample_flags_ ? sample_flags_[sample] : 0;
+  }
+
+  uint64_t num_keyframes() const { return num_keyframes_; }
+  uint64_t keyframe_index(uint64_t i) const {
+    return little_endian_64(keyframe_indices_[i]);
+  }
+  bool is_keyframe(uint64_t sample) const;
+  // The keyframe decoding has to start from to reach sample
+  uint64_t keyframe_at_or_before(uint64_t sample) const;
+
+  const uint8_t *metadata_bytes() const { return metadata_; }
+  size_t metadata_size() const { return metadata_size_; }
+
+ private:
+  void unmap();
+
+  void *map_ = nullptr;
+  size_t map_size_ = 0;
+
+  uint32_t timescale_ = 0;
+  uint64_t duration_ = 0;
+  uint32_t frame_width_ = 0;
+  uint32_t frame_height_ = 0;
+  std::string format_;
+  uint64_t num_frames_ = 0;
+  uint64_t num_keyframes_ = 0;
+  uint64_t num_sample_flags_ = 0;
+  size_t metadata_size_ = 0;
+  const uint64_t *sample_offsets_ = nullptr;
+  const uint64_t *sample_sizes_ = nullptr;
+  const uint64_t *keyframe_indices_ = nullptr;
+  const uint8_t *sample_flags_ = nullptr;
+  const uint8_t *metadata_ = nullptr;
+};
+
+}
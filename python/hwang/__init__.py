@@ -2,12 +2,12 @@ from .video_index import *
 from .decoder import *
 import os
 
-def index_video(f_or_string):
+def index_video(f_or_string, probe_samples=False):
     def w(f):
         f.seek(0, os.SEEK_END)
         size = f.tell()
         f.seek(0, 0)
-        indexer = MP4IndexCreator(size)
+        indexer = MP4IndexCreator(size, probe_samples)
         offset = 0
         size_to_read = 1024
         while not indexer.is_done():
@@ -20,7 +20,10 @@ def index_video(f_or_string):
         return indexer.get_video_index()
 
     if isinstance(f_or_string, str):
-        with open(f_or_string, 'rb') as f:
-            return w(f)
+        index, _ = index_file(f_or_string, probe_samples)
+        return index
+    elif isinstance(f_or_string, (bytes, bytearray, memoryview)):
+        index, _ = index_buffer(f_or_string, probe_samples)
+        return index
     else:
         return w(f_or_string)
@@ -1,5 +1,6 @@
 from ._python import *
 import hwang
+import mmap
 
 
 class Decoder(object):
@@ -7,16 +8,44 @@ class Decoder(object):
                  f_or_path,
                  video_index=None,
                  device_type=DeviceType.CPU,
-                 device_id=0):
+                 device_id=0,
+                 pixel_format=PixelFormat.RGB24,
+                 crop=None,
+                 size=None,
+                 rotation=0,
+                 interpolation=Interpolation.BILINEAR,
+                 quality=DecodeQuality.EXACT,
+                 threading=None):
+        """crop is (x, y, width, height) and size is the (width, height) of
+        the returned frames after rotation, which is clockwise in degrees.
+        Lower quality decodes faster but frames are not bit-exact.
+        threading is a ThreadingPolicy for the software decoder."""
         if video_index is None:
             video_index = hwang.index_video(f_or_path)
         self.video_index = video_index
+        self.pixel_format = pixel_format
+        self.quality = quality
+        self.geometry = FrameGeometry()
+        if crop is not None:
+            (self.geometry.crop_x, self.geometry.crop_y,
+             self.geometry.crop_width, self.geometry.crop_height) = crop
+        if size is not None:
+            self.geometry.width, self.geometry.height = size
+        self.geometry.rotation = rotation
+        self.geometry.interpolation = interpolation
 
         if isinstance(f_or_path, str):
             f = open(f_or_path, 'rb')
         else:
             f = f_or_path
         self.f = f
+        # Map the file when possible so encoded data can be handed to the
+        # decoder without copying it
+        try:
+            self._mmap = memoryview(
+                mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ))
+        except Exception:
+            self._mmap = None
 
         # Setup decoder
         handle = DeviceHandle()
@@ -26,23 +55,35 @@ class Decoder(object):
         if device_type == DeviceType.GPU:
             decoder_type = VideoDecoderType.NVIDIA
         self._decoder = DecoderAutomata(handle, 1, decoder_type)
+        if threading is not None:
+            self._decoder.set_threading_policy(threading)
 
     def retrieve(self, rows):
+        return list(self.retrieve_generator(rows))
+
+    def retrieve_generator(self, rows):
+        """Yields the frames for rows as soon as each one is decoded."""
         # Grab video index intervals
         video_intervals = slice_into_video_intervals(self.video_index, rows)
-        frames = []
-        sample_offsets = self.video_index.sample_offsets()
-        sample_sizes = self.video_index.sample_sizes()
-        sample_offsets.append(sample_offsets[-1] + sample_sizes[-1])
-        sample_sizes.append(0)
+        # Look samples up one at a time so that a compact index does not
+        # have to build its full sample table
+        index = self.video_index
+        num_samples = index.frames()
+
+        def sample_end(i):
+            i = min(i, num_samples - 1)
+            return index.sample_offset(i) + index.sample_size(i)
 
         for (start_index, end_index), valid_frames in video_intervals:
             # Figure out start and end offsets
-            start_offset = sample_offsets[start_index]
-            end_offset = (sample_offsets[end_index] + sample_sizes[end_index])
+            start_offset = index.sample_offset(start_index)
+            end_offset = sample_end(end_index)
             # Read data buffer
-            self.f.seek(start_offset, 0)
-            encoded_data = self.f.read(end_offset - start_offset)
+            if self._mmap is not None:
+                encoded_data = self._mmap[start_offset:end_offset]
+            else:
+                self.f.seek(start_offset, 0)
+                encoded_data = self.f.read(end_offset - start_offset)
 
             data = EncodedData()
             data.width = self.video_index.frame_width()
@@ -51,19 +92,24 @@ class Decoder(object):
             data.start_keyframe = start_index
             data.end_keyframe = end_index
 
-            data.sample_offsets = ([
-                o - start_offset for o in sample_offsets[start_index:end_index]
-            ])
-            data.sample_sizes = (sample_sizes[start_index:end_index])
-            data.valid_frames = valid_frames
-            data.keyframes = [
-                k for k in self.video_index.keyframe_indices()
-                if k >= start_index and k <= end_index
+            data.sample_offsets = [
+                index.sample_offset(i) - start_offset
+                for i in range(start_index, end_index)
             ]
+            data.sample_sizes = [
+                index.sample_size(i) for i in range(start_index, end_index)
+            ]
+            data.valid_frames = valid_frames
+            data.keyframes = []
+            k = index.keyframe_at_or_after(start_index)
+            while k <= end_index and k < num_samples:
+                data.keyframes.append(k)
+                k = index.keyframe_at_or_after(k + 1)
             data.encoded_video = encoded_data
             args = [data]
-            self._decoder.initialize(args, self.video_index.metadata_bytes())
-            frames += self._decoder.get_frames(self.video_index,
-                                               len(valid_frames))
-
-        return frames
+            self._decoder.initialize(args, self.video_index.metadata_bytes(),
+                                     self.pixel_format, self.geometry,
+                                     self.quality)
+            self._decoder.begin_frames(len(valid_frames))
+            for _ in range(len(valid_frames)):
+                yield self._decoder.next_frame(self.video_index)
@@ -7,8 +7,11 @@ def __VideoIndex_from_file(f):
     return VideoIndex.deserialize(f.read())
 
 
-def __VideoIndex_to_file(self, f):
-    f.write(self.serialize())
+def __VideoIndex_to_file(self, f, version=None):
+    if version is None:
+        f.write(self.serialize())
+    else:
+        f.write(self.serialize(version))
 
 
 setattr(VideoIndex, 'from_file', __VideoIndex_from_file)